@@ -43,8 +43,16 @@
 #include "houselog.h"
 #include "houseconfig.h"
 
+#include "housedepot_index.h"
+#include "housedepot_manifest.h"
+#include "housedepot_metrics.h"
 #include "housedepot_revision.h"
 #include "housedepot_repository.h"
+#include "housedepot_notify.h"
+#include "housedepot_retention.h"
+#include "housedepot_cache.h"
+#include "housedepot_uring.h"
+#include "housedepot_worker.h"
 
 static int Debug = 0;
 
@@ -57,11 +65,16 @@ static void housedepot_background (int fd, int mode) {
     static time_t LastCall = 0;
     time_t now = time(0);
 
+    housedepot_notify_background ();
+
     if (now <= LastCall) return;
     LastCall = now;
 
     houseportal_background (now);
     houselog_background (now);
+    housedepot_retention_background (now);
+    housedepot_revision_background ();
+    housedepot_index_background ();
 }
 
 static void housedepot_protect (const char *method, const char *uri) {
@@ -73,6 +86,9 @@ int main (int argc, const char **argv) {
     int i;
     const char *root = "/var/lib/house/depot";
 
+    struct timespec started;
+    clock_gettime (CLOCK_MONOTONIC, &started);
+
     // These strange statements are to make sure that fds 0 to 2 are
     // reserved, since this application might output some errors.
     // 3 descriptors are wasted if 0, 1 and 2 are already open. No big deal.
@@ -102,14 +118,31 @@ int main (int argc, const char **argv) {
             continue;
         }
     }
+    housedepot_worker_initialize (argc, argv);
+    housedepot_uring_initialize (argc, argv);
+    housedepot_cache_initialize (argc, argv);
+    housedepot_manifest_initialize (argc, argv);
+    housedepot_metrics_initialize (argc, argv);
+    housedepot_retention_initialize (argc, argv);
     housedepot_revision_initialize
        (houselog_host(), houseportal_server(), argc, argv);
     housedepot_repository_initialize
        (houselog_host(), houseportal_server(), root);
+    housedepot_notify_initialize (houselog_host(), argc, argv);
+    if (echttp_dynamic_port() && housedepot_notify_listening()) {
+        static const char *path[] = {"depot:/depot/notify"};
+        houseportal_declare_more (housedepot_notify_listening(), path, 1);
+    }
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&housedepot_background);
-    houselog_event ("SERVICE", "depot", "STARTED", "ON %s", houselog_host());
+
+    struct timespec ready;
+    clock_gettime (CLOCK_MONOTONIC, &ready);
+    long long elapsed = ((long long)(ready.tv_sec - started.tv_sec) * 1000)
+                            + ((ready.tv_nsec - started.tv_nsec) / 1000000);
+    houselog_event ("SERVICE", "depot", "STARTED",
+                    "ON %s IN %lld MS", houselog_host(), elapsed);
     echttp_loop();
 }
 
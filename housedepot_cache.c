@@ -0,0 +1,259 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_cache.c - Keep the content of the most used files in memory.
+ *
+ * DESCRIPTION
+ *
+ * Most requests are for the current revision of small configuration files.
+ * This module keeps a copy of the content of these revisions in memory,
+ * so that they can be served without accessing the disk at all.
+ *
+ * The total size of the cached data is limited: when the limit is reached,
+ * the least recently used content is dropped. Only text files are cached,
+ * since a cached content is returned as a string.
+ *
+ * Each entry records which revision it holds: an entry for another revision
+ * than the one requested is never used. The revision module still drops
+ * the entry of a file when its current revision changes or when it is
+ * deleted, and the index drops the entries of a directory that changed
+ * on disk.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_cache_initialize (int argc, const char **argv);
+ *
+ *   Set the size limit of the cache, using the -cache=N option (in bytes,
+ *   default: 1 MB). The cache is disabled if the limit is 0.
+ *
+ * const char *housedepot_cache_get (const char *filename, int revision);
+ *
+ *   Return the cached content of the specified revision, or 0 if not
+ *   cached. The content remains valid until the next call to this module.
+ *
+ * const char *housedepot_cache_put (const char *filename, int revision,
+ *                                   const char *data, int length);
+ *
+ *   Store the content of the specified revision in the cache, if it is
+ *   small enough (HOUSEDEPOT_CACHE_ITEM). Return the cached content, or
+ *   0 if not cached.
+ *
+ * void housedepot_cache_forget (const char *filename);
+ *
+ *   Drop the cached content of the specified file, if any.
+ *
+ * void housedepot_cache_invalidate (const char *path);
+ *
+ *   Drop the cached content of all the files in the specified directory.
+ *   If path is null, the whole cache is dropped.
+ *
+ * long long housedepot_cache_size (void);
+ * long long housedepot_cache_hits (void);
+ * long long housedepot_cache_misses (void);
+ *
+ *   Return statistics about the cache.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <echttp.h>
+
+#include "housedepot_cache.h"
+
+#define CACHEBUCKETS 256
+
+typedef struct housedepot_cache_entry housedepot_cache_entry;
+
+struct housedepot_cache_entry {
+    housedepot_cache_entry *hash;
+    housedepot_cache_entry *newer;
+    housedepot_cache_entry *older;
+    char *filename;
+    int   revision;
+    int   length;
+    char  data[];
+};
+
+static housedepot_cache_entry *CacheTable[CACHEBUCKETS];
+
+static housedepot_cache_entry *housedepot_cache_newest = 0;
+static housedepot_cache_entry *housedepot_cache_oldest = 0;
+
+static long long housedepot_cache_limit = 1024 * 1024;
+static long long housedepot_cache_used = 0;
+
+static long long housedepot_cache_hitcount = 0;
+static long long housedepot_cache_misscount = 0;
+
+void housedepot_cache_initialize (int argc, const char **argv) {
+
+    const char *limit = 0;
+    int i;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-cache=", argv[i], &limit);
+    }
+    if (limit) housedepot_cache_limit = atoll (limit);
+}
+
+static unsigned int housedepot_cache_hash (const char *name) {
+    unsigned int hash = 2166136261u; // FNV-1a.
+    while (*name) {
+        hash ^= (unsigned char)(*(name++));
+        hash *= 16777619u;
+    }
+    return hash % CACHEBUCKETS;
+}
+
+static housedepot_cache_entry *housedepot_cache_search (const char *filename) {
+
+    housedepot_cache_entry *cursor;
+    for (cursor = CacheTable[housedepot_cache_hash (filename)];
+         cursor; cursor = cursor->hash) {
+        if (!strcmp (cursor->filename, filename)) return cursor;
+    }
+    return 0;
+}
+
+static void housedepot_cache_unlink (housedepot_cache_entry *entry) {
+
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        housedepot_cache_newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        housedepot_cache_oldest = entry->newer;
+    entry->newer = entry->older = 0;
+}
+
+static void housedepot_cache_touch (housedepot_cache_entry *entry) {
+
+    if (entry == housedepot_cache_newest) return;
+    housedepot_cache_unlink (entry);
+    entry->older = housedepot_cache_newest;
+    if (housedepot_cache_newest) housedepot_cache_newest->newer = entry;
+    housedepot_cache_newest = entry;
+    if (!housedepot_cache_oldest) housedepot_cache_oldest = entry;
+}
+
+static void housedepot_cache_free (housedepot_cache_entry *entry) {
+
+    housedepot_cache_entry **cursor;
+    for (cursor = CacheTable + housedepot_cache_hash (entry->filename);
+         *cursor; cursor = &((*cursor)->hash)) {
+        if (*cursor == entry) {
+            *cursor = entry->hash;
+            break;
+        }
+    }
+    housedepot_cache_unlink (entry);
+    housedepot_cache_used -= entry->length;
+    free (entry->filename);
+    free (entry);
+}
+
+const char *housedepot_cache_get (const char *filename, int revision) {
+
+    housedepot_cache_entry *entry = housedepot_cache_search (filename);
+    if ((!entry) || (entry->revision != revision)) {
+        housedepot_cache_misscount += 1;
+        return 0;
+    }
+    housedepot_cache_touch (entry);
+    housedepot_cache_hitcount += 1;
+    return entry->data;
+}
+
+const char *housedepot_cache_put (const char *filename, int revision,
+                                  const char *data, int length) {
+
+    housedepot_cache_forget (filename);
+
+    if (housedepot_cache_limit <= 0) return 0;
+    if ((length > HOUSEDEPOT_CACHE_ITEM) ||
+        (length > housedepot_cache_limit)) return 0;
+    if (memchr (data, 0, length)) return 0; // Not text.
+
+    while (housedepot_cache_oldest &&
+           (housedepot_cache_used + length > housedepot_cache_limit)) {
+        housedepot_cache_free (housedepot_cache_oldest);
+    }
+
+    housedepot_cache_entry *entry =
+        malloc (sizeof(housedepot_cache_entry) + length + 1);
+    if (!entry) return 0;
+    entry->filename = strdup (filename);
+    if (!entry->filename) {
+        free (entry);
+        return 0;
+    }
+    entry->revision = revision;
+    entry->length = length;
+    memcpy (entry->data, data, length);
+    entry->data[length] = 0;
+
+    unsigned int h = housedepot_cache_hash (filename);
+    entry->hash = CacheTable[h];
+    CacheTable[h] = entry;
+    entry->newer = entry->older = 0;
+    housedepot_cache_touch (entry);
+    housedepot_cache_used += length;
+    return entry->data;
+}
+
+void housedepot_cache_forget (const char *filename) {
+
+    housedepot_cache_entry *entry = housedepot_cache_search (filename);
+    if (entry) housedepot_cache_free (entry);
+}
+
+void housedepot_cache_invalidate (const char *path) {
+
+    int length = path ? strlen(path) : 0;
+    housedepot_cache_entry *cursor = housedepot_cache_oldest;
+    while (cursor) {
+        housedepot_cache_entry *next = cursor->newer;
+        if (path) {
+            const char *sep = strrchr (cursor->filename, '/');
+            if (sep && (sep - cursor->filename == length) &&
+                (!strncmp (cursor->filename, path, length)))
+                housedepot_cache_free (cursor);
+        } else {
+            housedepot_cache_free (cursor);
+        }
+        cursor = next;
+    }
+}
+
+long long housedepot_cache_size (void) {
+    return housedepot_cache_used;
+}
+
+long long housedepot_cache_hits (void) {
+    return housedepot_cache_hitcount;
+}
+
+long long housedepot_cache_misses (void) {
+    return housedepot_cache_misscount;
+}
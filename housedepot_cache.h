@@ -0,0 +1,19 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_cache.h - Keep the content of the most used files in memory.
+ */
+
+#define HOUSEDEPOT_CACHE_ITEM 65536 // Larger files are not worth caching.
+
+void housedepot_cache_initialize (int argc, const char **argv);
+
+const char *housedepot_cache_get (const char *filename, int revision);
+const char *housedepot_cache_put (const char *filename, int revision,
+                                  const char *data, int length);
+
+void housedepot_cache_forget (const char *filename);
+void housedepot_cache_invalidate (const char *path);
+
+long long housedepot_cache_size (void);
+long long housedepot_cache_hits (void);
+long long housedepot_cache_misses (void);
@@ -0,0 +1,257 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_event.c - The journal of the recent changes, per repository.
+ *
+ * DESCRIPTION
+ *
+ * This module keeps the most recent changes for each repository in memory,
+ * so that clients can be told which file changed.
+ *
+ * Each change is identified by a sequence number that is specific to the
+ * repository and that always increases. The sequence restarts from 0 when
+ * the service is restarted, so the ID given to clients also includes an
+ * epoch, which is the time the service started, in milliseconds: an ID from
+ * a previous run never matches. A client can then tell from its last ID
+ * whether it missed some changes: when a client is too far behind, or
+ * refers to an unknown ID, it must reload the repository.
+ *
+ * Changes made behind the service's back are not known individually: the
+ * repository is then marked as invalidated and a "reset" event is recorded,
+ * so that the clients reload it.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_event_repository (const char *uri, const char *path);
+ *
+ *   Declare a repository, identified by its URI and its local path.
+ *
+ * void housedepot_event_record (const char *filename,
+ *                               const char *clientname,
+ *                               const char *action,
+ *                               int revision, const char *tag);
+ *
+ *   Record one change. The filename is the local path of the file, used
+ *   to find its repository, while the clientname is the path as seen by
+ *   the clients. The revision may be 0 and the tag may be null when not
+ *   applicable.
+ *
+ * void housedepot_event_invalidate (const char *path);
+ * void housedepot_event_reset (void);
+ *
+ *   Mark the repository that contains the specified local path as changed
+ *   on disk, or all repositories if the path is null. The reset function
+ *   then records one "reset" event for each repository marked, so that
+ *   a burst of changes does not flood the journal.
+ *
+ * int housedepot_event_search (const char *uri);
+ *
+ *   Return a handle for the repository with the specified URI, or -1.
+ *
+ * long long housedepot_event_first (int handle);
+ * long long housedepot_event_last (int handle);
+ *
+ *   Return the sequence number of the oldest event still in memory, and
+ *   of the most recent event. When there was no event yet, the last sequence
+ *   number is 0 and the first is one more.
+ *
+ * long long housedepot_event_epoch (void);
+ *
+ *   Return the epoch of this run, which is part of every event ID.
+ *
+ * long long housedepot_event_parse (const char *id);
+ *
+ *   Return the sequence number from an event ID formatted as
+ *   "<epoch>-<sequence>", or -1 if the ID is invalid or belongs to
+ *   another run of the service.
+ *
+ * const housedepot_event *housedepot_event_next (int handle, long long after);
+ *
+ *   Return the event that follows the specified sequence number, or 0 if
+ *   there is none. This also returns 0 when the events that followed were
+ *   lost: the caller must compare with housedepot_event_first() first.
+ *
+ * long long housedepot_event_changes (void);
+ *
+ *   Return a count of all events recorded. This is used to detect when
+ *   new events are available.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "houselog.h"
+
+#include "housedepot_event.h"
+
+#define HOUSEDEPOT_EVENT_MAX     64
+#define HOUSEDEPOT_EVENT_DEPTH  256
+
+static struct {
+    char *uri;
+    char *path;
+    int   length;
+    long long sequence; // The last sequence number used.
+    int invalidated;
+    housedepot_event *ring;
+} housedepot_event_repositories[HOUSEDEPOT_EVENT_MAX];
+
+static int housedepot_event_count = 0;
+
+static long long housedepot_event_origin = 0;
+static long long housedepot_event_total = 0;
+
+void housedepot_event_repository (const char *uri, const char *path) {
+
+    if (housedepot_event_count >= HOUSEDEPOT_EVENT_MAX) {
+        houselog_trace (HOUSE_FAILURE, "EVENT",
+                        "TOO MANY REPOSITORIES, NO EVENTS FOR %s", uri);
+        return;
+    }
+
+    if (!housedepot_event_origin) {
+        struct timeval now;
+        gettimeofday (&now, 0);
+        housedepot_event_origin =
+            ((long long)now.tv_sec * 1000) + (now.tv_usec / 1000);
+    }
+    housedepot_event *ring =
+        calloc (HOUSEDEPOT_EVENT_DEPTH, sizeof(housedepot_event));
+    if (!ring) return;
+
+    int i = housedepot_event_count++;
+    housedepot_event_repositories[i].uri = strdup (uri);
+    housedepot_event_repositories[i].path = strdup (path);
+    housedepot_event_repositories[i].length = strlen(path);
+    housedepot_event_repositories[i].sequence = 0;
+    housedepot_event_repositories[i].invalidated = 0;
+    housedepot_event_repositories[i].ring = ring;
+}
+
+static int housedepot_event_find (const char *filename) {
+    int i;
+    for (i = 0; i < housedepot_event_count; ++i) {
+        int length = housedepot_event_repositories[i].length;
+        if ((!strncmp (filename, housedepot_event_repositories[i].path, length))
+            && ((filename[length] == '/') || (filename[length] == 0)))
+            return i;
+    }
+    return -1;
+}
+
+static void housedepot_event_add (int i, const char *clientname,
+                                  const char *action,
+                                  int revision, const char *tag) {
+
+    long long sequence = ++(housedepot_event_repositories[i].sequence);
+    housedepot_event *event = housedepot_event_repositories[i].ring
+                                  + (sequence % HOUSEDEPOT_EVENT_DEPTH);
+    event->sequence = sequence;
+    event->time = time(0);
+    event->action = action;
+    event->revision = revision;
+    snprintf (event->file, sizeof(event->file), "%s", clientname);
+    snprintf (event->tag, sizeof(event->tag), "%s", tag ? tag : "");
+    housedepot_event_total += 1;
+}
+
+void housedepot_event_record (const char *filename,
+                              const char *clientname,
+                              const char *action,
+                              int revision, const char *tag) {
+    int i = housedepot_event_find (filename);
+    if (i < 0) return;
+    housedepot_event_add (i, clientname, action, revision, tag);
+}
+
+void housedepot_event_invalidate (const char *path) {
+    int i;
+    if (!path) {
+        for (i = 0; i < housedepot_event_count; ++i)
+            housedepot_event_repositories[i].invalidated = 1;
+        return;
+    }
+    i = housedepot_event_find (path);
+    if (i >= 0) housedepot_event_repositories[i].invalidated = 1;
+}
+
+void housedepot_event_reset (void) {
+    int i;
+    for (i = 0; i < housedepot_event_count; ++i) {
+        if (!housedepot_event_repositories[i].invalidated) continue;
+        housedepot_event_repositories[i].invalidated = 0;
+        housedepot_event_add (i, housedepot_event_repositories[i].uri,
+                              "reset", 0, 0);
+    }
+}
+
+int housedepot_event_search (const char *uri) {
+    int i;
+    for (i = 0; i < housedepot_event_count; ++i) {
+        if (!strcmp (housedepot_event_repositories[i].uri, uri)) return i;
+    }
+    return -1;
+}
+
+long long housedepot_event_last (int handle) {
+    if ((handle < 0) || (handle >= housedepot_event_count)) return 0;
+    return housedepot_event_repositories[handle].sequence;
+}
+
+long long housedepot_event_first (int handle) {
+    if ((handle < 0) || (handle >= housedepot_event_count)) return 0;
+    long long first = housedepot_event_repositories[handle].sequence
+                          - HOUSEDEPOT_EVENT_DEPTH + 1;
+    if (first < 1) first = 1;
+    return first;
+}
+
+long long housedepot_event_epoch (void) {
+    return housedepot_event_origin;
+}
+
+long long housedepot_event_parse (const char *id) {
+    if (!id) return -1;
+    char *end;
+    long long epoch = strtoll (id, &end, 10);
+    if ((epoch != housedepot_event_origin) || (*end != '-')) return -1;
+    long long sequence = strtoll (end + 1, &end, 10);
+    if ((*end != 0) || (sequence < 0)) return -1;
+    return sequence;
+}
+
+const housedepot_event *housedepot_event_next (int handle, long long after) {
+
+    if ((handle < 0) || (handle >= housedepot_event_count)) return 0;
+    if (after >= housedepot_event_repositories[handle].sequence) return 0;
+    if (after + 1 < housedepot_event_first (handle)) return 0; // Lost.
+
+    after += 1;
+    return housedepot_event_repositories[handle].ring
+               + (after % HOUSEDEPOT_EVENT_DEPTH);
+}
+
+long long housedepot_event_changes (void) {
+    return housedepot_event_total;
+}
@@ -0,0 +1,35 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_event.h - The journal of the recent changes, per repository.
+ */
+
+typedef struct {
+    long long sequence;
+    time_t time;
+    const char *action;
+    int revision;
+    char file[256];
+    char tag[64];
+} housedepot_event;
+
+void housedepot_event_repository (const char *uri, const char *path);
+
+void housedepot_event_record (const char *filename,
+                              const char *clientname,
+                              const char *action,
+                              int revision, const char *tag);
+
+void housedepot_event_invalidate (const char *path);
+void housedepot_event_reset (void);
+
+int housedepot_event_search (const char *uri);
+
+long long housedepot_event_first (int handle);
+long long housedepot_event_last (int handle);
+
+long long housedepot_event_epoch (void);
+long long housedepot_event_parse (const char *id);
+
+const housedepot_event *housedepot_event_next (int handle, long long after);
+
+long long housedepot_event_changes (void);
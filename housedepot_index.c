@@ -0,0 +1,930 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_index.c - A resident index of the file revisions and tags.
+ *
+ * DESCRIPTION
+ *
+ * This module keeps in memory what the revision module would otherwise
+ * learn from the disk on every request: the list of revisions of each
+ * file (with size and modification time) and the revision that each tag
+ * points to, including the predefined latest and current tags.
+ *
+ * The index is loaded one directory at a time, on first access, using
+ * a single directory scan. After that the revision module keeps it up to
+ * date as it modifies the files and links on disk.
+ *
+ * The index also records the subdirectories (groups) of each directory,
+ * so that a repository listing is a walk through memory.
+ *
+ * Files are identified by their local storage path, without any revision
+ * or tag suffix.
+ *
+ * Each directory is kept open once it was accessed, so that the revision
+ * files and links can be accessed relative to it, using the *at() system
+ * calls. This avoids having the kernel walk the whole path again on every
+ * file operation.
+ *
+ * When available, the index of a directory is loaded from the manifest
+ * saved in that directory instead (see housedepot_manifest.c). Every change
+ * to the index is then recorded in the manifest.
+ *
+ * SYNOPSYS
+ *
+ * housedepot_index_directory *housedepot_index_directory_get
+ *                                 (const char *path);
+ *
+ *   Return the index of the specified directory, loading it if needed.
+ *   Return 0 if there is no such directory.
+ *
+ * int housedepot_index_fd (housedepot_index_directory *dir);
+ *
+ *   Return an open file descriptor for the specified directory, or -1 if
+ *   the directory cannot be opened. The descriptor remains owned by the
+ *   index and must not be closed.
+ *
+ * int housedepot_index_open (const char *path);
+ *
+ *   Return an open file descriptor for the specified directory path, or -1.
+ *   The directory's index is not loaded.
+ *
+ * int housedepot_index_at (const char *path, const char **name);
+ *
+ *   Return an open file descriptor for the directory that contains the
+ *   specified path, and set name to the path relative to that directory.
+ *   Return -1 if the directory cannot be opened. A directory that does
+ *   not exist is not added to the index.
+ *
+ * housedepot_index_file *housedepot_index_get (const char *filename,
+ *                                              int create);
+ *
+ *   Return the index entry for the specified file. If the file is not
+ *   known, return 0, or a new (empty) entry if create is not 0.
+ *
+ * int housedepot_index_resolve (const housedepot_index_file *file,
+ *                               const char *tag);
+ *
+ *   Return the revision number matching the revision number or tag name,
+ *   or 0 if there is no such revision.
+ *
+ * housedepot_index_revision *housedepot_index_find
+ *                               (housedepot_index_file *file, int revision);
+ *
+ *   Return the index item for the specified revision, or 0 if not found.
+ *
+ * void housedepot_index_add (housedepot_index_file *file,
+ *                            int revision, long long size, time_t time);
+ *
+ * void housedepot_index_remove (housedepot_index_file *file, int revision);
+ *
+ *   Add (or update) and remove one revision of the file.
+ *
+ * int housedepot_index_prune (housedepot_index_file *file,
+ *                             int oldest, int keep);
+ *
+ *   Remove all the revisions up to the oldest one specified, except the
+ *   revision to keep, and the tags that point to them, in one pass. Return
+ *   the number of revisions removed.
+ *
+ * void housedepot_index_tag_set (housedepot_index_file *file,
+ *                                const char *tag, int revision);
+ *
+ * void housedepot_index_tag_remove (housedepot_index_file *file,
+ *                                   const char *tag);
+ *
+ *   Assign or remove a tag.
+ *
+ * void housedepot_index_forget (const char *filename);
+ *
+ *   Remove all knowledge of the specified file, including its cached
+ *   content (see housedepot_cache.c).
+ *
+ * int housedepot_index_verify (const char *path, const char *name);
+ *
+ *   Check the index against the disk for one entry of the specified
+ *   directory, typically after being told that this entry changed. If the
+ *   index does not match, the whole directory is invalidated and will be
+ *   loaded again on next access. Return 1 if the directory was invalidated,
+ *   0 if the index was up to date (or if nothing was cached).
+ *
+ * int housedepot_index_known (const char *path);
+ *
+ *   Return 1 if the specified directory is in the index, e.g. because it
+ *   was created or accessed through this service, 0 otherwise.
+ *
+ * void housedepot_index_invalidate (const char *path);
+ *
+ *   Forget everything about the specified directory, including its open
+ *   file descriptor and the cached content of its files. If path is null,
+ *   all directories are invalidated. A directory that no longer exists
+ *   is removed from the index.
+ *
+ * void housedepot_index_background (void);
+ *
+ *   Save the changes to the manifests, when no storage job is pending.
+ *   This must be called periodically.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "housedepot_cache.h"
+#include "housedepot_index.h"
+#include "housedepot_manifest.h"
+#include "housedepot_metrics.h"
+#include "housedepot_worker.h"
+
+#define FRM '~'
+
+#define INDEXBUCKETS 1024
+
+static housedepot_index_file *FileTable[INDEXBUCKETS];
+static housedepot_index_directory *DirectoryTable[INDEXBUCKETS];
+
+// Do not record the changes made while loading or resetting the index.
+static int housedepot_index_replaying = 0;
+
+static unsigned int housedepot_index_hash (const char *name, int length) {
+    unsigned int hash = 2166136261u; // FNV-1a.
+    while (length-- > 0) {
+        hash ^= (unsigned char)(*(name++));
+        hash *= 16777619u;
+    }
+    return hash % INDEXBUCKETS;
+}
+
+static housedepot_index_directory *housedepot_index_directory_search
+                                       (const char *path, int length) {
+
+    unsigned int h = housedepot_index_hash (path, length);
+    housedepot_index_directory *cursor;
+
+    for (cursor = DirectoryTable[h]; cursor; cursor = cursor->hash) {
+        if ((!strncmp (cursor->path, path, length)) && (!cursor->path[length]))
+            return cursor;
+    }
+    return 0;
+}
+
+static void housedepot_index_directory_attach
+                (housedepot_index_directory *parent,
+                 housedepot_index_directory *child) {
+
+    if (child->parent) return; // Already attached.
+
+    housedepot_index_directory **cursor;
+    for (cursor = &(parent->children); *cursor; cursor = &((*cursor)->sibling)) {
+        if (strcmp ((*cursor)->name, child->name) > 0) break;
+    }
+    child->sibling = *cursor;
+    *cursor = child;
+    child->parent = parent;
+
+    if (parent->loaded && (!housedepot_index_replaying))
+        housedepot_manifest_changed (parent);
+}
+
+static housedepot_index_directory *housedepot_index_directory_new
+                                       (const char *path, int length) {
+
+    housedepot_index_directory *dir =
+        housedepot_index_directory_search (path, length);
+    if (dir) return dir;
+
+    dir = calloc (1, sizeof(housedepot_index_directory));
+    if (!dir) return 0;
+    dir->fd = -1;
+    dir->manifest = -1;
+    dir->path = strndup (path, length);
+    if (!dir->path) {
+        free (dir);
+        return 0;
+    }
+    const char *sep = strrchr (dir->path, '/');
+    dir->name = sep ? sep + 1 : dir->path;
+
+    unsigned int h = housedepot_index_hash (path, length);
+    dir->hash = DirectoryTable[h];
+    DirectoryTable[h] = dir;
+
+    // Link to the parent directory, if known. (If not known, the link will
+    // be created when the parent directory is loaded.)
+    //
+    if (sep) {
+        housedepot_index_directory *parent =
+            housedepot_index_directory_search (dir->path, (int)(sep - dir->path));
+        if (parent) housedepot_index_directory_attach (parent, dir);
+    }
+    return dir;
+}
+
+static void housedepot_index_directory_free (housedepot_index_directory *dir) {
+
+    housedepot_index_directory **cursor;
+    unsigned int h = housedepot_index_hash (dir->path, strlen(dir->path));
+    for (cursor = DirectoryTable + h; *cursor; cursor = &((*cursor)->hash)) {
+        if (*cursor == dir) {
+            *cursor = dir->hash;
+            break;
+        }
+    }
+    if (dir->parent) {
+        for (cursor = &(dir->parent->children);
+             *cursor; cursor = &((*cursor)->sibling)) {
+            if (*cursor == dir) {
+                *cursor = dir->sibling;
+                break;
+            }
+        }
+    }
+    if (dir->fd >= 0) close (dir->fd);
+    if (dir->manifest >= 0) close (dir->manifest);
+    free (dir->path);
+    free (dir);
+}
+
+static housedepot_index_file *housedepot_index_search (const char *filename,
+                                                       int length) {
+
+    unsigned int h = housedepot_index_hash (filename, length);
+    housedepot_index_file *cursor;
+
+    for (cursor = FileTable[h]; cursor; cursor = cursor->hash) {
+        if ((!strncmp (cursor->filename, filename, length)) &&
+            (!cursor->filename[length])) return cursor;
+    }
+    return 0;
+}
+
+static housedepot_index_file *housedepot_index_new
+                                  (housedepot_index_directory *parent,
+                                   const char *name, int length) {
+
+    housedepot_index_file *file = calloc (1, sizeof(housedepot_index_file));
+    if (!file) return 0;
+
+    int dirlength = strlen(parent->path);
+    file->filename = malloc (dirlength + length + 2);
+    if (!file->filename) {
+        free (file);
+        return 0;
+    }
+    memcpy (file->filename, parent->path, dirlength);
+    file->filename[dirlength] = '/';
+    memcpy (file->filename+dirlength+1, name, length);
+    file->filename[dirlength+length+1] = 0;
+    file->basename = file->filename + dirlength + 1;
+
+    unsigned int h =
+        housedepot_index_hash (file->filename, dirlength + length + 1);
+    file->hash = FileTable[h];
+    FileTable[h] = file;
+
+    file->parent = parent;
+    file->next = parent->files;
+    parent->files = file;
+    return file;
+}
+
+static void housedepot_index_append (housedepot_index_file *file,
+                                     int revision, long long size, time_t time) {
+
+    if (file->count >= file->size) {
+        int size = file->size ? file->size * 2 : 16;
+        housedepot_index_revision *revisions =
+            realloc (file->revisions, size * sizeof(housedepot_index_revision));
+        if (!revisions) return;
+        file->revisions = revisions;
+        file->size = size;
+    }
+    housedepot_index_revision *item = file->revisions + (file->count++);
+    item->revision = revision;
+    item->size = size;
+    item->time = time;
+}
+
+static int housedepot_index_compare (const void *a, const void *b) {
+    return ((const housedepot_index_revision *)a)->revision
+               - ((const housedepot_index_revision *)b)->revision;
+}
+
+static void housedepot_index_replay (housedepot_index_directory *dir,
+                                     int type,
+                                     const char *name, const char *tag,
+                                     int revision, int keep,
+                                     long long size, time_t time) {
+
+    char path[1024];
+    int length = snprintf (path, sizeof(path), "%s/%s", dir->path, name);
+    if (length >= sizeof(path)) return;
+
+    if (type == HOUSEDEPOT_MANIFEST_GROUP) {
+        housedepot_index_directory *child =
+            housedepot_index_directory_new (path, length);
+        if (child) housedepot_index_directory_attach (dir, child);
+        return;
+    }
+    housedepot_index_file *file = housedepot_index_search (path, length);
+    if (type == HOUSEDEPOT_MANIFEST_FORGET) {
+        if (file) housedepot_index_forget (path);
+        return;
+    }
+    if (!file) file = housedepot_index_new (dir, name, strlen(name));
+    if (!file) return;
+
+    switch (type) {
+    case HOUSEDEPOT_MANIFEST_REVISION:
+        housedepot_index_add (file, revision, size, time);
+        break;
+    case HOUSEDEPOT_MANIFEST_REMOVE:
+        housedepot_index_remove (file, revision);
+        break;
+    case HOUSEDEPOT_MANIFEST_PRUNE:
+        housedepot_index_prune (file, revision, keep);
+        break;
+    case HOUSEDEPOT_MANIFEST_TAG:
+        housedepot_index_tag_set (file, tag, revision);
+        break;
+    case HOUSEDEPOT_MANIFEST_UNTAG:
+        housedepot_index_tag_remove (file, tag);
+        break;
+    }
+}
+
+static int housedepot_index_scan (housedepot_index_directory *dir) {
+
+    DIR *d = opendir (dir->path);
+    if (!d) return -1;
+    int dfd = dirfd (d);
+    housedepot_metrics_count (HOUSEDEPOT_METRICS_SCAN, 1);
+
+    struct dirent *ent;
+    while ((ent = readdir (d))) {
+        if (ent->d_name[0] == '.') continue; // Skip hidden entries.
+
+        // Some file systems do not report the entry type.
+        int type = ent->d_type;
+        struct stat fs;
+        int known = 0;
+        if (type == DT_UNKNOWN) {
+            if (fstatat (dfd, ent->d_name, &fs, AT_SYMLINK_NOFOLLOW)) continue;
+            if (S_ISDIR(fs.st_mode)) type = DT_DIR;
+            else if (S_ISLNK(fs.st_mode)) type = DT_LNK;
+            else if (S_ISREG(fs.st_mode)) type = DT_REG;
+            known = 1;
+        }
+
+        if (type == DT_DIR) {
+            char path[1024];
+            int length = snprintf (path, sizeof(path),
+                                   "%s/%s", dir->path, ent->d_name);
+            if (length >= sizeof(path)) continue;
+            housedepot_index_directory *child =
+                housedepot_index_directory_new (path, length);
+            if (child) housedepot_index_directory_attach (dir, child);
+            continue;
+        }
+        const char *sep = strrchr (ent->d_name, FRM);
+        if (!sep) continue; // Not a revision or tag.
+        int length = (int)(sep - ent->d_name);
+        if (length <= 0) continue;
+        sep += 1;
+
+        if ((type == DT_REG) && (!known)) {
+            if (fstatat (dfd, ent->d_name, &fs, AT_SYMLINK_NOFOLLOW)) continue;
+        }
+
+        housedepot_index_file *file;
+        char key[1024];
+        int keylength = snprintf (key, sizeof(key),
+                                  "%s/%.*s", dir->path, length, ent->d_name);
+        if (keylength >= sizeof(key)) continue;
+        file = housedepot_index_search (key, keylength);
+        if (!file) file = housedepot_index_new (dir, ent->d_name, length);
+        if (!file) continue;
+
+        if (type == DT_REG) {
+            if (!isdigit(sep[0])) continue;
+            housedepot_index_append (file, atoi(sep),
+                                     (long long)(fs.st_size), fs.st_mtime);
+        } else if (type == DT_LNK) {
+            if (isdigit(sep[0])) continue;
+            char target[1024];
+            int pathsz = readlinkat (dfd, ent->d_name, target, sizeof(target)-1);
+            if (pathsz <= 0) continue;
+            target[pathsz] = 0;
+            const char *rev = strrchr (target, FRM);
+            if ((!rev) || (!isdigit(rev[1]))) continue;
+            housedepot_index_tag_set (file, sep, atoi(rev+1));
+        }
+    }
+    closedir (d);
+
+    housedepot_index_file *file;
+    for (file = dir->files; file; file = file->next) {
+        if (file->count > 1)
+            qsort (file->revisions, file->count,
+                   sizeof(housedepot_index_revision), housedepot_index_compare);
+    }
+    housedepot_manifest_changed (dir); // Save what was learnt.
+    return 0;
+}
+
+// The manifest only tells that the directory itself did not change: a
+// revision file rewritten in place changes its own time or size, not the
+// directory's. This uses the same rules as housedepot_index_verify().
+//
+static int housedepot_index_match (housedepot_index_directory *dir) {
+
+    int fd = housedepot_index_fd (dir);
+    if (fd < 0) return 0;
+
+    housedepot_index_file *file;
+    for (file = dir->files; file; file = file->next) {
+        int i;
+        for (i = 0; i < file->count; ++i) {
+            housedepot_index_revision *item = file->revisions + i;
+            char name[1024];
+            struct stat fs;
+            snprintf (name, sizeof(name),
+                      "%s%c%d", file->basename, FRM, item->revision);
+            if (fstatat (fd, name, &fs, AT_SYMLINK_NOFOLLOW)) return 0;
+            if (!S_ISREG(fs.st_mode)) return 0;
+            if ((item->time != fs.st_mtime) && (fs.st_nlink <= 1)) return 0;
+            if ((item->revision != file->current) &&
+                (item->revision != file->latest)) continue;
+            if (item->size != fs.st_size) return 0;
+        }
+    }
+    return 1;
+}
+
+static int housedepot_index_load (housedepot_index_directory *dir) {
+
+    dir->loaded = 1; // Even if it fails: do not retry on every request.
+
+    housedepot_index_replaying = 1;
+    int status = 0;
+    if (housedepot_manifest_load (dir, housedepot_index_replay)) {
+        status = housedepot_index_scan (dir);
+    } else if (!housedepot_index_match (dir)) {
+        while (dir->files) housedepot_index_forget (dir->files->filename);
+        housedepot_manifest_discard (dir);
+        status = housedepot_index_scan (dir);
+    } else {
+        housedepot_metrics_count (HOUSEDEPOT_METRICS_MANIFEST, 1);
+    }
+    housedepot_index_replaying = 0;
+    return status;
+}
+
+housedepot_index_directory *housedepot_index_directory_get (const char *path) {
+
+    int length = strlen(path);
+    housedepot_index_directory *dir =
+        housedepot_index_directory_search (path, length);
+    if (dir) {
+        if (!dir->loaded) housedepot_index_load (dir);
+        return dir;
+    }
+    dir = housedepot_index_directory_new (path, length);
+    if (!dir) return 0;
+    if (housedepot_index_load (dir)) {
+        // Do not keep track of directories that do not exist.
+        housedepot_index_directory_free (dir);
+        return 0;
+    }
+    return dir;
+}
+
+int housedepot_index_fd (housedepot_index_directory *dir) {
+
+    if (!dir) return -1;
+    if (dir->fd < 0) dir->fd = open (dir->path, O_RDONLY|O_DIRECTORY);
+    return dir->fd;
+}
+
+// Return the entry for an existing directory. A new entry is created only
+// if the directory can be opened: a request for a path that does not exist
+// must not leave behind an entry that would never be freed.
+//
+static housedepot_index_directory *housedepot_index_directory_open
+                                       (const char *path, int length) {
+
+    housedepot_index_directory *dir =
+        housedepot_index_directory_search (path, length);
+    if (dir) return dir;
+
+    char buffer[1024];
+    if (length >= sizeof(buffer)) return 0;
+    memcpy (buffer, path, length);
+    buffer[length] = 0;
+    int fd = open (buffer, O_RDONLY|O_DIRECTORY);
+    if (fd < 0) return 0;
+
+    dir = housedepot_index_directory_new (path, length);
+    if (!dir) {
+        close (fd);
+        return 0;
+    }
+    dir->fd = fd;
+    return dir;
+}
+
+int housedepot_index_open (const char *path) {
+    return housedepot_index_fd
+               (housedepot_index_directory_open (path, strlen(path)));
+}
+
+int housedepot_index_at (const char *path, const char **name) {
+
+    const char *sep = strrchr (path, '/');
+    if (!sep) return -1;
+    *name = sep + 1;
+    return housedepot_index_fd
+               (housedepot_index_directory_open (path, (int)(sep - path)));
+}
+
+housedepot_index_file *housedepot_index_get (const char *filename, int create) {
+
+    int length = strlen(filename);
+    housedepot_index_file *file = housedepot_index_search (filename, length);
+    if (file) return file;
+
+    const char *sep = strrchr (filename, '/');
+    if (!sep) return 0;
+
+    housedepot_index_directory *dir =
+        housedepot_index_directory_open (filename, (int)(sep - filename));
+    if (!dir) return 0;
+    if (!dir->loaded) {
+        housedepot_index_load (dir);
+        file = housedepot_index_search (filename, length);
+        if (file) return file;
+    }
+    if (!create) return 0;
+    return housedepot_index_new (dir, sep+1, strlen(sep+1));
+}
+
+housedepot_index_revision *housedepot_index_find (housedepot_index_file *file,
+                                                  int revision) {
+    if (!file) return 0;
+
+    int low = 0;
+    int high = file->count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        housedepot_index_revision *item = file->revisions + middle;
+        if (item->revision == revision) return item;
+        if (item->revision < revision) low = middle + 1;
+        else high = middle - 1;
+    }
+    return 0;
+}
+
+int housedepot_index_resolve (const housedepot_index_file *file,
+                              const char *tag) {
+
+    if (!file) return 0;
+    if (!tag) tag = "current";
+
+    int revision = 0;
+    if (isdigit(tag[0])) {
+        const char *cursor;
+        for (cursor = tag; *cursor; ++cursor) {
+            if (!isdigit(*cursor)) return 0;
+        }
+        revision = atoi (tag);
+    } else if (!strcmp (tag, "current")) {
+        revision = file->current;
+    } else if (!strcmp (tag, "latest")) {
+        revision = file->latest;
+    } else {
+        int i;
+        for (i = 0; i < file->tagcount; ++i) {
+            if (!strcmp (file->tags[i].name, tag)) {
+                revision = file->tags[i].revision;
+                break;
+            }
+        }
+    }
+    if (revision <= 0) return 0;
+    if (!housedepot_index_find ((housedepot_index_file *)file, revision))
+        return 0; // Dangling tag.
+    return revision;
+}
+
+void housedepot_index_add (housedepot_index_file *file,
+                           int revision, long long size, time_t time) {
+
+    if (!file) return;
+
+    if (!housedepot_index_replaying)
+        housedepot_manifest_record (file, HOUSEDEPOT_MANIFEST_REVISION,
+                                    0, revision, 0, size, time);
+
+    housedepot_index_revision *item = housedepot_index_find (file, revision);
+    if (item) {
+        item->size = size;
+        item->time = time;
+        return;
+    }
+    housedepot_index_append (file, revision, size, time);
+    int i = file->count - 1;
+    while ((i > 0) && (file->revisions[i-1].revision > revision)) {
+        housedepot_index_revision swap = file->revisions[i-1];
+        file->revisions[i-1] = file->revisions[i];
+        file->revisions[i] = swap;
+        i -= 1;
+    }
+}
+
+void housedepot_index_remove (housedepot_index_file *file, int revision) {
+
+    housedepot_index_revision *item = housedepot_index_find (file, revision);
+    if (!item) return;
+
+    if (!housedepot_index_replaying)
+        housedepot_manifest_record (file, HOUSEDEPOT_MANIFEST_REMOVE,
+                                    0, revision, 0, 0, 0);
+
+    int i = (int)(item - file->revisions);
+    file->count -= 1;
+    if (i < file->count)
+        memmove (item, item+1,
+                 (file->count - i) * sizeof(housedepot_index_revision));
+}
+
+int housedepot_index_prune (housedepot_index_file *file,
+                            int oldest, int keep) {
+
+    if (!file) return 0;
+
+    if (!housedepot_index_replaying)
+        housedepot_manifest_record (file, HOUSEDEPOT_MANIFEST_PRUNE,
+                                    0, oldest, keep, 0, 0);
+
+    int i;
+    int kept = 0;
+    for (i = 0; i < file->count; ++i) {
+        int revision = file->revisions[i].revision;
+        if ((revision > oldest) || (revision == keep))
+            file->revisions[kept++] = file->revisions[i];
+    }
+    int removed = file->count - kept;
+    file->count = kept;
+
+    kept = 0;
+    for (i = 0; i < file->tagcount; ++i) {
+        int revision = file->tags[i].revision;
+        if ((revision > oldest) || (revision == keep))
+            file->tags[kept++] = file->tags[i];
+        else
+            free (file->tags[i].name);
+    }
+    file->tagcount = kept;
+    return removed;
+}
+
+void housedepot_index_tag_set (housedepot_index_file *file,
+                               const char *tag, int revision) {
+
+    if (!file) return;
+
+    if (!housedepot_index_replaying)
+        housedepot_manifest_record (file, HOUSEDEPOT_MANIFEST_TAG,
+                                    tag, revision, 0, 0, 0);
+
+    if (!strcmp (tag, "current")) file->current = revision;
+    else if (!strcmp (tag, "latest")) file->latest = revision;
+
+    int i;
+    for (i = 0; i < file->tagcount; ++i) {
+        int delta = strcmp (file->tags[i].name, tag);
+        if (delta == 0) {
+            file->tags[i].revision = revision;
+            return;
+        }
+        if (delta > 0) break; // Insert here to keep the tags ordered.
+    }
+    if (file->tagcount >= file->tagsize) {
+        int size = file->tagsize ? file->tagsize * 2 : 4;
+        housedepot_index_tag *tags =
+            realloc (file->tags, size * sizeof(housedepot_index_tag));
+        if (!tags) return;
+        file->tags = tags;
+        file->tagsize = size;
+    }
+    if (i < file->tagcount)
+        memmove (file->tags+i+1, file->tags+i,
+                 (file->tagcount - i) * sizeof(housedepot_index_tag));
+    file->tags[i].name = strdup (tag);
+    file->tags[i].revision = revision;
+    file->tagcount += 1;
+}
+
+void housedepot_index_tag_remove (housedepot_index_file *file, const char *tag) {
+
+    if (!file) return;
+
+    if (!housedepot_index_replaying)
+        housedepot_manifest_record (file, HOUSEDEPOT_MANIFEST_UNTAG,
+                                    tag, 0, 0, 0, 0);
+
+    if (!strcmp (tag, "current")) file->current = 0;
+    else if (!strcmp (tag, "latest")) file->latest = 0;
+
+    int i;
+    for (i = 0; i < file->tagcount; ++i) {
+        if (!strcmp (file->tags[i].name, tag)) {
+            free (file->tags[i].name);
+            file->tagcount -= 1;
+            if (i < file->tagcount)
+                memmove (file->tags+i, file->tags+i+1,
+                         (file->tagcount - i) * sizeof(housedepot_index_tag));
+            return;
+        }
+    }
+}
+
+static void housedepot_index_reset (housedepot_index_directory *dir) {
+
+    housedepot_index_replaying = 1;
+    while (dir->files) housedepot_index_forget (dir->files->filename);
+    housedepot_index_replaying = 0;
+    housedepot_cache_invalidate (dir->path);
+    housedepot_manifest_discard (dir); // It did not match either.
+    dir->loaded = 0;
+    if (dir->fd >= 0) {
+        close (dir->fd);
+        dir->fd = -1;
+    }
+}
+
+void housedepot_index_invalidate (const char *path) {
+
+    if (path) {
+        housedepot_index_directory *dir =
+            housedepot_index_directory_search (path, strlen(path));
+        if (!dir) return;
+        housedepot_index_reset (dir);
+        if ((!dir->children) && (access (dir->path, F_OK) < 0)) {
+            if (dir->parent && dir->parent->loaded)
+                housedepot_manifest_changed (dir->parent);
+            housedepot_index_directory_free (dir);
+        }
+        return;
+    }
+    int i;
+    for (i = 0; i < INDEXBUCKETS; ++i) {
+        housedepot_index_directory *dir;
+        for (dir = DirectoryTable[i]; dir; dir = dir->hash)
+            housedepot_index_reset (dir);
+    }
+}
+
+int housedepot_index_known (const char *path) {
+    return housedepot_index_directory_search (path, strlen(path)) != 0;
+}
+
+int housedepot_index_verify (const char *path, const char *name) {
+
+    housedepot_index_directory *dir =
+        housedepot_index_directory_search (path, strlen(path));
+    if ((!dir) || (!dir->loaded)) return 0; // Nothing was cached.
+
+    if (name[0] == '.') return 0; // Hidden or temporary entry.
+    const char *sep = strrchr (name, FRM);
+    if (!sep) return 0; // Default link, same as the current tag.
+    int length = (int)(sep - name);
+    if (length <= 0) return 0;
+    sep += 1;
+
+    char key[1024];
+    int keylength = snprintf (key, sizeof(key), "%s/%.*s", path, length, name);
+    if (keylength >= sizeof(key)) return 0;
+    housedepot_index_file *file = housedepot_index_search (key, keylength);
+
+    struct stat fs;
+    int fd = housedepot_index_fd (dir);
+    int exists = (fd >= 0) &&
+                 (fstatat (fd, name, &fs, AT_SYMLINK_NOFOLLOW) == 0);
+
+    if (isdigit(sep[0])) {
+        int revision = atoi(sep);
+        housedepot_index_revision *item = housedepot_index_find (file, revision);
+        if ((!exists) || (!S_ISREG(fs.st_mode))) {
+            if (!item) return 0;
+        } else if (item && ((item->time == fs.st_mtime) || (fs.st_nlink > 1))) {
+            // The time of a shared blob is not the time of this revision.
+            // Only the current and latest revisions are always stored
+            // in full: the size of the other revisions may differ. A
+            // pending storage job may still be storing it back in full,
+            // and will then update its size.
+            if ((revision != file->current) && (revision != file->latest))
+                return 0;
+            if (item->size == fs.st_size) return 0;
+            if (!housedepot_worker_idle (key)) return 0;
+        }
+    } else {
+        int revision = 0;
+        if (exists && S_ISLNK(fs.st_mode)) {
+            char target[1024];
+            int pathsz = readlinkat (fd, name, target, sizeof(target)-1);
+            if (pathsz > 0) {
+                target[pathsz] = 0;
+                const char *rev = strrchr (target, FRM);
+                if (rev && isdigit(rev[1])) revision = atoi(rev+1);
+            }
+        }
+        int indexed = 0;
+        if (file) {
+            int i;
+            for (i = 0; i < file->tagcount; ++i) {
+                if (!strcmp (file->tags[i].name, sep)) {
+                    indexed = file->tags[i].revision;
+                    break;
+                }
+            }
+        }
+        if (revision == indexed) return 0;
+    }
+    housedepot_index_reset (dir);
+    return 1;
+}
+
+void housedepot_index_forget (const char *filename) {
+
+    housedepot_cache_forget (filename);
+
+    int length = strlen(filename);
+    housedepot_index_file *file = housedepot_index_search (filename, length);
+    if (!file) return;
+
+    if (!housedepot_index_replaying)
+        housedepot_manifest_record (file, HOUSEDEPOT_MANIFEST_FORGET,
+                                    0, 0, 0, 0, 0);
+
+    housedepot_index_file **cursor;
+    unsigned int h = housedepot_index_hash (filename, length);
+    for (cursor = FileTable + h; *cursor; cursor = &((*cursor)->hash)) {
+        if (*cursor == file) {
+            *cursor = file->hash;
+            break;
+        }
+    }
+    for (cursor = &(file->parent->files); *cursor; cursor = &((*cursor)->next)) {
+        if (*cursor == file) {
+            *cursor = file->next;
+            break;
+        }
+    }
+    int i;
+    for (i = 0; i < file->tagcount; ++i) free (file->tags[i].name);
+    free (file->tags);
+    free (file->revisions);
+    free (file->filename);
+    free (file);
+}
+
+void housedepot_index_background (void) {
+
+    // The storage jobs still modify the directories: the manifests would
+    // not match.
+    if (housedepot_worker_pending ()) return;
+
+    int i;
+    for (i = 0; i < INDEXBUCKETS; ++i) {
+        housedepot_index_directory *dir;
+        for (dir = DirectoryTable[i]; dir; dir = dir->hash) {
+            if (dir->loaded && dir->changed) housedepot_manifest_sync (dir);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_index.h - A resident index of the file revisions and tags.
+ */
+
+typedef struct {
+    int       revision;
+    long long size;
+    time_t    time;
+} housedepot_index_revision;
+
+typedef struct {
+    char *name;
+    int   revision;
+} housedepot_index_tag;
+
+typedef struct housedepot_index_directory housedepot_index_directory;
+typedef struct housedepot_index_file housedepot_index_file;
+
+struct housedepot_index_file {
+    char *filename;
+    const char *basename;
+    housedepot_index_directory *parent;
+    housedepot_index_file *hash;
+    housedepot_index_file *next;
+
+    int latest;
+    int current;
+
+    int count;
+    int size;
+    housedepot_index_revision *revisions; // Ordered by revision number.
+
+    int tagcount;
+    int tagsize;
+    housedepot_index_tag *tags; // Ordered by tag name.
+};
+
+struct housedepot_index_directory {
+    char *path;
+    const char *name;
+    int loaded;
+    int fd;
+    housedepot_index_directory *hash;
+    housedepot_index_directory *parent;
+    housedepot_index_directory *children; // Ordered by name.
+    housedepot_index_directory *sibling;
+    housedepot_index_file *files;
+
+    int manifest; // See housedepot_manifest.c
+    int journal;
+    int changed;
+};
+
+housedepot_index_directory *housedepot_index_directory_get (const char *path);
+
+int housedepot_index_fd (housedepot_index_directory *dir);
+int housedepot_index_open (const char *path);
+int housedepot_index_at (const char *path, const char **name);
+
+housedepot_index_file *housedepot_index_get (const char *filename, int create);
+
+int housedepot_index_resolve (const housedepot_index_file *file,
+                              const char *tag);
+
+housedepot_index_revision *housedepot_index_find (housedepot_index_file *file,
+                                                  int revision);
+
+void housedepot_index_add (housedepot_index_file *file,
+                           int revision, long long size, time_t time);
+void housedepot_index_remove (housedepot_index_file *file, int revision);
+int  housedepot_index_prune (housedepot_index_file *file, int oldest, int keep);
+
+void housedepot_index_tag_set (housedepot_index_file *file,
+                               const char *tag, int revision);
+void housedepot_index_tag_remove (housedepot_index_file *file, const char *tag);
+
+void housedepot_index_forget (const char *filename);
+
+int  housedepot_index_verify (const char *path, const char *name);
+int  housedepot_index_known (const char *path);
+void housedepot_index_invalidate (const char *path);
+
+void housedepot_index_background (void);
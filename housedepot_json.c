@@ -0,0 +1,285 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_json.c - A JSON response builder of bounded size.
+ *
+ * DESCRIPTION
+ *
+ * This module formats JSON responses, keeping track of the separators
+ * between items. The text is accumulated in a memory buffer that grows
+ * up to a fixed limit. When the limit is reached, the buffer is flushed
+ * to an anonymous temporary file and the response is eventually sent
+ * as a file transfer. This way the memory used remains bounded, while
+ * there is no limit to the size of the response.
+ *
+ * Each builder context is meant to be static: the response text must
+ * remain valid after the HTTP callback returned. The buffer is reused
+ * from one response to the next.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_json_start (housedepot_json *json);
+ *
+ *   Start a new response, discarding the previous one.
+ *
+ * void housedepot_json_object (housedepot_json *json, const char *name);
+ * void housedepot_json_array  (housedepot_json *json, const char *name);
+ * void housedepot_json_close  (housedepot_json *json);
+ *
+ *   Open or close a JSON object or array. The name is ignored if the
+ *   parent is an array (or if this is the outer structure), and should
+ *   then be 0.
+ *
+ * void housedepot_json_string  (housedepot_json *json,
+ *                               const char *name, const char *value);
+ * void housedepot_json_integer (housedepot_json *json,
+ *                               const char *name, long long value);
+ *
+ *   Add one value. The string is escaped as needed.
+ *
+ * void housedepot_json_header (housedepot_json *json,
+ *                              const char *host, const char *portal);
+ *
+ *   Add the entries that are common to all responses: host, proxy
+ *   (if any) and timestamp.
+ *
+ * const char *housedepot_json_end (housedepot_json *json);
+ *
+ *   Close all structures that are still open and return the response text,
+ *   or an empty string if the response was large enough that it is sent
+ *   as a file transfer.
+ *
+ * long long housedepot_json_transferred (void);
+ *
+ *   Return the length of the file transfer started by the last call to
+ *   housedepot_json_end, or 0 if that response was returned as text or
+ *   if this length was already read.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+
+#include "housedepot_json.h"
+
+#define HOUSEDEPOT_JSON_MIN    4096
+#define HOUSEDEPOT_JSON_CHUNK 65536
+
+static long long housedepot_json_sent = 0; // Length of the last transfer.
+
+static int housedepot_json_flush (housedepot_json *json) {
+
+    if (json->fd < 0) {
+        char name[] = P_tmpdir "/housedepotXXXXXX";
+        json->fd = mkstemp (name);
+        if (json->fd < 0) return -1;
+        unlink (name); // Anonymous: removed when closed.
+        json->spilled = 0;
+    }
+    if (write (json->fd, json->buffer, json->cursor) != json->cursor) {
+        close (json->fd);
+        json->fd = -1;
+        return -1;
+    }
+    json->spilled += json->cursor;
+    json->cursor = 0;
+    return 0;
+}
+
+static int housedepot_json_grow (housedepot_json *json) {
+
+    int size = json->size ? json->size * 2 : HOUSEDEPOT_JSON_MIN;
+    char *buffer = realloc (json->buffer, size);
+    if (!buffer) return -1;
+    json->buffer = buffer;
+    json->size = size;
+    return 0;
+}
+
+static void housedepot_json_write (housedepot_json *json,
+                                   const char *data, int length) {
+
+    // Always keep room for a terminating null character.
+    //
+    while ((json->cursor + length >= json->size) &&
+           (json->size < HOUSEDEPOT_JSON_CHUNK)) {
+        if (housedepot_json_grow (json)) return;
+    }
+    if (json->cursor + length >= json->size) {
+        // The buffer reached its limit: move its content to the file.
+        if (housedepot_json_flush (json) == 0) {
+            if (length >= json->size) {
+                if (write (json->fd, data, length) == length)
+                    json->spilled += length;
+                return;
+            }
+        } else {
+            // No temporary file: keep growing rather than truncate.
+            while (json->cursor + length >= json->size) {
+                if (housedepot_json_grow (json)) return;
+            }
+        }
+    }
+    memcpy (json->buffer + json->cursor, data, length);
+    json->cursor += length;
+    json->buffer[json->cursor] = 0;
+}
+
+static void housedepot_json_text (housedepot_json *json, const char *text) {
+    housedepot_json_write (json, text, strlen(text));
+}
+
+static void housedepot_json_quoted (housedepot_json *json, const char *text) {
+
+    housedepot_json_write (json, "\"", 1);
+    const char *start = text;
+    for (;;) {
+        unsigned char c = *((unsigned char *)text);
+        if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+            text += 1;
+            continue;
+        }
+        if (text > start) housedepot_json_write (json, start, text - start);
+        if (c == 0) break;
+
+        char escape[8];
+        switch (c) {
+            case '"':  housedepot_json_write (json, "\\\"", 2); break;
+            case '\\': housedepot_json_write (json, "\\\\", 2); break;
+            case '\n': housedepot_json_write (json, "\\n", 2); break;
+            case '\t': housedepot_json_write (json, "\\t", 2); break;
+            default:
+                snprintf (escape, sizeof(escape), "\\u%04x", c);
+                housedepot_json_text (json, escape);
+        }
+        start = ++text;
+    }
+    housedepot_json_write (json, "\"", 1);
+}
+
+static void housedepot_json_item (housedepot_json *json, const char *name) {
+
+    if (json->depth <= 0) return; // Outer structure.
+
+    char *comma = json->comma + json->depth - 1;
+    if (*comma) housedepot_json_write (json, ",", 1);
+    *comma = 1;
+    if (name) {
+        housedepot_json_quoted (json, name);
+        housedepot_json_write (json, ":", 1);
+    }
+}
+
+void housedepot_json_start (housedepot_json *json) {
+
+    if (json->fd >= 0) close (json->fd); // Should not happen.
+    json->fd = -1;
+    json->spilled = 0;
+    json->cursor = 0;
+    json->depth = 0;
+    if (json->buffer) json->buffer[0] = 0;
+}
+
+static void housedepot_json_open (housedepot_json *json, const char *name,
+                                  const char *opening, char closing) {
+
+    housedepot_json_item (json, name);
+    housedepot_json_write (json, opening, 1);
+    if (json->depth >= HOUSEDEPOT_JSON_DEPTH) return; // Too deep, ignore.
+    json->comma[json->depth] = 0;
+    json->closing[json->depth] = closing;
+    json->depth += 1;
+}
+
+void housedepot_json_object (housedepot_json *json, const char *name) {
+    housedepot_json_open (json, name, "{", '}');
+}
+
+void housedepot_json_array (housedepot_json *json, const char *name) {
+    housedepot_json_open (json, name, "[", ']');
+}
+
+void housedepot_json_close (housedepot_json *json) {
+
+    if (json->depth <= 0) return;
+    json->depth -= 1;
+    housedepot_json_write (json, json->closing + json->depth, 1);
+}
+
+void housedepot_json_string (housedepot_json *json,
+                             const char *name, const char *value) {
+    housedepot_json_item (json, name);
+    housedepot_json_quoted (json, value);
+}
+
+void housedepot_json_integer (housedepot_json *json,
+                              const char *name, long long value) {
+    char ascii[32];
+    housedepot_json_item (json, name);
+    housedepot_json_write (json, ascii,
+                           snprintf (ascii, sizeof(ascii), "%lld", value));
+}
+
+void housedepot_json_header (housedepot_json *json,
+                             const char *host, const char *portal) {
+
+    housedepot_json_string (json, "host", host);
+    if (portal) housedepot_json_string (json, "proxy", portal);
+    housedepot_json_integer (json, "timestamp", (long long)time(0));
+}
+
+const char *housedepot_json_end (housedepot_json *json) {
+
+    while (json->depth > 0) housedepot_json_close (json);
+
+    housedepot_json_sent = 0;
+    if (json->fd < 0) {
+        if (!json->buffer) return "";
+        return json->buffer;
+    }
+
+    // This is a large response: send the temporary file.
+    //
+    if (json->cursor > 0) housedepot_json_flush (json);
+    if (json->fd >= 0) {
+        lseek (json->fd, 0, SEEK_SET);
+        echttp_transfer (json->fd, (int)(json->spilled));
+        housedepot_json_sent = json->spilled;
+        json->fd = -1; // Now owned by echttp.
+    }
+    json->cursor = 0;
+    if (json->buffer) json->buffer[0] = 0;
+    return "";
+}
+
+long long housedepot_json_transferred (void) {
+
+    long long length = housedepot_json_sent;
+    housedepot_json_sent = 0;
+    return length;
+}
@@ -0,0 +1,36 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_json.h - A JSON response builder of bounded size.
+ */
+
+#define HOUSEDEPOT_JSON_DEPTH 16
+
+typedef struct {
+    char *buffer;
+    int size;
+    int cursor;
+    int fd;
+    long long spilled;
+    int depth;
+    char comma[HOUSEDEPOT_JSON_DEPTH];
+    char closing[HOUSEDEPOT_JSON_DEPTH];
+} housedepot_json;
+
+#define HOUSEDEPOT_JSON_INIT {0, 0, 0, -1, 0, 0, {0}, {0}}
+
+void housedepot_json_start (housedepot_json *json);
+
+void housedepot_json_object (housedepot_json *json, const char *name);
+void housedepot_json_array  (housedepot_json *json, const char *name);
+void housedepot_json_close  (housedepot_json *json);
+
+void housedepot_json_string  (housedepot_json *json,
+                              const char *name, const char *value);
+void housedepot_json_integer (housedepot_json *json,
+                              const char *name, long long value);
+
+void housedepot_json_header (housedepot_json *json,
+                             const char *host, const char *portal);
+
+const char *housedepot_json_end (housedepot_json *json);
+long long housedepot_json_transferred (void);
@@ -0,0 +1,425 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_manifest.c - A persistent copy of the index, per directory.
+ *
+ * DESCRIPTION
+ *
+ * Loading the index of a directory requires reading the whole directory,
+ * then the status of each revision file and the target of each tag link.
+ * On a large depot, this makes the first requests after a restart slow.
+ *
+ * This module saves the index of each directory in a hidden ".manifest"
+ * file in that directory, so that it can be loaded in one read (mmap)
+ * on the next start. The manifest is a binary file, not meant to be
+ * portable: it is only a cache, and it is rebuilt whenever in doubt.
+ *
+ * The manifest starts with a snapshot of the index, followed by the list
+ * of changes made to the index since that snapshot, appended one record
+ * at a time. The snapshot is rewritten in the background once too many
+ * changes were appended.
+ *
+ * The manifest header records the modification and change times of the
+ * directory at the time the manifest was known to match the directory.
+ * A manifest that does not match the directory's current times is ignored,
+ * and the directory is read instead. Since a revision file may also be
+ * rewritten in place without changing the directory's times, the index
+ * module then checks the time and size of every revision loaded from the
+ * manifest (one stat per revision, still much cheaper than a scan). The times are updated in the
+ * background, only when no background storage job is pending, since
+ * these jobs still modify the directory.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_manifest_initialize (int argc, const char **argv);
+ *
+ *   Disable the manifests if the -no-manifest option is present.
+ *
+ * int housedepot_manifest_load (housedepot_index_directory *dir,
+ *                               housedepot_manifest_apply *apply);
+ *
+ *   Load the manifest of the specified directory, calling apply for each
+ *   record. Return 0 on success, or -1 if the manifest is missing, invalid
+ *   or out of date. Nothing is applied if the manifest is not valid.
+ *
+ * void housedepot_manifest_record (housedepot_index_file *file,
+ *                                  int type, const char *tag,
+ *                                  int revision, int keep,
+ *                                  long long size, time_t time);
+ *
+ *   Append one change to the manifest of the file's directory.
+ *
+ * void housedepot_manifest_changed (housedepot_index_directory *dir);
+ *
+ *   Tell that the directory changed in a way that was not recorded: its
+ *   manifest must be written again.
+ *
+ * void housedepot_manifest_sync (housedepot_index_directory *dir);
+ *
+ *   Bring the manifest of the directory up to date, if it changed. Only
+ *   call this when no storage job is pending.
+ *
+ * void housedepot_manifest_discard (housedepot_index_directory *dir);
+ *
+ *   Remove the manifest of the directory, which content is no longer
+ *   trusted.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include <houselog.h>
+
+#include "housedepot_index.h"
+#include "housedepot_manifest.h"
+
+#define HOUSEDEPOT_MANIFEST_NAME    ".manifest"
+#define HOUSEDEPOT_MANIFEST_TEMP    ".manifest.new"
+#define HOUSEDEPOT_MANIFEST_MAGIC   "HDMANIF1"
+#define HOUSEDEPOT_MANIFEST_JOURNAL 1024 // Changes before a new snapshot.
+
+typedef struct {
+    char magic[8];
+    long long stamp[2]; // Directory times (ns) when the manifest matched.
+    long long snapshot; // Size of the snapshot part, header included.
+} housedepot_manifest_header;
+
+typedef struct {
+    unsigned char type;
+    unsigned char namelength;
+    unsigned char taglength;
+    unsigned char reserved;
+    int revision;
+    int keep;
+    int reserved2;
+    long long size;
+    long long time;
+} housedepot_manifest_item; // Followed by the name, then the tag.
+
+static int housedepot_manifest_enabled = 1;
+
+void housedepot_manifest_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-no-manifest", argv[i]))
+            housedepot_manifest_enabled = 0;
+    }
+}
+
+static long long housedepot_manifest_time (const struct timespec *t) {
+    return ((long long)(t->tv_sec) * 1000000000) + t->tv_nsec;
+}
+
+static int housedepot_manifest_stamp (housedepot_index_directory *dir,
+                                      housedepot_manifest_header *header) {
+
+    struct stat st;
+    if (fstat (housedepot_index_fd (dir), &st)) return -1;
+    header->stamp[0] = housedepot_manifest_time (&(st.st_mtim));
+    header->stamp[1] = housedepot_manifest_time (&(st.st_ctim));
+    return 0;
+}
+
+int housedepot_manifest_load (housedepot_index_directory *dir,
+                              housedepot_manifest_apply *apply) {
+
+    if (!housedepot_manifest_enabled) return -1;
+
+    int dirfd = housedepot_index_fd (dir);
+    if (dirfd < 0) return -1;
+
+    int fd = openat (dirfd, HOUSEDEPOT_MANIFEST_NAME, O_RDWR);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat (fd, &st) || (st.st_size < sizeof(housedepot_manifest_header))) {
+        close (fd);
+        return -1;
+    }
+    const char *data = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close (fd);
+        return -1;
+    }
+    const char *end = data + st.st_size;
+
+    housedepot_manifest_header header;
+    housedepot_manifest_header now;
+    memcpy (&header, data, sizeof(header));
+    int valid = (!memcmp (header.magic, HOUSEDEPOT_MANIFEST_MAGIC, 8)) &&
+                (!housedepot_manifest_stamp (dir, &now)) &&
+                (header.stamp[0] == now.stamp[0]) &&
+                (header.stamp[1] == now.stamp[1]) &&
+                (header.snapshot >= sizeof(header)) &&
+                (header.snapshot <= st.st_size);
+
+    // Check the whole structure first, so that nothing is applied from
+    // a truncated manifest (e.g. a crash in the middle of an append).
+    //
+    const char *cursor = data + sizeof(header);
+    housedepot_manifest_item item;
+    int journal = 0;
+    while (valid && (cursor < end)) {
+        if (cursor + sizeof(item) > end) {
+            valid = 0;
+            break;
+        }
+        memcpy (&item, cursor, sizeof(item));
+        cursor += sizeof(item) + item.namelength + item.taglength;
+        if (cursor > end) valid = 0;
+        if (cursor > data + header.snapshot) journal += 1;
+    }
+
+    if (valid) {
+        char name[256];
+        char tag[256];
+        cursor = data + sizeof(header);
+        while (cursor < end) {
+            memcpy (&item, cursor, sizeof(item));
+            cursor += sizeof(item);
+            memcpy (name, cursor, item.namelength);
+            name[item.namelength] = 0;
+            cursor += item.namelength;
+            memcpy (tag, cursor, item.taglength);
+            tag[item.taglength] = 0;
+            cursor += item.taglength;
+            apply (dir, item.type, name, tag, item.revision, item.keep,
+                   item.size, (time_t)(item.time));
+        }
+    }
+    munmap ((void *)data, st.st_size);
+
+    if (!valid) {
+        close (fd);
+        return -1;
+    }
+    if (dir->manifest >= 0) close (dir->manifest);
+    dir->manifest = fd;
+    dir->journal = journal;
+    dir->changed = 0;
+    return 0;
+}
+
+static int housedepot_manifest_format (char *buffer, int type,
+                                       const char *name, const char *tag,
+                                       int revision, int keep,
+                                       long long size, time_t time) {
+
+    housedepot_manifest_item item;
+    int namelength = strlen (name);
+    int taglength = tag ? strlen (tag) : 0;
+    if ((namelength > 255) || (taglength > 255)) return -1;
+
+    memset (&item, 0, sizeof(item));
+    item.type = type;
+    item.namelength = namelength;
+    item.taglength = taglength;
+    item.revision = revision;
+    item.keep = keep;
+    item.size = size;
+    item.time = (long long)time;
+
+    memcpy (buffer, &item, sizeof(item));
+    memcpy (buffer + sizeof(item), name, namelength);
+    if (taglength) memcpy (buffer + sizeof(item) + namelength, tag, taglength);
+    return sizeof(item) + namelength + taglength;
+}
+
+#define HOUSEDEPOT_MANIFEST_RECORD (sizeof(housedepot_manifest_item) + 512)
+
+void housedepot_manifest_record (housedepot_index_file *file,
+                                 int type, const char *tag,
+                                 int revision, int keep,
+                                 long long size, time_t time) {
+
+    if (!housedepot_manifest_enabled) return;
+
+    housedepot_index_directory *dir = file->parent;
+    if (dir->manifest < 0) {
+        dir->changed = HOUSEDEPOT_MANIFEST_WRITE;
+        return;
+    }
+
+    char buffer[HOUSEDEPOT_MANIFEST_RECORD];
+    int length = housedepot_manifest_format (buffer, type, file->basename,
+                                             tag, revision, keep, size, time);
+    if ((length < 0) ||
+        (lseek (dir->manifest, 0, SEEK_END) < 0) ||
+        (write (dir->manifest, buffer, length) != length)) {
+        housedepot_manifest_discard (dir);
+        dir->changed = HOUSEDEPOT_MANIFEST_WRITE;
+        return;
+    }
+    dir->journal += 1;
+    if (dir->journal > HOUSEDEPOT_MANIFEST_JOURNAL)
+        dir->changed = HOUSEDEPOT_MANIFEST_WRITE;
+    else if (!dir->changed)
+        dir->changed = HOUSEDEPOT_MANIFEST_STAMP;
+}
+
+void housedepot_manifest_changed (housedepot_index_directory *dir) {
+    if (housedepot_manifest_enabled) dir->changed = HOUSEDEPOT_MANIFEST_WRITE;
+}
+
+typedef struct {
+    char *data;
+    int length;
+    int size;
+} housedepot_manifest_buffer;
+
+static void housedepot_manifest_append (housedepot_manifest_buffer *buffer,
+                                        int type,
+                                        const char *name, const char *tag,
+                                        int revision,
+                                        long long size, time_t time) {
+
+    if (!buffer->data) return; // Failed earlier.
+
+    if (buffer->length + HOUSEDEPOT_MANIFEST_RECORD > buffer->size) {
+        int newsize = buffer->size * 2;
+        char *data = realloc (buffer->data, newsize);
+        if (!data) {
+            free (buffer->data);
+            buffer->data = 0;
+            return;
+        }
+        buffer->data = data;
+        buffer->size = newsize;
+    }
+    int length = housedepot_manifest_format (buffer->data + buffer->length,
+                                             type, name, tag, revision, 0,
+                                             size, time);
+    if (length > 0) buffer->length += length;
+}
+
+static void housedepot_manifest_write (housedepot_index_directory *dir) {
+
+    int dirfd = housedepot_index_fd (dir);
+    if (dirfd < 0) return;
+
+    housedepot_manifest_buffer buffer;
+    buffer.size = 65536;
+    buffer.length = sizeof(housedepot_manifest_header);
+    buffer.data = malloc (buffer.size);
+
+    // Only list the subdirectories that still exist: the index may also
+    // know of directories that were only looked up.
+    //
+    housedepot_index_directory *child;
+    for (child = dir->children; child; child = child->sibling) {
+        struct stat st;
+        if (fstatat (dirfd, child->name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+        if (!S_ISDIR(st.st_mode)) continue;
+        housedepot_manifest_append (&buffer, HOUSEDEPOT_MANIFEST_GROUP,
+                                    child->name, 0, 0, 0, 0);
+    }
+
+    housedepot_index_file *file;
+    for (file = dir->files; file; file = file->next) {
+        int i;
+        for (i = 0; i < file->count; ++i) {
+            housedepot_index_revision *rev = file->revisions + i;
+            housedepot_manifest_append (&buffer, HOUSEDEPOT_MANIFEST_REVISION,
+                                        file->basename, 0,
+                                        rev->revision, rev->size, rev->time);
+        }
+        for (i = 0; i < file->tagcount; ++i) {
+            housedepot_manifest_append (&buffer, HOUSEDEPOT_MANIFEST_TAG,
+                                        file->basename, file->tags[i].name,
+                                        file->tags[i].revision, 0, 0);
+        }
+    }
+    if (!buffer.data) return; // Try again later.
+
+    housedepot_manifest_header header;
+    memset (&header, 0, sizeof(header));
+    memcpy (header.magic, HOUSEDEPOT_MANIFEST_MAGIC, 8);
+    header.snapshot = buffer.length;
+    memcpy (buffer.data, &header, sizeof(header));
+
+    int fd = openat (dirfd, HOUSEDEPOT_MANIFEST_TEMP,
+                     O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        free (buffer.data);
+        return;
+    }
+    int written = write (fd, buffer.data, buffer.length);
+    free (buffer.data);
+    if ((written != buffer.length) ||
+        renameat (dirfd, HOUSEDEPOT_MANIFEST_TEMP,
+                  dirfd, HOUSEDEPOT_MANIFEST_NAME)) {
+        houselog_trace (HOUSE_FAILURE, dir->path, "CANNOT WRITE MANIFEST");
+        close (fd);
+        unlinkat (dirfd, HOUSEDEPOT_MANIFEST_TEMP, 0);
+        return;
+    }
+
+    // The rename modified the directory: stamp the manifest after it.
+    if (dir->manifest >= 0) close (dir->manifest);
+    dir->manifest = fd;
+    dir->journal = 0;
+    dir->changed = HOUSEDEPOT_MANIFEST_STAMP;
+}
+
+void housedepot_manifest_sync (housedepot_index_directory *dir) {
+
+    if (!housedepot_manifest_enabled) return;
+    if (!dir->changed) return;
+
+    if ((dir->changed == HOUSEDEPOT_MANIFEST_WRITE) || (dir->manifest < 0))
+        housedepot_manifest_write (dir);
+    if (dir->manifest < 0) return; // Could not write it.
+
+    housedepot_manifest_header header;
+    if (housedepot_manifest_stamp (dir, &header)) return;
+    if (pwrite (dir->manifest, header.stamp, sizeof(header.stamp),
+                offsetof(housedepot_manifest_header, stamp))
+            != sizeof(header.stamp)) {
+        housedepot_manifest_discard (dir);
+        return;
+    }
+    dir->changed = 0;
+}
+
+void housedepot_manifest_discard (housedepot_index_directory *dir) {
+
+    if (dir->manifest >= 0) {
+        close (dir->manifest);
+        dir->manifest = -1;
+    }
+    dir->journal = 0;
+    dir->changed = 0;
+    if (!housedepot_manifest_enabled) return;
+    int dirfd = housedepot_index_fd (dir);
+    if (dirfd >= 0) unlinkat (dirfd, HOUSEDEPOT_MANIFEST_NAME, 0);
+}
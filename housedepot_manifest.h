@@ -0,0 +1,35 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_manifest.h - A persistent copy of the index, per directory.
+ */
+
+#define HOUSEDEPOT_MANIFEST_GROUP    'G'
+#define HOUSEDEPOT_MANIFEST_REVISION 'R'
+#define HOUSEDEPOT_MANIFEST_REMOVE   'D'
+#define HOUSEDEPOT_MANIFEST_PRUNE    'P'
+#define HOUSEDEPOT_MANIFEST_TAG      'T'
+#define HOUSEDEPOT_MANIFEST_UNTAG    'U'
+#define HOUSEDEPOT_MANIFEST_FORGET   'F'
+
+#define HOUSEDEPOT_MANIFEST_STAMP 1 // Values of housedepot_index_directory.changed
+#define HOUSEDEPOT_MANIFEST_WRITE 2
+
+void housedepot_manifest_initialize (int argc, const char **argv);
+
+typedef void housedepot_manifest_apply (housedepot_index_directory *dir,
+                                        int type,
+                                        const char *name, const char *tag,
+                                        int revision, int keep,
+                                        long long size, time_t time);
+
+int  housedepot_manifest_load (housedepot_index_directory *dir,
+                               housedepot_manifest_apply *apply);
+
+void housedepot_manifest_record (housedepot_index_file *file,
+                                 int type, const char *tag,
+                                 int revision, int keep,
+                                 long long size, time_t time);
+
+void housedepot_manifest_changed (housedepot_index_directory *dir);
+void housedepot_manifest_sync (housedepot_index_directory *dir);
+void housedepot_manifest_discard (housedepot_index_directory *dir);
@@ -0,0 +1,303 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_metrics.c - Count the requests and the storage operations.
+ *
+ * DESCRIPTION
+ *
+ * This module keeps statistics about the HTTP requests (count, latency
+ * and bytes, per method and per kind of request) and counts some storage
+ * operations. These are served on /depot/metrics, in the Prometheus
+ * text format.
+ *
+ * The counters are plain memory counters, updated from the main thread:
+ * counting costs a few additions per request.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_metrics_initialize (int argc, const char **argv);
+ *
+ *   Declare the /depot/metrics URI.
+ *
+ * long long housedepot_metrics_start (void);
+ *
+ *   Return the time when a request started, used for calculating its
+ *   latency.
+ *
+ * void housedepot_metrics_request (int route, const char *method,
+ *                                  long long start,
+ *                                  long long received, long long sent);
+ *
+ *   Record one request of the specified kind (HOUSEDEPOT_METRICS_ROUTE_*).
+ *
+ * void housedepot_metrics_count (int counter, int increment);
+ *
+ *   Increment one of the storage counters (HOUSEDEPOT_METRICS_*).
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "housedepot_cache.h"
+#include "housedepot_retention.h"
+#include "housedepot_worker.h"
+#include "housedepot_metrics.h"
+
+static const char *housedepot_metrics_routes[HOUSEDEPOT_METRICS_ROUTES] = {
+    "file", "history", "all", "events", "list", "check", "metrics"
+};
+
+#define HOUSEDEPOT_METRICS_METHODS 6
+static const char *housedepot_metrics_methods[HOUSEDEPOT_METRICS_METHODS] = {
+    "GET", "HEAD", "PUT", "POST", "DELETE", "OTHER"
+};
+
+// The upper bounds of the latency histogram buckets, in microseconds.
+#define HOUSEDEPOT_METRICS_BUCKETS 12
+static const long long housedepot_metrics_bounds[HOUSEDEPOT_METRICS_BUCKETS] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000
+};
+
+typedef struct {
+    long long count;
+    long long duration; // Microseconds.
+    long long received;
+    long long sent;
+    long long buckets[HOUSEDEPOT_METRICS_BUCKETS]; // Not cumulative.
+} housedepot_metrics_series;
+
+static housedepot_metrics_series
+    housedepot_metrics_requests[HOUSEDEPOT_METRICS_METHODS][HOUSEDEPOT_METRICS_ROUTES];
+
+static long long housedepot_metrics_counters[HOUSEDEPOT_METRICS_COUNTERS];
+
+static char housedepot_metrics_buffer[65536];
+
+long long housedepot_metrics_start (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static int housedepot_metrics_method (const char *method) {
+    int i;
+    for (i = 0; i < HOUSEDEPOT_METRICS_METHODS - 1; ++i) {
+        if (!strcmp (method, housedepot_metrics_methods[i])) return i;
+    }
+    return HOUSEDEPOT_METRICS_METHODS - 1;
+}
+
+void housedepot_metrics_request (int route, const char *method,
+                                 long long start,
+                                 long long received, long long sent) {
+
+    if ((route < 0) || (route >= HOUSEDEPOT_METRICS_ROUTES)) return;
+
+    long long duration = housedepot_metrics_start () - start;
+    housedepot_metrics_series *series =
+        &(housedepot_metrics_requests[housedepot_metrics_method(method)][route]);
+
+    series->count += 1;
+    series->duration += duration;
+    series->received += received;
+    series->sent += sent;
+
+    int i;
+    for (i = 0; i < HOUSEDEPOT_METRICS_BUCKETS; ++i) {
+        if (duration <= housedepot_metrics_bounds[i]) {
+            series->buckets[i] += 1;
+            break;
+        }
+    }
+}
+
+void housedepot_metrics_count (int counter, int increment) {
+    if ((counter < 0) || (counter >= HOUSEDEPOT_METRICS_COUNTERS)) return;
+    housedepot_metrics_counters[counter] += increment;
+}
+
+typedef struct {
+    char *cursor;
+    char *end;
+} housedepot_metrics_output;
+
+static void housedepot_metrics_print (housedepot_metrics_output *out,
+                                      const char *format, ...) {
+    va_list args;
+    va_start (args, format);
+    int length = vsnprintf (out->cursor, out->end - out->cursor, format, args);
+    va_end (args);
+    if (length < 0) return;
+    if (length >= out->end - out->cursor) {
+        out->cursor = out->end - 1; // Truncated.
+        return;
+    }
+    out->cursor += length;
+}
+
+static void housedepot_metrics_header (housedepot_metrics_output *out,
+                                       const char *name, const char *type,
+                                       const char *help) {
+    housedepot_metrics_print (out, "# HELP %s %s\n# TYPE %s %s\n",
+                              name, help, name, type);
+}
+
+static void housedepot_metrics_single (housedepot_metrics_output *out,
+                                       const char *name, const char *type,
+                                       const char *help, long long value) {
+    housedepot_metrics_header (out, name, type, help);
+    housedepot_metrics_print (out, "%s %lld\n", name, value);
+}
+
+// Print one value for each method and route that was used.
+//
+static void housedepot_metrics_series_print (housedepot_metrics_output *out,
+                                             const char *name,
+                                             const char *help, int field) {
+
+    housedepot_metrics_header (out, name, "counter", help);
+    int m, r;
+    for (m = 0; m < HOUSEDEPOT_METRICS_METHODS; ++m) {
+        for (r = 0; r < HOUSEDEPOT_METRICS_ROUTES; ++r) {
+            housedepot_metrics_series *series =
+                &(housedepot_metrics_requests[m][r]);
+            if (!series->count) continue;
+            long long value = 0;
+            switch (field) {
+            case 0: value = series->count; break;
+            case 1: value = series->received; break;
+            case 2: value = series->sent; break;
+            }
+            housedepot_metrics_print (out,
+                                      "%s{method=\"%s\",route=\"%s\"} %lld\n",
+                                      name, housedepot_metrics_methods[m],
+                                      housedepot_metrics_routes[r], value);
+        }
+    }
+}
+
+static void housedepot_metrics_histogram (housedepot_metrics_output *out) {
+
+    static const char name[] = "housedepot_request_duration_seconds";
+
+    housedepot_metrics_header (out, name, "histogram",
+                               "Time spent processing the requests.");
+    int m, r, i;
+    for (m = 0; m < HOUSEDEPOT_METRICS_METHODS; ++m) {
+        for (r = 0; r < HOUSEDEPOT_METRICS_ROUTES; ++r) {
+            housedepot_metrics_series *series =
+                &(housedepot_metrics_requests[m][r]);
+            if (!series->count) continue;
+
+            const char *method = housedepot_metrics_methods[m];
+            const char *route = housedepot_metrics_routes[r];
+            long long cumulative = 0;
+            for (i = 0; i < HOUSEDEPOT_METRICS_BUCKETS; ++i) {
+                cumulative += series->buckets[i];
+                housedepot_metrics_print
+                    (out,
+                     "%s_bucket{method=\"%s\",route=\"%s\",le=\"%g\"} %lld\n",
+                     name, method, route,
+                     housedepot_metrics_bounds[i] / 1000000.0, cumulative);
+            }
+            housedepot_metrics_print
+                (out, "%s_bucket{method=\"%s\",route=\"%s\",le=\"+Inf\"} %lld\n",
+                 name, method, route, series->count);
+            housedepot_metrics_print
+                (out, "%s_sum{method=\"%s\",route=\"%s\"} %.6f\n",
+                 name, method, route, series->duration / 1000000.0);
+            housedepot_metrics_print
+                (out, "%s_count{method=\"%s\",route=\"%s\"} %lld\n",
+                 name, method, route, series->count);
+        }
+    }
+}
+
+static const char *housedepot_metrics_page (const char *action,
+                                            const char *uri,
+                                            const char *data, int length) {
+
+    long long start = housedepot_metrics_start ();
+
+    housedepot_metrics_output out;
+    out.cursor = housedepot_metrics_buffer;
+    out.end = housedepot_metrics_buffer + sizeof(housedepot_metrics_buffer);
+    out.cursor[0] = 0;
+
+    housedepot_metrics_series_print (&out, "housedepot_requests_total",
+                                     "Number of HTTP requests.", 0);
+    housedepot_metrics_histogram (&out);
+    housedepot_metrics_series_print (&out, "housedepot_received_bytes_total",
+                                     "Bytes received in the request bodies.", 1);
+    housedepot_metrics_series_print (&out, "housedepot_sent_bytes_total",
+                                     "Bytes sent in the response bodies.", 2);
+
+    housedepot_metrics_single
+        (&out, "housedepot_checkin_duplicates_total", "counter",
+         "Checkins ignored because the content did not change.",
+         housedepot_metrics_counters[HOUSEDEPOT_METRICS_DUPLICATE]);
+    housedepot_metrics_single
+        (&out, "housedepot_pruned_revisions_total", "counter",
+         "Revisions removed by the retention rules.",
+         housedepot_metrics_counters[HOUSEDEPOT_METRICS_PRUNED]);
+    housedepot_metrics_single
+        (&out, "housedepot_directory_scans_total", "counter",
+         "Directories read from disk.",
+         housedepot_metrics_counters[HOUSEDEPOT_METRICS_SCAN]);
+    housedepot_metrics_single
+        (&out, "housedepot_manifest_loads_total", "counter",
+         "Directories loaded from their manifest.",
+         housedepot_metrics_counters[HOUSEDEPOT_METRICS_MANIFEST]);
+
+    housedepot_metrics_single
+        (&out, "housedepot_worker_pending", "gauge",
+         "Storage jobs waiting for a worker.", housedepot_worker_pending ());
+    housedepot_metrics_single
+        (&out, "housedepot_retention_pending", "gauge",
+         "Files waiting for a retention check.",
+         housedepot_retention_pending ());
+    housedepot_metrics_single
+        (&out, "housedepot_cache_bytes", "gauge",
+         "Size of the content cached in memory.", housedepot_cache_size ());
+    housedepot_metrics_single
+        (&out, "housedepot_cache_hits_total", "counter",
+         "Requests served from the cache.", housedepot_cache_hits ());
+    housedepot_metrics_single
+        (&out, "housedepot_cache_misses_total", "counter",
+         "Requests that could not be served from the cache.",
+         housedepot_cache_misses ());
+
+    echttp_content_type_set ("text/plain; version=0.0.4");
+
+    housedepot_metrics_request (HOUSEDEPOT_METRICS_ROUTE_METRICS, action, start,
+                                length, out.cursor - housedepot_metrics_buffer);
+    return housedepot_metrics_buffer;
+}
+
+void housedepot_metrics_initialize (int argc, const char **argv) {
+    echttp_route_uri ("/depot/metrics", housedepot_metrics_page);
+}
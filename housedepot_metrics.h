@@ -0,0 +1,28 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_metrics.h - Count the requests and the storage operations.
+ */
+
+#define HOUSEDEPOT_METRICS_ROUTE_FILE    0
+#define HOUSEDEPOT_METRICS_ROUTE_HISTORY 1
+#define HOUSEDEPOT_METRICS_ROUTE_ALL     2
+#define HOUSEDEPOT_METRICS_ROUTE_EVENTS  3
+#define HOUSEDEPOT_METRICS_ROUTE_LIST    4
+#define HOUSEDEPOT_METRICS_ROUTE_CHECK   5
+#define HOUSEDEPOT_METRICS_ROUTE_METRICS 6
+#define HOUSEDEPOT_METRICS_ROUTES        7
+
+#define HOUSEDEPOT_METRICS_DUPLICATE 0
+#define HOUSEDEPOT_METRICS_PRUNED    1
+#define HOUSEDEPOT_METRICS_SCAN      2
+#define HOUSEDEPOT_METRICS_MANIFEST  3
+#define HOUSEDEPOT_METRICS_COUNTERS  4
+
+void housedepot_metrics_initialize (int argc, const char **argv);
+
+long long housedepot_metrics_start (void);
+void housedepot_metrics_request (int route, const char *method,
+                                 long long start,
+                                 long long received, long long sent);
+
+void housedepot_metrics_count (int counter, int increment);
@@ -0,0 +1,740 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_notify.c - Notify clients of changes without polling.
+ *
+ * DESCRIPTION
+ *
+ * The echttp library sends the response when the HTTP callback returns:
+ * a request cannot be kept waiting without blocking the whole service.
+ * This module runs a small, separate, HTTP listener that holds requests
+ * until there is something to report. Its sockets are polled by the echttp
+ * main loop, so that waiting clients cost nothing.
+ *
+ * The main HTTP service redirects to this listener the requests that must
+ * wait for a change, so clients only need to follow redirections. This
+ * listener uses a fixed port by default, and all its URLs start with
+ * /depot/notify, so that it can be declared to HousePortal separately
+ * from the main HTTP service.
+ *
+ * This listener does not go through echttp, and thus not through its
+ * access control: the redirection URL carries a single use ticket, which
+ * proves that the request was accepted by the main HTTP service. Requests
+ * without a valid ticket are rejected. No wildcard CORS header is sent:
+ * the origin of the request, if any, is only allowed with a valid ticket.
+ *
+ * Three requests are supported:
+ *
+ *   GET /depot/notify/check?since=<timestamp>&timeout=<seconds>
+ *
+ * This is a long poll for the global update timestamp. The response is
+ * sent as soon as the update timestamp is different from the one provided,
+ * or when the timeout expires. The response content is the same as for
+ * the regular /depot/check request.
+ *
+ *   GET /depot/notify/<repository>/events[?lastEventId=<sequence>]
+ *
+ * This is a Server-Sent Events stream that reports each change to the
+ * repository, as recorded by the event journal. The stream resumes after
+ * the sequence number provided in the Last-Event-ID header (or lastEventId
+ * parameter), if any. If the changes that followed are no longer known,
+ * a "reset" event tells the client to reload the whole repository.
+ *
+ *   GET /depot/notify/commit?id=<commit>
+ *
+ * This waits until the specified staged checkin is durable (see
+ * housedepot_revision_batch_stage), and then sends the response to the
+ * checkin: 200 on success, or 500 with the error. The main HTTP service
+ * redirects a staged PUT request here using a 303 status.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_notify_initialize (const char *host,
+ *                                    int argc, const char *argv[]);
+ *
+ *   Open the notification listener. The port is set using the
+ *   -notify-port=N option (default: 8047). A port 0 means a dynamic port.
+ *
+ * int housedepot_notify_listening (void);
+ *
+ *   Return the port of the notification listener, or 0 if it is not
+ *   available.
+ *
+ * const char *housedepot_notify_url (const char *host,
+ *                                    const char *path, const char *query);
+ *
+ *   Return the URL of the specified request on the notification listener,
+ *   or 0 if the listener is not available, or if too many tickets are
+ *   still waiting to be used. The path is the one of the
+ *   request on the main HTTP service. The host is the host name used
+ *   by the client, as found in the Host header, if any. A new ticket is
+ *   added to the query: this must only be called after the request was
+ *   accepted by the main HTTP service.
+ *
+ * void housedepot_notify_background (void);
+ *
+ *   Respond to the clients that have been waiting for a change, for their
+ *   checkin to be durable, or for too long, and send the new events to
+ *   the streaming clients. This must be called after each request is
+ *   processed, so that changes are reported quickly.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/random.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "housedepot_event.h"
+#include "housedepot_json.h"
+#include "housedepot_revision.h"
+#include "housedepot_notify.h"
+
+#define HOUSEDEPOT_NOTIFY_MAX      256
+#define HOUSEDEPOT_NOTIFY_REQUEST 1024
+#define HOUSEDEPOT_NOTIFY_TIMEOUT  300 // Longest wait allowed.
+#define HOUSEDEPOT_NOTIFY_RECEIVE   10 // Time allowed to send the request.
+#define HOUSEDEPOT_NOTIFY_KEEPALIVE 30 // Period of stream keepalives.
+#define HOUSEDEPOT_NOTIFY_TICKETS   64
+#define HOUSEDEPOT_NOTIFY_PORT    8047
+
+// The root of the listener's URLs, which replaces /depot.
+#define HOUSEDEPOT_NOTIFY_PATH "/depot/notify"
+
+#define HOUSEDEPOT_NOTIFY_RECEIVING 0
+#define HOUSEDEPOT_NOTIFY_POLLING   1
+#define HOUSEDEPOT_NOTIFY_STREAMING 2
+#define HOUSEDEPOT_NOTIFY_COMMITTING 3
+
+static const char *housedepot_notify_host;
+
+static int housedepot_notify_server = -1;
+static int housedepot_notify_port = HOUSEDEPOT_NOTIFY_PORT;
+
+static struct {
+    int fd;
+    int mode;
+    long long since;    // Polling: update timestamp. Streaming: sequence.
+                        // Committing: the staged checkin.
+    int repository;     // Streaming only: event journal handle.
+    time_t deadline;    // Polling, committing: timeout.
+                        // Streaming: next keepalive.
+    int length;
+    char origin[128];
+    char request[HOUSEDEPOT_NOTIFY_REQUEST];
+} housedepot_notify_clients[HOUSEDEPOT_NOTIFY_MAX];
+
+// The tickets issued by the main HTTP service, waiting to be used.
+//
+static struct {
+    char value[36];
+    time_t expires;
+} housedepot_notify_tickets[HOUSEDEPOT_NOTIFY_TICKETS];
+
+static int housedepot_notify_count = 0; // Highest slot used + 1.
+static int housedepot_notify_parked = 0;
+
+static long long housedepot_notify_updated = 0;
+static long long housedepot_notify_changes = 0;
+static long long housedepot_notify_committed = 0;
+
+static void housedepot_notify_close (int i) {
+
+    int fd = housedepot_notify_clients[i].fd;
+    if (fd < 0) return;
+    echttp_forget (fd);
+    close (fd);
+    housedepot_notify_clients[i].fd = -1;
+    if (housedepot_notify_clients[i].mode != HOUSEDEPOT_NOTIFY_RECEIVING) {
+        housedepot_notify_clients[i].mode = HOUSEDEPOT_NOTIFY_RECEIVING;
+        housedepot_notify_parked -= 1;
+    }
+    while ((housedepot_notify_count > 0) &&
+           (housedepot_notify_clients[housedepot_notify_count-1].fd < 0))
+        housedepot_notify_count -= 1;
+}
+
+// Allow the origin of the request, which was accepted by the main
+// HTTP service (see the ticket), but never any origin.
+//
+static const char *housedepot_notify_cors (int i) {
+    static char cors[192];
+    if (!housedepot_notify_clients[i].origin[0]) return "";
+    snprintf (cors, sizeof(cors),
+              "Access-Control-Allow-Origin: %s\r\nVary: Origin\r\n",
+              housedepot_notify_clients[i].origin);
+    return cors;
+}
+
+/* Send text on a stream. There is no output buffering: if the client
+ * cannot keep up, it is disconnected and will resume from its last event.
+ */
+static int housedepot_notify_write (int i, const char *text, int length) {
+
+    if (write (housedepot_notify_clients[i].fd, text, length) != length) {
+        housedepot_notify_close (i);
+        return -1;
+    }
+    return 0;
+}
+
+static void housedepot_notify_send (int i, int status, const char *reason,
+                                    const char *type, const char *body) {
+
+    char header[512];
+    int bodylength = strlen(body);
+    int length = snprintf (header, sizeof(header),
+                           "HTTP/1.1 %d %s\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Length: %d\r\n"
+                           "Cache-Control: no-store\r\n"
+                           "%s"
+                           "Connection: close\r\n\r\n",
+                           status, reason, type, bodylength,
+                           housedepot_notify_cors (i));
+
+    // The response is small: the socket buffer can always take it.
+    // If it does not, the connection is closed: the client will see
+    // a truncated response and retry.
+    //
+    if (housedepot_notify_write (i, header, length)) return;
+    if ((bodylength > 0) &&
+        housedepot_notify_write (i, body, bodylength)) return;
+    housedepot_notify_close (i);
+}
+
+static void housedepot_notify_check (int i) {
+
+    static housedepot_json json = HOUSEDEPOT_JSON_INIT;
+
+    housedepot_json_start (&json);
+    housedepot_json_object (&json, 0);
+    housedepot_json_string (&json, "host", housedepot_notify_host);
+    housedepot_json_integer (&json, "timestamp", (long long)time(0));
+    housedepot_json_integer (&json, "updated",
+                             housedepot_revision_get_update_timestamp());
+    housedepot_notify_send (i, 200, "OK", "application/json",
+                            housedepot_json_end (&json));
+}
+
+static void housedepot_notify_commit (int i) {
+
+    const char *error =
+        housedepot_revision_outcome (housedepot_notify_clients[i].since);
+    if (error)
+        housedepot_notify_send (i, 500, error, "text/plain", "");
+    else
+        housedepot_notify_send (i, 200, "OK", "text/plain", "");
+}
+
+/* Tell the client to start from scratch, because the events that followed
+ * its last one are not known anymore.
+ */
+static int housedepot_notify_reset (int i, int handle) {
+
+    char reset[128];
+    long long latest = housedepot_event_last (handle);
+    int length = snprintf (reset, sizeof(reset),
+                           "id: %lld-%lld\nevent: reset\ndata: {}\n\n",
+                           housedepot_event_epoch(), latest);
+    if (housedepot_notify_write (i, reset, length)) return -1;
+    housedepot_notify_clients[i].since = latest;
+    return 0;
+}
+
+static void housedepot_notify_stream (int i) {
+
+    static housedepot_json json = HOUSEDEPOT_JSON_INIT;
+    char header[128];
+
+    int handle = housedepot_notify_clients[i].repository;
+
+    // The client may have fallen behind more events than are kept.
+    if (housedepot_notify_clients[i].since + 1 < housedepot_event_first (handle)) {
+        if (housedepot_notify_reset (i, handle)) return;
+    }
+    for (;;) {
+        const housedepot_event *event =
+            housedepot_event_next (handle, housedepot_notify_clients[i].since);
+        if (!event) break;
+
+        housedepot_json_start (&json);
+        housedepot_json_object (&json, 0);
+        housedepot_json_string (&json, "file", event->file);
+        if (event->revision > 0)
+            housedepot_json_integer (&json, "rev", event->revision);
+        if (event->tag[0])
+            housedepot_json_string (&json, "tag", event->tag);
+        housedepot_json_integer (&json, "time", (long long)(event->time));
+        const char *data = housedepot_json_end (&json);
+
+        int length = snprintf (header, sizeof(header),
+                               "id: %lld-%lld\nevent: %s\ndata: ",
+                               housedepot_event_epoch(),
+                               event->sequence, event->action);
+        if (housedepot_notify_write (i, header, length)) return;
+        if (housedepot_notify_write (i, data, strlen(data))) return;
+        if (housedepot_notify_write (i, "\n\n", 2)) return;
+        housedepot_notify_clients[i].since = event->sequence;
+    }
+    housedepot_notify_clients[i].deadline =
+        time(0) + HOUSEDEPOT_NOTIFY_KEEPALIVE;
+}
+
+static void housedepot_notify_events (int i, const char *uri,
+                                      const char *last) {
+
+    // The URI is the repository's, followed by "/events".
+    char *sep = strrchr (uri, '/');
+    if (sep) *sep = 0;
+    int handle = housedepot_event_search (uri);
+    if (handle < 0) {
+        housedepot_notify_send (i, 404, "Not Found", "text/plain", "");
+        return;
+    }
+    char header[512];
+    int length = snprintf (header, sizeof(header),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/event-stream\r\n"
+                           "Cache-Control: no-store\r\n"
+                           "%s"
+                           "Connection: close\r\n\r\n"
+                           "retry: 3000\n\n", housedepot_notify_cors (i));
+    if (housedepot_notify_write (i, header, length)) return;
+
+    housedepot_notify_clients[i].mode = HOUSEDEPOT_NOTIFY_STREAMING;
+    housedepot_notify_clients[i].repository = handle;
+    housedepot_notify_parked += 1;
+
+    long long latest = housedepot_event_last (handle);
+    long long sequence = last ? housedepot_event_parse (last) : latest;
+    if ((sequence < 0) || (sequence > latest)) {
+        // The ID comes from a previous run of the service.
+        if (housedepot_notify_reset (i, handle)) return;
+    } else {
+        // If the events that followed were lost, the stream resets.
+        housedepot_notify_clients[i].since = sequence;
+    }
+    housedepot_notify_stream (i);
+}
+
+static const char *housedepot_notify_parameter (const char *query,
+                                                const char *name) {
+    int length = strlen(name);
+    while (query && *query) {
+        if ((!strncmp (query, name, length)) && (query[length] == '='))
+            return query + length + 1;
+        query = strchr (query, '&');
+        if (query) query += 1;
+    }
+    return 0;
+}
+
+static const char *housedepot_notify_ticket (void) {
+
+    static const char digits[] = "0123456789abcdef";
+    unsigned char random[16];
+
+    // A ticket that was not used yet is never reused before it expires:
+    // the request it was issued for would be rejected.
+    time_t now = time(0);
+    int t;
+    for (t = 0; t < HOUSEDEPOT_NOTIFY_TICKETS; ++t) {
+        if (housedepot_notify_tickets[t].expires < now) break;
+    }
+    if (t >= HOUSEDEPOT_NOTIFY_TICKETS) return 0; // All in use.
+
+    if (getrandom (random, sizeof(random), 0) != sizeof(random)) return 0;
+
+    char *value = housedepot_notify_tickets[t].value;
+    int j;
+    for (j = 0; j < sizeof(random); ++j) {
+        *(value++) = digits[random[j] >> 4];
+        *(value++) = digits[random[j] & 15];
+    }
+    *value = 0;
+    housedepot_notify_tickets[t].expires = now + HOUSEDEPOT_NOTIFY_RECEIVE;
+    return housedepot_notify_tickets[t].value;
+}
+
+// Return 1 if the ticket is valid. A ticket can be used only once.
+//
+static int housedepot_notify_redeem (const char *ticket) {
+
+    if (!ticket) return 0;
+    int length = strcspn (ticket, "&");
+    if (length != 32) return 0;
+
+    time_t now = time(0);
+    int t;
+    for (t = 0; t < HOUSEDEPOT_NOTIFY_TICKETS; ++t) {
+        if (housedepot_notify_tickets[t].expires < now) continue;
+        if (strncmp (housedepot_notify_tickets[t].value, ticket, length))
+            continue;
+        housedepot_notify_tickets[t].expires = 0;
+        housedepot_notify_tickets[t].value[0] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static const char *housedepot_notify_header (const char *request,
+                                             const char *name,
+                                             char *value, int size) {
+    int length = strlen(name);
+    const char *line;
+    for (line = strchr (request, '\n'); line; line = strchr (line, '\n')) {
+        line += 1;
+        if ((!strncasecmp (line, name, length)) && (line[length] == ':')) {
+            line += length + 1;
+            while (*line == ' ') line += 1;
+            snprintf (value, size,
+                      "%.*s", (int)strcspn (line, "\r\n"), line);
+            return value;
+        }
+    }
+    return 0;
+}
+
+static void housedepot_notify_request (int i) {
+
+    char *request = housedepot_notify_clients[i].request;
+
+    // The only headers needed are Origin, and Last-Event-ID for streams.
+    char origin[128];
+    if (!housedepot_notify_header (request, "Origin", origin, sizeof(origin)))
+        origin[0] = 0;
+    char id[64];
+    const char *last =
+        housedepot_notify_header (request, "Last-Event-ID", id, sizeof(id));
+
+    if (strncmp (request, "GET ", 4)) {
+        housedepot_notify_send (i, 405, "Method Not Allowed", "text/plain", "");
+        return;
+    }
+    char *uri = request + 4;
+    char *end = strchr (uri, ' ');
+    if (end) *end = 0;
+    char *query = strchr (uri, '?');
+    if (query) *(query++) = 0;
+
+    // The origin is allowed only if the main HTTP service accepted it.
+    if (!housedepot_notify_redeem
+             (housedepot_notify_parameter (query, "ticket"))) {
+        housedepot_notify_send (i, 403, "Forbidden", "text/plain", "");
+        return;
+    }
+    snprintf (housedepot_notify_clients[i].origin,
+              sizeof(housedepot_notify_clients[i].origin), "%s", origin);
+
+    // Restore the URI of the original request, which starts with /depot.
+    int root = strlen(HOUSEDEPOT_NOTIFY_PATH);
+    if (strncmp (uri, HOUSEDEPOT_NOTIFY_PATH "/", root + 1)) {
+        housedepot_notify_send (i, 404, "Not Found", "text/plain", "");
+        return;
+    }
+    uri += root - 6;
+    memcpy (uri, "/depot", 6);
+
+    if (!strcmp (uri, "/depot/commit")) {
+        const char *id = housedepot_notify_parameter (query, "id");
+        long long commit = id ? atoll(id) : 0;
+        if (commit <= 0) {
+            housedepot_notify_send (i, 400, "Bad Request", "text/plain", "");
+            return;
+        }
+        housedepot_notify_clients[i].since = commit;
+        if (commit <= housedepot_revision_committed()) {
+            housedepot_notify_commit (i);
+            return;
+        }
+        housedepot_notify_clients[i].mode = HOUSEDEPOT_NOTIFY_COMMITTING;
+        housedepot_notify_clients[i].deadline =
+            time(0) + HOUSEDEPOT_NOTIFY_TIMEOUT;
+        housedepot_notify_parked += 1;
+        return;
+    }
+
+    if (strcmp (uri, "/depot/check")) {
+        int length = strlen(uri);
+        if ((length > 7) && (!strcmp (uri + length - 7, "/events"))) {
+            if (!last) {
+                last = housedepot_notify_parameter (query, "lastEventId");
+                if (last) {
+                    snprintf (id, sizeof(id),
+                              "%.*s", (int)strcspn (last, "&"), last);
+                    last = id;
+                }
+            }
+            housedepot_notify_events (i, uri, last);
+            return;
+        }
+        housedepot_notify_send (i, 404, "Not Found", "text/plain", "");
+        return;
+    }
+
+    const char *since = housedepot_notify_parameter (query, "since");
+    const char *timeout = housedepot_notify_parameter (query, "timeout");
+    int delay = timeout ? atoi(timeout) : 0;
+    if (delay > HOUSEDEPOT_NOTIFY_TIMEOUT) delay = HOUSEDEPOT_NOTIFY_TIMEOUT;
+
+    housedepot_notify_clients[i].since = since ? atoll(since) : 0;
+    if ((delay <= 0) ||
+        (housedepot_notify_clients[i].since !=
+             housedepot_revision_get_update_timestamp())) {
+        housedepot_notify_check (i);
+        return;
+    }
+    housedepot_notify_clients[i].mode = HOUSEDEPOT_NOTIFY_POLLING;
+    housedepot_notify_clients[i].deadline = time(0) + delay;
+    housedepot_notify_parked += 1;
+}
+
+static int housedepot_notify_search (int fd) {
+    int i;
+    for (i = 0; i < housedepot_notify_count; ++i) {
+        if (housedepot_notify_clients[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+static void housedepot_notify_receive (int fd, int mode) {
+
+    int i = housedepot_notify_search (fd);
+    if (i < 0) {
+        echttp_forget (fd);
+        close (fd);
+        return;
+    }
+
+    if (housedepot_notify_clients[i].mode != HOUSEDEPOT_NOTIFY_RECEIVING) {
+        // Nothing more is expected from this client: this is either
+        // a disconnection or garbage.
+        char buffer[256];
+        if (read (fd, buffer, sizeof(buffer)) <= 0)
+            housedepot_notify_close (i);
+        return;
+    }
+
+    int length = housedepot_notify_clients[i].length;
+    int room = HOUSEDEPOT_NOTIFY_REQUEST - length - 1;
+    if (room <= 0) {
+        housedepot_notify_send (i, 431, "Request Header Fields Too Large",
+                                "text/plain", "");
+        return;
+    }
+    int count = read (fd, housedepot_notify_clients[i].request + length, room);
+    if (count <= 0) {
+        if ((count < 0) && (errno == EAGAIN)) return;
+        housedepot_notify_close (i);
+        return;
+    }
+    length += count;
+    housedepot_notify_clients[i].request[length] = 0;
+    housedepot_notify_clients[i].length = length;
+
+    if (strstr (housedepot_notify_clients[i].request, "\r\n\r\n"))
+        housedepot_notify_request (i);
+}
+
+static void housedepot_notify_accept (int fd, int mode) {
+
+    int client = accept (fd, 0, 0);
+    if (client < 0) return;
+    fcntl (client, F_SETFL, fcntl (client, F_GETFL) | O_NONBLOCK);
+    fcntl (client, F_SETFD, FD_CLOEXEC);
+
+    int i;
+    for (i = 0; i < HOUSEDEPOT_NOTIFY_MAX; ++i) {
+        if ((i >= housedepot_notify_count) ||
+            (housedepot_notify_clients[i].fd < 0)) break;
+    }
+    if (i >= HOUSEDEPOT_NOTIFY_MAX) {
+        close (client); // Too many waiting clients.
+        return;
+    }
+    if (i >= housedepot_notify_count) housedepot_notify_count = i + 1;
+
+    housedepot_notify_clients[i].fd = client;
+    housedepot_notify_clients[i].mode = HOUSEDEPOT_NOTIFY_RECEIVING;
+    housedepot_notify_clients[i].length = 0;
+    housedepot_notify_clients[i].origin[0] = 0;
+    housedepot_notify_clients[i].request[0] = 0;
+    housedepot_notify_clients[i].deadline = time(0) + HOUSEDEPOT_NOTIFY_RECEIVE;
+    echttp_listen (client, 1, housedepot_notify_receive, 0);
+}
+
+void housedepot_notify_initialize (const char *host,
+                                   int argc, const char *argv[]) {
+
+    int i;
+    const char *value;
+
+    housedepot_notify_host = host;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-notify-port=", argv[i], &value))
+            housedepot_notify_port = atoi(value);
+    }
+    for (i = 0; i < HOUSEDEPOT_NOTIFY_MAX; ++i)
+        housedepot_notify_clients[i].fd = -1;
+
+    int server = socket (AF_INET6, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (server < 0) goto failure;
+
+    int option = 1;
+    setsockopt (server, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    option = 0;
+    setsockopt (server, IPPROTO_IPV6, IPV6_V6ONLY, &option, sizeof(option));
+
+    struct sockaddr_in6 address;
+    socklen_t size = sizeof(address);
+    memset (&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(housedepot_notify_port);
+    if (bind (server, (struct sockaddr *)&address, size)) goto failure;
+    if (listen (server, 64)) goto failure;
+
+    if (getsockname (server, (struct sockaddr *)&address, &size)) goto failure;
+    housedepot_notify_port = ntohs(address.sin6_port);
+    housedepot_notify_server = server;
+    housedepot_notify_updated = housedepot_revision_get_update_timestamp();
+    housedepot_notify_changes = housedepot_event_changes();
+    housedepot_notify_committed = housedepot_revision_committed();
+    echttp_listen (server, 1, housedepot_notify_accept, 1);
+    houselog_trace (HOUSE_INFO, "NOTIFY",
+                    "LISTENING ON PORT %d", housedepot_notify_port);
+    return;
+
+failure:
+    houselog_trace (HOUSE_FAILURE, "NOTIFY",
+                    "CANNOT LISTEN: %s", strerror(errno));
+    if (server >= 0) close (server);
+}
+
+const char *housedepot_notify_url (const char *host,
+                                   const char *path, const char *query) {
+
+    static char url[1024];
+
+    if (housedepot_notify_server < 0) return 0;
+    if (strncmp (path, "/depot/", 7)) return 0;
+    const char *ticket = housedepot_notify_ticket ();
+    if (!ticket) return 0;
+
+    // Keep the host name or address used by the client, but not its port.
+    //
+    char name[256];
+    if (!host) host = housedepot_notify_host;
+    snprintf (name, sizeof(name), "%s", host);
+    char *port = strchr (name, (name[0] == '[') ? ']' : ':');
+    if (port) {
+        if (*port == ']') port += 1; // IPv6 address: keep the brackets.
+        *port = 0;
+    }
+
+    snprintf (url, sizeof(url),
+              "http://%s:%d" HOUSEDEPOT_NOTIFY_PATH "%s?%s%sticket=%s",
+              name, housedepot_notify_port, path + 6,
+              query ? query : "", query ? "&" : "", ticket);
+    return url;
+}
+
+int housedepot_notify_listening (void) {
+    return (housedepot_notify_server < 0) ? 0 : housedepot_notify_port;
+}
+
+void housedepot_notify_background (void) {
+
+    int i;
+    if (housedepot_notify_count <= 0) return;
+
+    long long updated = housedepot_revision_get_update_timestamp();
+    long long changes = housedepot_event_changes();
+    long long committed = housedepot_revision_committed();
+    time_t now = time(0);
+
+    if (committed != housedepot_notify_committed) {
+        housedepot_notify_committed = committed;
+        for (i = housedepot_notify_count - 1; i >= 0; --i) {
+            if (housedepot_notify_clients[i].fd < 0) continue;
+            if (housedepot_notify_clients[i].mode != HOUSEDEPOT_NOTIFY_COMMITTING)
+                continue;
+            if (housedepot_notify_clients[i].since > committed) continue;
+            housedepot_notify_commit (i);
+        }
+    }
+
+    if (updated != housedepot_notify_updated) {
+        housedepot_notify_updated = updated;
+        for (i = housedepot_notify_count - 1; i >= 0; --i) {
+            if (housedepot_notify_clients[i].fd < 0) continue;
+            if (housedepot_notify_clients[i].mode != HOUSEDEPOT_NOTIFY_POLLING)
+                continue;
+            if (housedepot_notify_clients[i].since == updated) continue;
+            housedepot_notify_check (i);
+        }
+    }
+
+    if (changes != housedepot_notify_changes) {
+        housedepot_notify_changes = changes;
+        for (i = housedepot_notify_count - 1; i >= 0; --i) {
+            if (housedepot_notify_clients[i].fd < 0) continue;
+            if (housedepot_notify_clients[i].mode != HOUSEDEPOT_NOTIFY_STREAMING)
+                continue;
+            housedepot_notify_stream (i);
+        }
+    }
+
+    for (i = housedepot_notify_count - 1; i >= 0; --i) {
+        if (housedepot_notify_clients[i].fd < 0) continue;
+        if (housedepot_notify_clients[i].deadline > now) continue;
+        switch (housedepot_notify_clients[i].mode) {
+            case HOUSEDEPOT_NOTIFY_POLLING:
+                housedepot_notify_check (i);
+                break;
+            case HOUSEDEPOT_NOTIFY_STREAMING:
+                // A comment line, which also detects dead connections.
+                if (housedepot_notify_write (i, ":\n\n", 3) == 0)
+                    housedepot_notify_clients[i].deadline =
+                        now + HOUSEDEPOT_NOTIFY_KEEPALIVE;
+                break;
+            case HOUSEDEPOT_NOTIFY_COMMITTING:
+                housedepot_notify_send (i, 503, "Service Unavailable",
+                                        "text/plain", "");
+                break;
+            default:
+                housedepot_notify_close (i); // Never sent its request.
+        }
+    }
+}
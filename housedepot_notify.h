@@ -0,0 +1,14 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_notify.h - Notify clients of changes without polling.
+ */
+
+void housedepot_notify_initialize (const char *host,
+                                   int argc, const char *argv[]);
+
+int housedepot_notify_listening (void);
+
+const char *housedepot_notify_url (const char *host,
+                                   const char *path, const char *query);
+
+void housedepot_notify_background (void);
@@ -27,37 +27,53 @@
  *                                        const char *parent);
  *
  *    Set the host and portal names, initialize the module's resources and
- *    initialize the context for each repository found.
+ *    initialize the context for each repository found. Repositories created
+ *    later in the parent directory are detected and initialized as well.
  */
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <time.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include "echttp.h"
 #include "echttp_static.h"
 #include "echttp_catalog.h"
 #include "echttp_libc.h"
+#include "echttp_json.h"
 
+#include <houselog.h>
+
+#include "housedepot_event.h"
+#include "housedepot_index.h"
+#include "housedepot_json.h"
+#include "housedepot_metrics.h"
+#include "housedepot_notify.h"
+#include "housedepot_retention.h"
 #include "housedepot_revision.h"
+#include "housedepot_storage.h"
+#include "housedepot_watch.h"
 #include "housedepot_repository.h"
 
 #define DEBUG if (housedepot_isdebug()) printf
 
 static echttp_catalog housedepot_repository_roots;
-static echttp_catalog housedepot_repository_depth;
 
 static echttp_catalog housedepot_repository_type;
 
 static const char *housedepot_repository_host;
 static const char *housedepot_repository_portal;
 
+static long long housedepot_repository_sent; // Size of a file transfer.
+
 /* List the supported content types.
  * Only list text-based format here: RCS does not handle binary data.
  */
@@ -77,7 +93,125 @@ static struct {
     {0, 0}
 };
 
-static const char *housedepot_repository_transfer (int fd,
+static const char *housedepot_repository_skip (const char *p, const char *end) {
+    while ((p < end) && ((*p == ' ') || (*p == '\t'))) p += 1;
+    return p;
+}
+
+// Return 1 if the client accepts the gzip content coding. Accept-Encoding
+// is a comma separated list of codings, each one optionally followed by
+// parameters, e.g. "gzip;q=0.5, br". Only the q parameter is meaningful:
+// a q value of 0 means that the coding is refused.
+//
+static int housedepot_repository_accept_gzip (void) {
+
+    const char *accepted = echttp_attribute_get ("Accept-Encoding");
+    if (!accepted) return 0;
+
+    while (*accepted) {
+        const char *end = accepted + strcspn (accepted, ",");
+        const char *p = housedepot_repository_skip (accepted, end);
+        accepted = *end ? end + 1 : end;
+
+        int length = strcspn (p, " \t;,");
+        if ((length != 4) || strncasecmp (p, "gzip", 4)) continue;
+        p += length;
+
+        // The first q parameter, if any, decides.
+        for (;;) {
+            p = housedepot_repository_skip (p, end);
+            if ((p >= end) || (*p != ';')) return 1;
+            p = housedepot_repository_skip (p + 1, end);
+            const char *name = p;
+            p += strcspn (p, " \t=;,");
+            if ((p - name != 1) || (tolower(*name) != 'q')) {
+                p += strcspn (p, ";,"); // Some other parameter.
+                continue;
+            }
+            p = housedepot_repository_skip (p, end);
+            if ((p >= end) || (*p != '=')) return 1;
+            p = housedepot_repository_skip (p + 1, end);
+            return (atof (p) > 0);
+        }
+    }
+    return 0;
+}
+
+static void housedepot_repository_content_type (const char *filename) {
+
+    const char *sep = strrchr (filename, '.');
+    if (sep) {
+        const char *content = echttp_catalog_get (&housedepot_repository_type, sep+1);
+        if (content) {
+            echttp_content_type_set (content);
+        }
+    }
+}
+
+/* Decode an HTTP date (RFC 9110 IMF-fixdate format). Return 0 if invalid.
+ */
+static time_t housedepot_repository_date (const char *text) {
+
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4];
+    struct tm date;
+
+    memset (&date, 0, sizeof(date));
+    if (sscanf (text, "%*3s, %d %3s %d %d:%d:%d GMT",
+                &date.tm_mday, month, &date.tm_year,
+                &date.tm_hour, &date.tm_min, &date.tm_sec) != 6) return 0;
+    const char *found = strstr (months, month);
+    if ((!found) || (strlen(month) != 3)) return 0;
+    date.tm_mon = (found - months) / 3;
+    date.tm_year -= 1900;
+    return timegm (&date);
+}
+
+/* Set the response headers that identify the revision being served, and
+ * check them against the client's conditional request headers, if any.
+ * Return 1 if the client already has this revision.
+ * The ETag is weak because the same revision may be sent compressed or not.
+ * A tag may be moved to an older revision, e.g. a rollback of "current":
+ * for a tag, the date must match the revision's date exactly. Only a
+ * specific revision number can be compared as "not modified since".
+ */
+static int housedepot_repository_unchanged (int revision, time_t mtime,
+                                            int numeric) {
+
+    char etag[64];
+    char ascii[64];
+
+    snprintf (etag, sizeof(etag), "W/\"%d-%lld\"", revision, (long long)mtime);
+    echttp_attribute_set ("ETag", etag);
+
+    struct tm gmt;
+    gmtime_r (&mtime, &gmt);
+    strftime (ascii, sizeof(ascii), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+    echttp_attribute_set ("Last-Modified", ascii);
+
+    snprintf (ascii, sizeof(ascii), "%d", revision);
+    echttp_attribute_set ("X-Depot-Revision", ascii);
+    echttp_attribute_set ("Vary", "Accept-Encoding");
+
+    // If-None-Match takes precedence over If-Modified-Since.
+    //
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match) {
+        if (strchr (match, '*')) return 1;
+        const char *tag = strchr (etag, '"'); // Weak comparison.
+        const char *cursor = strstr (match, tag);
+        return (cursor != 0);
+    }
+
+    const char *since = echttp_attribute_get ("If-Modified-Since");
+    if (since) {
+        time_t date = housedepot_repository_date (since);
+        if (date > 0) return numeric ? (mtime <= date) : (mtime == date);
+    }
+    return 0;
+}
+
+static const char *housedepot_repository_transfer (int fd, int gzip,
                                                    const char *filename,
                                                    const char *revision) {
 
@@ -97,14 +231,14 @@ static const char *housedepot_repository_transfer (int fd,
             printf ("Serving static file: %s\n", filename);
     }
 
-    const char *sep = strrchr (filename, '.');
-    if (sep) {
-        const char *content = echttp_catalog_get (&housedepot_repository_type, sep+1);
-        if (content) {
-            echttp_content_type_set (content);
-        }
-    }
-    echttp_transfer (fd, fileinfo.st_size);
+    // A compressed revision is sent from after its storage header.
+    off_t offset = lseek (fd, 0, SEEK_CUR);
+    if ((offset < 0) || (offset > fileinfo.st_size)) offset = 0;
+
+    housedepot_repository_content_type (filename);
+    if (gzip) echttp_attribute_set ("Content-Encoding", "gzip");
+    echttp_transfer (fd, fileinfo.st_size - offset);
+    housedepot_repository_sent = fileinfo.st_size - offset;
     return "";
 
 unsupported:
@@ -113,9 +247,153 @@ unsupported:
     return "";
 }
 
-static const char *housedepot_repository_page (const char *action,
-                                               const char *uri,
-                                               const char *data, int length) {
+// Create the parent directory of the file if needed. Return -1 on error,
+// 1 if the directory was created and 0 if it already existed.
+//
+static int housedepot_repository_parent (const char *filename) {
+
+    char parent[1024];
+    strtcpy (parent, filename, sizeof(parent));
+    char *subdir = strrchr (parent, '/');
+    if (subdir) {
+        *subdir = 0;
+        if (mkdir (parent, 0750) < 0) {
+            if (errno != EEXIST) return -1;
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Remove the parent directory created for a checkin that failed.
+// This does nothing if the directory is not empty.
+//
+static void housedepot_repository_unparent (const char *filename) {
+
+    char parent[1024];
+    strtcpy (parent, filename, sizeof(parent));
+    char *subdir = strrchr (parent, '/');
+    if (!subdir) return;
+    *subdir = 0;
+    if (rmdir (parent) == 0) housedepot_index_invalidate (parent);
+}
+
+// Commit the pending checkin. In a durable repository, it is staged for
+// the next group commit instead: the client is redirected to the
+// notification listener, which answers once the checkin is on disk. If
+// no redirection is possible, the client is only told that the checkin
+// was accepted. (If a staged checkin fails, the groups created for it
+// are left behind, empty.)
+//
+static const char *housedepot_repository_finish (void) {
+
+    long long commit = 0;
+    if (housedepot_notify_listening ())
+        commit = housedepot_revision_batch_stage ();
+    if (commit <= 0) return housedepot_revision_batch_commit ();
+
+    char query[64];
+    snprintf (query, sizeof(query), "id=%lld", commit);
+    const char *url = housedepot_notify_url
+                          (echttp_attribute_get ("Host"), "/depot/commit", query);
+    if (url) {
+        echttp_attribute_set ("Location", url);
+        echttp_error (303, "See Other");
+    } else {
+        echttp_error (202, "Accepted");
+    }
+    return 0;
+}
+
+// Checkin multiple files as one transaction: the data is a JSON object
+// where each item's name is the path of a file, relative to the URI,
+// and each item's value is the new content of that file.
+//
+#define HOUSEDEPOT_REPOSITORY_BATCH 64
+
+static const char *housedepot_repository_commit (const char *clienturi,
+                                                 const char *dirname,
+                                                 time_t timestamp,
+                                                 const char *data, int length) {
+    ParserToken tokens[HOUSEDEPOT_REPOSITORY_BATCH+1];
+    char created[HOUSEDEPOT_REPOSITORY_BATCH+1];
+    int count = HOUSEDEPOT_REPOSITORY_BATCH+1;
+    char clientname[2048];
+    char filename[2048];
+    int i;
+
+    if (length <= 0) return "no data";
+    char *json = malloc (length+1);
+    if (!json) return "no more memory";
+    memcpy (json, data, length);
+    json[length] = 0;
+
+    const char *error = echttp_json_parse (json, tokens, &count);
+    if (!error) {
+        if ((count < 1) || (tokens[0].type != PARSER_OBJECT))
+            error = "invalid file list";
+        else if (tokens[0].length != count - 1)
+            error = "invalid file content";
+    }
+    for (i = 1; (i < count) && (!error); ++i) {
+        const char *name = tokens[i].key;
+        if (tokens[i].type != PARSER_STRING) error = "invalid file content";
+        else if ((!name) || (!name[0]) || (name[0] == '/')) error = "invalid file name";
+        else if (strstr (name, "..") || strchr (name, '~')) error = "invalid file name";
+        else {
+            const char *sep = strchr (name, '/');
+            if (sep && strchr (sep+1, '/')) error = "invalid file path";
+        }
+    }
+    if (error) {
+        free (json);
+        return error;
+    }
+
+    memset (created, 0, sizeof(created));
+    housedepot_revision_batch_start ();
+    for (i = 1; i < count; ++i) {
+        snprintf (clientname, sizeof(clientname),
+                  "%s/%s", clienturi, tokens[i].key);
+        snprintf (filename, sizeof(filename), "%s/%s", dirname, tokens[i].key);
+        int made = housedepot_repository_parent (filename);
+        if (made < 0) {
+            error = "URI too deep";
+            break;
+        }
+        created[i] = made;
+        const char *content = tokens[i].value.string;
+        error = housedepot_revision_batch_add
+                    (clientname, filename, timestamp, content, strlen(content));
+        if (error) break;
+    }
+    if (error)
+        housedepot_revision_batch_cancel ();
+    else
+        error = housedepot_repository_finish ();
+    if (error) {
+        // Do not leave behind the groups created for this batch.
+        for (i = 1; i < count; ++i) {
+            if (!created[i]) continue;
+            snprintf (filename, sizeof(filename),
+                      "%s/%s", dirname, tokens[i].key);
+            housedepot_repository_unparent (filename);
+        }
+    } else {
+        for (i = 1; i < count; ++i) {
+            snprintf (filename, sizeof(filename),
+                      "%s/%s", dirname, tokens[i].key);
+            housedepot_retention_changed (filename);
+        }
+    }
+    free (json);
+    return error;
+}
+
+static const char *housedepot_repository_serve (const char *action,
+                                                const char *uri,
+                                                const char *data, int length) {
     const char *path;
     char localuri[1024];
     char rooturi[1024];
@@ -166,11 +444,51 @@ static const char *housedepot_repository_page (const char *action,
     char *p = stpecpy (filename, end, path);
     stpecpy (p, end, localuri+strlen(rooturi));
 
+    // The repository's change feed must be held open: the request is
+    // redirected to the notification listener.
+    //
+    if ((!is_all) && (!strcmp (localuri+strlen(rooturi), "/events"))) {
+        if (strcmp (action, "GET")) {
+            echttp_error (405, "Method Not Allowed");
+            return "";
+        }
+        char query[64];
+        const char *last = echttp_attribute_get ("Last-Event-ID");
+        if (!last) last = echttp_parameter_get ("lastEventId");
+        if (last) // The ID is "<epoch>-<sequence>": only digits and '-'.
+            snprintf (query, sizeof(query), "lastEventId=%.*s",
+                      (int)strspn (last, "0123456789-"), last);
+        const char *url = housedepot_notify_url
+                              (echttp_attribute_get ("Host"),
+                               localuri, last ? query : 0);
+        if (!url) {
+            echttp_error (503, "Service Unavailable");
+            return "";
+        }
+        echttp_redirect (url);
+        return "";
+    }
+
     const char *revision = echttp_parameter_get ("revision");
 
-    if (!strcmp (action, "GET")) {
+    int is_head = !strcmp (action, "HEAD");
+    if (is_head || (!strcmp (action, "GET"))) {
         if (is_all) {
             echttp_content_type_json();
+            const char *files = echttp_parameter_get ("files");
+            if (files || echttp_parameter_get ("content")) {
+                // The contents are subject to the same visibility rules
+                // as individual files. At the root of the repository, the
+                // visibility of each file depends on its group or name.
+                //
+                int below = (strlen(localuri) > strlen(rooturi));
+                if (below && (!visible)) {
+                    echttp_error (404, "Path not visible");
+                    return "";
+                }
+                return housedepot_revision_bundle
+                           (localuri, filename, files, revision, visible);
+            }
             return housedepot_revision_list (localuri, filename);
         }
         if (!visible) {
@@ -188,40 +506,78 @@ static const char *housedepot_repository_page (const char *action,
             }
             return data;
         }
-        int fd = housedepot_revision_checkout (filename, revision);
-        return housedepot_repository_transfer (fd, filename, revision);
+
+        // Resolve the revision from the index first: a client that already
+        // has this revision does not need the file to be opened.
+        //
+        time_t mtime;
+        int rev = housedepot_revision_stat (filename, revision, &mtime);
+        if (rev <= 0) {
+            echttp_error (404, "File not found");
+            return "";
+        }
+        int numeric = revision && isdigit (revision[0]);
+        if (housedepot_repository_unchanged (rev, mtime, numeric)) {
+            echttp_error (304, "Not Modified");
+            return "";
+        }
+        // A HEAD request goes through the same steps as GET, so that its
+        // Content-Length and Content-Encoding headers are the ones that
+        // GET would return: echttp does not send the body of a HEAD.
+        //
+        const char *cached = housedepot_revision_cached (filename, rev);
+        if (cached) {
+            if (echttp_isdebug())
+                printf ("Serving cached file: %s\n", filename);
+            housedepot_repository_content_type (filename);
+            return cached;
+        }
+        char resolved[16];
+        snprintf (resolved, sizeof(resolved), "%d", rev);
+        int gzip = housedepot_repository_accept_gzip ();
+        int fd = housedepot_revision_checkout (filename, resolved, &gzip);
+        return housedepot_repository_transfer (fd, gzip, filename, revision);
     }
 
     if (is_all) {
-        echttp_error (500, "Invalid URI"); // Only valid in GET method.
+        if (strcmp (action, "PUT")) {
+            echttp_error (500, "Invalid URI"); // Only valid in GET or PUT.
+            return "";
+        }
+        time_t timestamp = 0;
+        const char *timestampstring = echttp_parameter_get ("time");
+        if (timestampstring) timestamp = atoll(timestampstring);
+
+        error = housedepot_repository_commit
+                    (localuri, filename, timestamp, data, length);
+        if (error) {
+            echttp_error (500, error);
+            return "";
+        }
         return "";
     }
 
     if (!strcmp (action, "PUT")) {
-        char parent[1024];
-        strtcpy (parent, filename, sizeof(parent));
-        char *subdir = strrchr (parent, '/');
-        if (subdir) {
-            *subdir = 0;
-            if (mkdir (parent, 0750) < 0) {
-                if (errno != EEXIST) {
-                    echttp_error (500, "URI too deep");
-                    return "";
-                }
-            }
+        int created = housedepot_repository_parent (filename);
+        if (created < 0) {
+            echttp_error (500, "URI too deep");
+            return "";
         }
         time_t timestamp = 0;
         const char *timestampstring = echttp_parameter_get ("time");
         if (timestampstring) timestamp = atoll(timestampstring);
 
-        error = housedepot_revision_checkin
+        housedepot_revision_batch_start ();
+        error = housedepot_revision_batch_add
                    (localuri, filename, timestamp, data, length);
-        if (error) echttp_error (500, error);
-
-        const char *depth = echttp_catalog_get (&housedepot_repository_depth, rooturi);
-        if (depth) {
-           housedepot_revision_prune (localuri, filename, atoi(depth));
-        }
+        if (error)
+            housedepot_revision_batch_cancel ();
+        else
+            error = housedepot_repository_finish ();
+        if (error) {
+            if (created) housedepot_repository_unparent (filename);
+            echttp_error (500, error);
+        } else housedepot_retention_changed (filename);
         return "";
     }
 
@@ -254,19 +610,43 @@ static const char *housedepot_repository_page (const char *action,
     return "";
 }
 
-static char housedepot_repositories[65537];
-static int housedepot_repositories_cursor;
-static char *housedepot_repositories_sep;
+static const char *housedepot_repository_page (const char *action,
+                                               const char *uri,
+                                               const char *data, int length) {
+
+    long long start = housedepot_metrics_start ();
+    housedepot_repository_sent = 0;
+    housedepot_json_transferred (); // Forget any earlier transfer.
+
+    const char *response =
+        housedepot_repository_serve (action, uri, data, length);
+
+    int route = HOUSEDEPOT_METRICS_ROUTE_FILE;
+    const char *base = strrchr (uri, '/');
+    if (base && (!strcmp (base, "/all"))) {
+        route = HOUSEDEPOT_METRICS_ROUTE_ALL;
+    } else if (base && (!strcmp (base, "/events"))) {
+        route = HOUSEDEPOT_METRICS_ROUTE_EVENTS;
+    } else if ((!strcmp (action, "GET")) || (!strcmp (action, "HEAD"))) {
+        const char *revision = echttp_parameter_get ("revision");
+        if (revision && (!strcmp (revision, "all")))
+            route = HOUSEDEPOT_METRICS_ROUTE_HISTORY;
+    }
+    // A large JSON response was sent as a file transfer.
+    if (!housedepot_repository_sent)
+        housedepot_repository_sent = housedepot_json_transferred ();
+    if (!housedepot_repository_sent) housedepot_repository_sent = strlen(response);
+    housedepot_metrics_request (route, action, start,
+                                length, housedepot_repository_sent);
+    return response;
+}
+
+static housedepot_json housedepot_repositories = HOUSEDEPOT_JSON_INIT;
 
 static int housedepot_repository_list_iterator (const char *name,
                                                 const char *value) {
 
-    housedepot_repositories_cursor +=
-        snprintf (housedepot_repositories+housedepot_repositories_cursor,
-                  sizeof(housedepot_repositories)-housedepot_repositories_cursor,
-                  "%s\"%s\"", housedepot_repositories_sep, name);
-
-    housedepot_repositories_sep = ",";
+    housedepot_json_string (&housedepot_repositories, 0, name);
     return 0;
 }
 
@@ -274,50 +654,93 @@ static const char *housedepot_repository_list (const char *action,
                                                const char *uri,
                                                const char *data, int length) {
 
-    char *buffer = housedepot_repositories;
-    const int size = sizeof(housedepot_repositories);
+    long long start = housedepot_metrics_start ();
+    housedepot_json *json = &housedepot_repositories;
 
-    int cursor = snprintf (buffer, size,
-                           "{\"host\":\"%s\",\"timestamp\":%d",
-                           housedepot_repository_host, (int)time(0));
-    if (housedepot_repository_portal)
-        cursor += snprintf (buffer+cursor, size-cursor,
-                           ",\"proxy\":\"%s\"", housedepot_repository_portal);
-    cursor += snprintf (buffer+cursor, size-cursor, ",\"repositories\":[");
-
-    housedepot_repositories_cursor = cursor;
-    housedepot_repositories_sep = "";
+    housedepot_json_start (json);
+    housedepot_json_object (json, 0);
+    housedepot_json_header (json,
+                            housedepot_repository_host,
+                            housedepot_repository_portal);
+    housedepot_json_array (json, "repositories");
     echttp_catalog_enumerate (&housedepot_repository_roots,
                               housedepot_repository_list_iterator);
 
-    cursor = housedepot_repositories_cursor;
-    snprintf (buffer+cursor, size-cursor, "]}");
     echttp_content_type_json();
-    return buffer;
+    const char *response = housedepot_json_end (json);
+    long long sent = housedepot_json_transferred ();
+    housedepot_metrics_request (HOUSEDEPOT_METRICS_ROUTE_LIST, action, start,
+                                length, sent ? sent : strlen(response));
+    return response;
 }
 
 static const char *housedepot_repository_check (const char *action,
                                                 const char *uri,
                                                 const char *data, int length) {
 
-    snprintf (housedepot_repositories, sizeof(housedepot_repositories),
-              "{\"host\":\"%s\",\"timestamp\":%d,\"updated\":%lld}",
-              housedepot_repository_host, (int)time(0),
-              housedepot_revision_get_update_timestamp());
+    long long start = housedepot_metrics_start ();
+
+    // A client that wants to wait for the next change is redirected
+    // to the notification listener, which can hold the request. If that
+    // is not possible, e.g. all the tickets are in use, the client is
+    // answered immediately, as if it had not asked to wait.
+    //
+    const char *since = echttp_parameter_get ("since");
+    const char *timeout = echttp_parameter_get ("timeout");
+    if (since && timeout && (atoi(timeout) > 0) &&
+        (atoll(since) == housedepot_revision_get_update_timestamp())) {
+        char query[128];
+        snprintf (query, sizeof(query), "since=%lld&timeout=%d",
+                  atoll(since), atoi(timeout));
+        const char *url = housedepot_notify_url
+                              (echttp_attribute_get ("Host"), uri, query);
+        if (url) {
+            echttp_redirect (url);
+            housedepot_metrics_request (HOUSEDEPOT_METRICS_ROUTE_CHECK,
+                                        action, start, length, 0);
+            return "";
+        }
+    }
+
+    housedepot_json *json = &housedepot_repositories;
+
+    housedepot_json_start (json);
+    housedepot_json_object (json, 0);
+    housedepot_json_string (json, "host", housedepot_repository_host);
+    housedepot_json_integer (json, "timestamp", (long long)time(0));
+    housedepot_json_integer (json, "updated",
+                             housedepot_revision_get_update_timestamp());
     echttp_content_type_json();
-    return housedepot_repositories;
+    const char *response = housedepot_json_end (json);
+    housedepot_metrics_request (HOUSEDEPOT_METRICS_ROUTE_CHECK, action, start,
+                                length, strlen(response));
+    return response;
 }
 
 static int housedepot_repository_route (const char *uri, const char *path) {
 
     echttp_catalog_set (&housedepot_repository_roots, uri, path);
+    housedepot_event_repository (uri, path);
+    housedepot_index_open (path); // Keep the repository root open.
+    housedepot_watch_repository (path);
+    housedepot_retention_repository (uri, path);
     char options[256];
     snprintf (options, sizeof(options), "%s/.options", path);
     FILE *file = fopen (options, "r");
     if (file) {
        while (fgets (options, sizeof(options), file)) {
+          char *eol = strchr (options, '\n');
+          if (eol) *eol = 0;
           if (strstr (options, "depth ") == options) {
-             echttp_catalog_set (&housedepot_repository_depth, uri, strdup(options+6));
+             housedepot_retention_option (path, "depth", options+6);
+          } else if (strstr (options, "age ") == options) {
+             housedepot_retention_option (path, "age", options+4);
+          } else if (strstr (options, "size ") == options) {
+             housedepot_retention_option (path, "size", options+5);
+          } else if (strstr (options, "storage ") == options) {
+             housedepot_storage_option (path, "storage", options+8);
+          } else if (strstr (options, "durability ") == options) {
+             housedepot_storage_option (path, "durability", options+11);
           }
        }
        fclose (file);
@@ -325,6 +748,22 @@ static int housedepot_repository_route (const char *uri, const char *path) {
     return echttp_route_match (uri, housedepot_repository_page);
 }
 
+static const char *housedepot_repository_top = 0;
+
+// A new repository directory was created while the service was running.
+//
+static void housedepot_repository_discover (const char *name) {
+
+    char uri[300];
+    char path[350];
+    snprintf (uri, sizeof(uri), "/depot/%s", name);
+    if (echttp_catalog_get (&housedepot_repository_roots, uri)) return;
+
+    snprintf (path, sizeof(path), "%s/%s", housedepot_repository_top, name);
+    houselog_event ("REPOSITORY", uri, "ADDED", "PATH %s", path);
+    housedepot_repository_route (strdup(uri), strdup(path));
+}
+
 void housedepot_repository_initialize (const char *hostname,
                                        const char *portal,
                                        const char *parent) {
@@ -343,6 +782,9 @@ void housedepot_repository_initialize (const char *hostname,
         echttp_route_uri ("/depot/all", housedepot_repository_list);
         echttp_route_uri ("/depot/check", housedepot_repository_check);
 
+        housedepot_repository_top = parent;
+        housedepot_watch_initialize (parent, housedepot_repository_discover);
+
         // Find out all the repositories and initialize them.
         struct dirent **files = 0;
         int n = scandir (parent, &files, 0, 0);
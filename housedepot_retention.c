@@ -0,0 +1,525 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_retention.c - Remove the old revisions in the background.
+ *
+ * DESCRIPTION
+ *
+ * Each repository may define retention rules in its .options file:
+ *
+ *   depth N   Keep only the N most recent revisions of each file.
+ *   age N     Remove the revisions older than N days.
+ *   size N    Keep the total size of all revisions below N bytes, removing
+ *             the oldest revisions of the repository first.
+ *
+ * The current and latest revisions of a file are never removed, whatever
+ * the rules say.
+ *
+ * The rules are not enforced when a file is modified: the file is only
+ * queued, and the revisions are removed later from the background task.
+ * The repositories with rules are also swept periodically, since the age
+ * and size rules may be violated without any change to a specific file.
+ *
+ * The work done per second is limited (option -prune-budget=N, default 100,
+ * 0 means no limit), so that a large cleanup does not compete with the
+ * clients for disk access: the work remaining is carried over to the next
+ * second. Each revision removed, each file checked and each directory
+ * walked by a sweep (which may load it from disk) counts against this
+ * budget. With a budget, a sweep walks at most one directory per second.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_retention_initialize (int argc, const char **argv);
+ *
+ *   Retrieve the retention options from the command line.
+ *
+ * void housedepot_retention_repository (const char *uri, const char *path);
+ *
+ *   Declare a repository, identified by its URI and its local path.
+ *
+ * void housedepot_retention_option (const char *path,
+ *                                   const char *name, const char *value);
+ *
+ *   Set one retention rule for the specified repository. The supported
+ *   names are "depth", "age" and "size".
+ *
+ * void housedepot_retention_changed (const char *filename);
+ *
+ *   Queue the specified file for a check of its repository's rules.
+ *
+ * void housedepot_retention_background (time_t now);
+ *
+ *   Remove old revisions, within the budget. This must be called once
+ *   per second.
+ *
+ * int housedepot_retention_pending (void);
+ * long long housedepot_retention_removed (void);
+ *
+ *   Return the number of files queued, and the total number of revisions
+ *   removed so far.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include <houselog.h>
+
+#include "housedepot_index.h"
+#include "housedepot_revision.h"
+#include "housedepot_retention.h"
+
+#define HOUSEDEPOT_RETENTION_MAX    64
+#define HOUSEDEPOT_RETENTION_SWEEP 600 // Seconds between two sweeps.
+
+static struct {
+    char *uri;
+    char *path;
+    int   length;
+    int   depth;
+    time_t age;
+    long long size;
+    time_t swept;
+} housedepot_retention_rules[HOUSEDEPOT_RETENTION_MAX];
+
+static int housedepot_retention_count = 0;
+
+typedef struct housedepot_retention_task housedepot_retention_task;
+
+struct housedepot_retention_task {
+    housedepot_retention_task *next;
+    int rule;
+    int oldest; // Set by the size rule, 0 otherwise.
+    char filename[1];
+};
+
+static housedepot_retention_task *housedepot_retention_head = 0;
+static housedepot_retention_task *housedepot_retention_tail = 0;
+static int housedepot_retention_queued = 0;
+
+static int housedepot_retention_budget = 100;
+static long long housedepot_retention_total = 0;
+
+void housedepot_retention_initialize (int argc, const char **argv) {
+
+    const char *budget = 0;
+    int i;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-prune-budget=", argv[i], &budget);
+    }
+    if (budget) housedepot_retention_budget = atoi (budget);
+}
+
+void housedepot_retention_repository (const char *uri, const char *path) {
+
+    if (housedepot_retention_count >= HOUSEDEPOT_RETENTION_MAX) return;
+
+    int i = housedepot_retention_count++;
+    housedepot_retention_rules[i].uri = strdup (uri);
+    housedepot_retention_rules[i].path = strdup (path);
+    housedepot_retention_rules[i].length = strlen(path);
+    housedepot_retention_rules[i].depth = 0;
+    housedepot_retention_rules[i].age = 0;
+    housedepot_retention_rules[i].size = 0;
+    housedepot_retention_rules[i].swept = 0;
+}
+
+static int housedepot_retention_search (const char *filename) {
+    int i;
+    for (i = 0; i < housedepot_retention_count; ++i) {
+        int length = housedepot_retention_rules[i].length;
+        if ((!strncmp (filename, housedepot_retention_rules[i].path, length))
+            && (filename[length] == '/')) return i;
+    }
+    return -1;
+}
+
+void housedepot_retention_option (const char *path,
+                                  const char *name, const char *value) {
+    int i;
+    for (i = 0; i < housedepot_retention_count; ++i) {
+        if (!strcmp (housedepot_retention_rules[i].path, path)) break;
+    }
+    if (i >= housedepot_retention_count) return;
+
+    if (!strcmp (name, "depth")) {
+        int depth = atoi (value);
+        if (depth < 2) depth = 0; // Never prune that bad..
+        housedepot_retention_rules[i].depth = depth;
+    } else if (!strcmp (name, "age")) {
+        housedepot_retention_rules[i].age = (time_t)atoi(value) * 86400;
+    } else if (!strcmp (name, "size")) {
+        housedepot_retention_rules[i].size = atoll (value);
+    } else {
+        return;
+    }
+    houselog_trace (HOUSE_INFO, housedepot_retention_rules[i].uri,
+                    "retention %s %s", name, value);
+}
+
+static void housedepot_retention_queue (const char *filename,
+                                        int rule, int oldest) {
+
+    // Checkins to the same file tend to come in bursts: only queue once.
+    housedepot_retention_task *tail = housedepot_retention_tail;
+    if (tail && (tail->oldest == oldest) && (!strcmp (tail->filename, filename)))
+        return;
+
+    int length = strlen (filename);
+    housedepot_retention_task *task =
+        malloc (sizeof(housedepot_retention_task) + length);
+    if (!task) return;
+    task->next = 0;
+    task->rule = rule;
+    task->oldest = oldest;
+    memcpy (task->filename, filename, length+1);
+
+    if (tail) tail->next = task;
+    else      housedepot_retention_head = task;
+    housedepot_retention_tail = task;
+    housedepot_retention_queued += 1;
+}
+
+void housedepot_retention_changed (const char *filename) {
+
+    int rule = housedepot_retention_search (filename);
+    if (rule < 0) return;
+    if ((!housedepot_retention_rules[rule].depth) &&
+        (!housedepot_retention_rules[rule].age)) return;
+    housedepot_retention_queue (filename, rule, 0);
+}
+
+// The candidates for removal by the size rule, oldest first. The index
+// may change between two steps of a sweep: the files are identified by
+// name, one copy per file.
+//
+typedef struct {
+    const char *filename;
+    int revision;
+    time_t time;
+    long long size;
+} housedepot_retention_candidate;
+
+// The sweep in progress, one directory at a time: the repository itself
+// first, then its groups in name order.
+//
+static struct {
+    int rule; // -1 if no sweep is in progress.
+    int root; // 1 once the repository directory itself was walked.
+    char *group; // Name of the last group walked, if any.
+    housedepot_retention_candidate *list;
+    int count;
+    int size;
+    char **names;
+    int namecount;
+    int namesize;
+    long long total;
+} housedepot_retention_sweeping = {-1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static int housedepot_retention_older (const void *a, const void *b) {
+    const housedepot_retention_candidate *ca = a;
+    const housedepot_retention_candidate *cb = b;
+    if (ca->time != cb->time) return (ca->time < cb->time) ? -1 : 1;
+    return ca->revision - cb->revision;
+}
+
+static int housedepot_retention_byfile (const void *a, const void *b) {
+    const housedepot_retention_candidate *ca = a;
+    const housedepot_retention_candidate *cb = b;
+    if (ca->filename != cb->filename)
+        return (ca->filename < cb->filename) ? -1 : 1;
+    return ca->revision - cb->revision;
+}
+
+static const char *housedepot_retention_name (const char *filename) {
+
+    if (housedepot_retention_sweeping.namecount >=
+            housedepot_retention_sweeping.namesize) {
+        int newsize = housedepot_retention_sweeping.namesize ?
+                          (housedepot_retention_sweeping.namesize * 2) : 64;
+        char **newnames = realloc (housedepot_retention_sweeping.names,
+                                   newsize * sizeof(char *));
+        if (!newnames) return 0;
+        housedepot_retention_sweeping.names = newnames;
+        housedepot_retention_sweeping.namesize = newsize;
+    }
+    char *name = strdup (filename);
+    if (name)
+        housedepot_retention_sweeping.names
+            [housedepot_retention_sweeping.namecount++] = name;
+    return name;
+}
+
+static void housedepot_retention_walk (housedepot_index_directory *dir,
+                                       int rule) {
+
+    housedepot_index_file *file;
+    for (file = dir->files; file; file = file->next) {
+
+        if ((file->latest <= 0) || (file->current <= 0)) continue;
+
+        if (housedepot_retention_rules[rule].depth ||
+            housedepot_retention_rules[rule].age)
+            housedepot_retention_queue (file->filename, rule, 0);
+
+        if (!housedepot_retention_rules[rule].size) continue;
+
+        const char *name = 0;
+        int i;
+        for (i = 0; i < file->count; ++i) {
+            housedepot_index_revision *rev = file->revisions + i;
+            housedepot_retention_sweeping.total += rev->size;
+            if ((rev->revision == file->current) ||
+                (rev->revision == file->latest)) continue;
+            if (!name) name = housedepot_retention_name (file->filename);
+            if (!name) continue;
+            if (housedepot_retention_sweeping.count >=
+                    housedepot_retention_sweeping.size) {
+                int newsize = housedepot_retention_sweeping.size ?
+                                  (housedepot_retention_sweeping.size * 2) : 256;
+                housedepot_retention_candidate *newlist =
+                    realloc (housedepot_retention_sweeping.list,
+                             newsize * sizeof(housedepot_retention_candidate));
+                if (!newlist) continue;
+                housedepot_retention_sweeping.list = newlist;
+                housedepot_retention_sweeping.size = newsize;
+            }
+            housedepot_retention_candidate *item =
+                housedepot_retention_sweeping.list
+                    + housedepot_retention_sweeping.count++;
+            item->filename = name;
+            item->revision = rev->revision;
+            item->time = rev->time;
+            item->size = rev->size;
+        }
+    }
+}
+
+// All directories were walked: apply the size rule and start over.
+//
+static void housedepot_retention_complete (void) {
+
+    int rule = housedepot_retention_sweeping.rule;
+    housedepot_retention_candidate *list = housedepot_retention_sweeping.list;
+    int count = housedepot_retention_sweeping.count;
+    long long total = housedepot_retention_sweeping.total;
+
+    long long excess = total - housedepot_retention_rules[rule].size;
+    if (housedepot_retention_rules[rule].size && (excess > 0) && (count > 0)) {
+
+        // Select the oldest revisions of the whole repository, then queue
+        // one task per file, up to the most recent revision selected.
+        //
+        qsort (list, count, sizeof(*list), housedepot_retention_older);
+        int selected = 0;
+        while ((selected < count) && (excess > 0)) {
+            excess -= list[selected++].size;
+        }
+        houselog_trace (HOUSE_INFO, housedepot_retention_rules[rule].uri,
+                        "%lld bytes over the %lld limit, %d revisions to remove",
+                        total - housedepot_retention_rules[rule].size,
+                        housedepot_retention_rules[rule].size, selected);
+
+        qsort (list, selected, sizeof(*list), housedepot_retention_byfile);
+        int i;
+        for (i = 0; i < selected; ++i) {
+            if ((i + 1 < selected) &&
+                (list[i+1].filename == list[i].filename)) continue;
+            housedepot_retention_queue (list[i].filename, rule, list[i].revision);
+        }
+    }
+
+    int i;
+    for (i = 0; i < housedepot_retention_sweeping.namecount; ++i)
+        free (housedepot_retention_sweeping.names[i]);
+    free (housedepot_retention_sweeping.names);
+    free (housedepot_retention_sweeping.list);
+    free (housedepot_retention_sweeping.group);
+    housedepot_retention_sweeping.names = 0;
+    housedepot_retention_sweeping.namecount = 0;
+    housedepot_retention_sweeping.namesize = 0;
+    housedepot_retention_sweeping.list = 0;
+    housedepot_retention_sweeping.count = 0;
+    housedepot_retention_sweeping.size = 0;
+    housedepot_retention_sweeping.group = 0;
+    housedepot_retention_sweeping.total = 0;
+    housedepot_retention_sweeping.root = 0;
+    housedepot_retention_sweeping.rule = -1;
+}
+
+// Walk the next directory of the sweep in progress, or start a new sweep
+// if one is due. Return 0 if there was nothing to do.
+//
+static int housedepot_retention_sweep (time_t now) {
+
+    int rule = housedepot_retention_sweeping.rule;
+    if (rule < 0) {
+        for (rule = 0; rule < housedepot_retention_count; ++rule) {
+            if ((!housedepot_retention_rules[rule].depth) &&
+                (!housedepot_retention_rules[rule].age) &&
+                (!housedepot_retention_rules[rule].size)) continue;
+            if (now >= housedepot_retention_rules[rule].swept
+                           + HOUSEDEPOT_RETENTION_SWEEP) break;
+        }
+        if (rule >= housedepot_retention_count) return 0;
+        housedepot_retention_rules[rule].swept = now;
+        housedepot_retention_sweeping.rule = rule;
+    }
+
+    housedepot_index_directory *dir =
+        housedepot_index_directory_get (housedepot_retention_rules[rule].path);
+    if (!dir) {
+        housedepot_retention_complete ();
+        return 1;
+    }
+    if (!housedepot_retention_sweeping.root) {
+        housedepot_retention_walk (dir, rule);
+        housedepot_retention_sweeping.root = 1;
+        return 1;
+    }
+
+    // Support only one level of subdirectory (see README.md). The groups
+    // are ordered by name, which tells where the sweep stopped.
+    //
+    const char *last = housedepot_retention_sweeping.group;
+    housedepot_index_directory *child;
+    for (child = dir->children; child; child = child->sibling) {
+        if ((!last) || (strcmp (child->name, last) > 0)) break;
+    }
+    if (!child) {
+        housedepot_retention_complete ();
+        return 1;
+    }
+    free (housedepot_retention_sweeping.group);
+    housedepot_retention_sweeping.group = strdup (child->name);
+
+    housedepot_index_directory *sub = housedepot_index_directory_get (child->path);
+    if (sub) housedepot_retention_walk (sub, rule);
+
+    // Without the name, the sweep could not resume: end it there.
+    if (!housedepot_retention_sweeping.group) housedepot_retention_complete ();
+    return 1;
+}
+
+// Decide which revisions of this file must go, up to the budget left.
+// Return the number of revisions removed, or -1 if the budget was not
+// enough to complete the task.
+//
+static int housedepot_retention_apply (housedepot_retention_task *task,
+                                       time_t now, int budget) {
+
+    housedepot_index_file *file = housedepot_index_get (task->filename, 0);
+    if (!file) return 0; // Deleted meanwhile.
+    if ((file->latest <= 0) || (file->current <= 0)) return 0;
+
+    int rule = task->rule;
+    int oldest = task->oldest;
+
+    int depth = housedepot_retention_rules[rule].depth;
+    if (depth && (file->latest - depth > oldest))
+        oldest = file->latest - depth;
+
+    time_t age = housedepot_retention_rules[rule].age;
+    if (age) {
+        time_t limit = now - age;
+        int i;
+        for (i = 0; i < file->count; ++i) {
+            housedepot_index_revision *rev = file->revisions + i;
+            if ((rev->time < limit) && (rev->revision > oldest))
+                oldest = rev->revision;
+        }
+    }
+    if (oldest >= file->latest) oldest = file->latest - 1;
+    if (oldest < 1) return 0;
+
+    // Cap the work to the budget left: the revisions are removed oldest
+    // first, and the rest is left for later.
+    //
+    int complete = 1;
+    if (budget > 0) {
+        int i;
+        int count = 0;
+        for (i = 0; i < file->count; ++i) {
+            int revision = file->revisions[i].revision;
+            if (revision > oldest) break;
+            if (revision == file->current) continue;
+            if (++count >= budget) {
+                if (revision < oldest) {
+                    oldest = revision;
+                    complete = 0;
+                }
+                break;
+            }
+        }
+    }
+
+    char clientname[1024];
+    snprintf (clientname, sizeof(clientname), "%s%s",
+              housedepot_retention_rules[rule].uri,
+              task->filename + housedepot_retention_rules[rule].length);
+
+    int removed = housedepot_revision_prune (clientname, task->filename, oldest);
+    housedepot_retention_total += removed;
+    return complete ? removed : -1;
+}
+
+void housedepot_retention_background (time_t now) {
+
+    int budget = housedepot_retention_budget;
+    int walked = 0;
+
+    for (;;) {
+        if ((housedepot_retention_budget > 0) && (budget <= 0)) break;
+
+        // Walk the next directory only when the tasks queued from the
+        // previous one are complete, to keep the queue short. Loading
+        // a directory may scan it from disk: this is part of the budget.
+        //
+        if (!housedepot_retention_head) {
+            if (walked && (housedepot_retention_budget > 0)) break;
+            if (!housedepot_retention_sweep (now)) break;
+            walked = 1;
+            budget -= 1;
+            continue;
+        }
+
+        housedepot_retention_task *task = housedepot_retention_head;
+        int removed = housedepot_retention_apply (task, now, budget);
+        if (removed < 0) break; // Budget exhausted, resume next time.
+        budget -= removed + 1; // Checking the file has a cost too.
+
+        housedepot_retention_head = task->next;
+        if (!housedepot_retention_head) housedepot_retention_tail = 0;
+        housedepot_retention_queued -= 1;
+        free (task);
+    }
+}
+
+int housedepot_retention_pending (void) {
+    return housedepot_retention_queued;
+}
+
+long long housedepot_retention_removed (void) {
+    return housedepot_retention_total;
+}
@@ -0,0 +1,17 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_retention.h - Remove the old revisions in the background.
+ */
+
+void housedepot_retention_initialize (int argc, const char **argv);
+
+void housedepot_retention_repository (const char *uri, const char *path);
+void housedepot_retention_option (const char *path,
+                                  const char *name, const char *value);
+
+void housedepot_retention_changed (const char *filename);
+
+void housedepot_retention_background (time_t now);
+
+int       housedepot_retention_pending (void);
+long long housedepot_retention_removed (void);
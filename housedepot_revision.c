@@ -27,13 +27,26 @@
  * revisions (no branches) and user defined symbolic tags. Each revision is
  * saved as a separate file with the suffix '~'+revision appended to its name.
  * Tags are implemented as symbolic links, with the suffix '~'+tag appended
- * to its name.
+ * to its name. How the content of each revision file is stored depends on
+ * the repository (see housedepot_storage.c).
  *
  * There are three predefined tags: current, latest and all.
  *
  * To facilitate web access, a symbolic link without suffix always points
  * to the same revision as "~current". (That link is not used here.)
  *
+ * The revisions and tags of each file are kept in a resident index (see
+ * housedepot_index.c), so that most requests are answered without having
+ * to walk symbolic links or scan directories. The links are still
+ * maintained on disk, as they are the persistent form of the tags.
+ *
+ * The index and the links are always updated before the response is sent.
+ * (A staged checkin is answered by the notification listener, once its
+ * group commit is durable: see housedepot_notify.c.)
+ * The storage work that does not change what clients see, i.e. compacting
+ * the revisions that are no longer current and removing the deleted
+ * revision files, is left to the workers (see housedepot_worker.c).
+ *
  * The same naming convention is used for all the methods listed below:
  *
  *   clientname: the path as seens by the external client. It is provided
@@ -63,9 +76,26 @@
  *   Return 1 if this service should list the named group.
  *
  * int housedepot_revision_checkout (const char *filename,
- *                                   const char *revision);
+ *                                   const char *revision, int *gzip);
  *
  *   Checkout the specified revision (or "current" if revision is null).
+ *   If gzip is not null, it indicates on input if the caller accepts gzip
+ *   compressed content, and on output if the content returned is
+ *   compressed.
+ *
+ * int housedepot_revision_stat (const char *filename,
+ *                               const char *revision, time_t *mtime);
+ *
+ *   Return the revision number that the specified tag resolves to, and the
+ *   time of this revision. Return 0 if there is no such revision. This uses
+ *   the index only and does not access the revision file.
+ *
+ * const char *housedepot_revision_cached (const char *filename, int revision);
+ *
+ *   Return the content of the specified revision from memory, if this is
+ *   the current revision of a small text file (see housedepot_cache.c).
+ *   The content is loaded in the cache on first access. Return 0 if the
+ *   revision cannot be served from memory: use checkout instead.
  *
  * const char *housedepot_revision_checkin (const char *clientname,
  *                                          const char *filename,
@@ -74,6 +104,37 @@
  *
  *   Checkin the provided data as the new current content of the specified file.
  *
+ * void        housedepot_revision_batch_start (void);
+ * const char *housedepot_revision_batch_add (const char *clientname,
+ *                                            const char *filename,
+ *                                            time_t      timestamp,
+ *                                            const char *data, int length);
+ * const char *housedepot_revision_batch_commit (void);
+ * void        housedepot_revision_batch_cancel (void);
+ *
+ *   Checkin multiple files as one transaction. The new revisions are stored
+ *   when each file is added, but the latest and current tags are moved only
+ *   on commit, all at once. On cancel, the new revisions are removed. The
+ *   data provided must remain valid until the transaction is committed.
+ *
+ * long long housedepot_revision_batch_stage (void);
+ *
+ *   Commit the pending transaction later, with all the other ones staged
+ *   within the same commit window, sharing the disk flushes. This is only
+ *   done for the repositories with the fsync durability: return 0 if the
+ *   transaction was not staged, in which case the caller must commit or
+ *   cancel it. Otherwise return an identifier for the outcome of this
+ *   transaction. The window is set using the -commit-window=MS option
+ *   (default: 10 ms). A negative window disables staging.
+ *
+ * long long housedepot_revision_committed (void);
+ * const char *housedepot_revision_outcome (long long commit);
+ *
+ *   Return the identifier of the most recent staged transaction that is
+ *   now durable, and the outcome of one transaction: 0 on success,
+ *   or else an error. The transactions complete in the order they were
+ *   staged.
+ *
  * const char *housedepot_revision_apply (const char *tag,
  *                                        const char *clientname,
  *                                        const char *filename,
@@ -99,28 +160,44 @@
  *                                       const char *dirname);
  *
  *   Return JSON data that lists all the files stored in the repository
- *   identified by its root path.
+ *   identified by its root path. This listing is built from the index
+ *   and does not access the disk, except when loading the index.
+ *
+ * const char *housedepot_revision_bundle (const char *clientname,
+ *                                         const char *dirname,
+ *                                         const char *files,
+ *                                         const char *revision,
+ *                                         int visible);
+ *
+ *   Return JSON data that contains the content of multiple files from the
+ *   same directory. The files parameter is a comma-separated list of names
+ *   relative to the directory (which may include a group subdirectory).
+ *   If files is null, all the files listed by housedepot_revision_list()
+ *   are included. The revision is the tag or revision to retrieve for all
+ *   files (default: current). The visible parameter tells if the path of
+ *   the directory makes its files visible, as for individual requests: if
+ *   not, a file is included only if its group or name is visible. A content
+ *   that contains null characters is encoded in base64.
  *
  * const char *housedepot_revision_history (const char *clientname,
  *                                          const char *filename);
  *
  *   Return JSON data that describes the file history.
  *
- * void housedepot_revision_prune (const char *clientname,
- *                                 const char *filename, int depth);
+ * int housedepot_revision_prune (const char *clientname,
+ *                                const char *filename, int oldest);
  *
- *   Remove older revisions of the specified file, leaving only the
- *   most recent revisions up to the specified depth. The pruning
- *   follow the delete restrictions: the latest and current revisions
- *   cannot be pruned. If the depth value is less than 2, no revision is
- *   removed. Nothing is done if there are no revisions older than depth.
+ *   Remove all the revisions of the specified file up to the specified
+ *   revision number, included. The pruning follows the delete restrictions:
+ *   the latest and current revisions are never pruned. Return the number
+ *   of revisions removed.
  *
- *   For example, if depth is 3 and the current tag matches latest,
- *   only the 3 most recent revisions will be left.
+ *   The retention rules (depth, age, size) are decided by the retention
+ *   module, which calls this function in the background.
  *
- *   Warning: the depth check is based on the revision number,
- *   not on the number of files. If depth is 3 but the 2nd most
- *   recent revision was deleted, then only 2 revisions will be left.
+ *   All the revisions are removed in one pass, with the tags that point
+ *   to them, and reported as one prune event for the most recent revision
+ *   removed.
  *
  * void housedepot_revision_repair (const char *dirname);
  *
@@ -130,31 +207,58 @@
  *   version created absolute links, causing a breakage if the repository
  *   is moved, and thus the need for repair.
  *
+ *   The repair is only needed once: a repository that was repaired is
+ *   marked with a hidden ".relative" file, and is skipped afterward.
+ *   Otherwise the repository is queued, and the repair is done later by
+ *   housedepot_revision_background(), so that it does not delay startup.
+ *   (Absolute links still work as long as the repository is not moved.)
+ *
+ * void housedepot_revision_background (void);
+ *
+ *   Repair the queued repositories, for up to 50 ms per call, resuming
+ *   where the previous call stopped. This must be called once per second.
+ *
  * long long housedepot_revision_get_update_timestamp (void);
  *
  *   Return a millisecond timestamp representing the last time any of
  *   the repository has been modified.
+ *
+ * void housedepot_revision_set_update_timestamp (void);
+ *
+ *   Record that a repository was modified. This is used when a change
+ *   was made without going through this module.
  */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <utime.h>
 #include <errno.h>
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <dirent.h>
 
+#include <openssl/evp.h>
+
 #include <echttp.h>
 #include "echttp_libc.h"
 
 #include <houselog.h>
 
+#include "housedepot_cache.h"
+#include "housedepot_event.h"
+#include "housedepot_index.h"
+#include "housedepot_json.h"
+#include "housedepot_metrics.h"
+#include "housedepot_storage.h"
+#include "housedepot_uring.h"
+#include "housedepot_worker.h"
 #include "housedepot_revision.h"
 
 // The list of groups that this service must make visible (or not)
@@ -171,9 +275,15 @@ static const char *housedepot_revision_portal;
 
 static char housedepot_valid_revision[256] = {0};
 
+// The group commit window (see housedepot_revision_batch_stage).
+static int housedepot_revision_window = 10; // ms, negative: no group commit.
+static int housedepot_revision_timer = -1;
+
+static void housedepot_revision_commit_window (int fd, int mode);
+
 long long housedepot_revision_updated = 0;
 
-static void housedepot_revision_set_update_timestamp (void) {
+void housedepot_revision_set_update_timestamp (void) {
 
     struct timeval now;
     gettimeofday (&now, 0);
@@ -223,8 +333,20 @@ void housedepot_revision_initialize (const char *host,
                                      int argc, const char *argv[]) {
 
     int i;
+    const char *value;
     for (i = 1; i < argc; ++i) {
         housedepot_revision_default (argv[i]);
+        if (echttp_option_match ("-commit-window=", argv[i], &value))
+            housedepot_revision_window = atoi(value);
+    }
+    if (housedepot_revision_window > 0) {
+        housedepot_revision_timer =
+            timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (housedepot_revision_timer < 0)
+            housedepot_revision_window = 0; // Commit without waiting.
+        else
+            echttp_listen (housedepot_revision_timer, 1,
+                           housedepot_revision_commit_window, 0);
     }
 
     housedepot_revision_host = host;
@@ -268,107 +390,373 @@ static void housedepot_trace (const char *source, int line, const char *level,
 }
 
 int housedepot_revision_checkout (const char *filename,
-                                  const char *revision) {
+                                  const char *revision, int *gzip) {
     char fullname[1024];
 
     if (!housedepot_revision_isvalid(revision)) return -1;
 
-    snprintf (fullname, sizeof(fullname), "%s%c%s", filename, FRM, revision);
-    return open (fullname, O_RDONLY);
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    int rev = housedepot_index_resolve (file, revision);
+    if (rev <= 0) return -1;
+
+    // The current revision is stored in full, except for a short while
+    // after it became current in a repository that compacts revisions.
+    // It may still be stored as before a change of the storage method.
+    if ((rev == file->current) && !housedepot_storage_compacts (filename)) {
+        snprintf (fullname, sizeof(fullname), "%s%c%d", file->basename, FRM, rev);
+        int dir = housedepot_index_fd (file->parent);
+        if (dir < 0) return -1;
+        int fd = openat (dir, fullname, O_RDONLY);
+        if ((fd < 0) || !housedepot_storage_encoded (fd)) {
+            if (gzip) *gzip = 0;
+            return fd;
+        }
+        close (fd);
+    }
+    snprintf (fullname, sizeof(fullname), "%s%c%d", filename, FRM, rev);
+    return housedepot_storage_open (fullname, file->count, gzip);
+}
+
+int housedepot_revision_stat (const char *filename,
+                              const char *revision, time_t *mtime) {
+
+    if (!housedepot_revision_isvalid(revision)) return 0;
+
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    int rev = housedepot_index_resolve (file, revision);
+    if (rev <= 0) return 0;
+
+    housedepot_index_revision *item = housedepot_index_find (file, rev);
+    if (!item) return 0;
+    if (mtime) *mtime = item->time;
+    return rev;
+}
+
+const char *housedepot_revision_cached (const char *filename, int revision) {
+
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    if ((!file) || (revision != file->current)) return 0;
+
+    const char *data = housedepot_cache_get (filename, revision);
+    if (data) return data;
+
+    // Not cached yet: load it, if this is worth it.
+    //
+    housedepot_index_revision *item = housedepot_index_find (file, revision);
+    if ((!item) || (item->size > HOUSEDEPOT_CACHE_ITEM)) return 0;
+
+    char fullname[1024];
+    snprintf (fullname, sizeof(fullname), "%s%c%d", file->basename, FRM, revision);
+    int dir = housedepot_index_fd (file->parent);
+    if (dir < 0) return 0;
+    int fd = openat (dir, fullname, O_RDONLY);
+    if (fd < 0) return 0;
+
+    char *buffer = malloc (item->size + 1);
+    int length = buffer ? read (fd, buffer, item->size + 1) : -1;
+    close (fd);
+
+    // A revision not yet stored back in full has another size, or starts
+    // with a null character, which the cache refuses: it is not cached.
+    //
+    if (length == item->size) // Otherwise the index is not up to date.
+        data = housedepot_cache_put (filename, revision, buffer, length);
+    free (buffer);
+    return data;
 }
 
 /* Create all links as relative, to the same directory.
  * This matches the model of the depot repository and makes links
  * independent from the actual repository location..
+ *
+ * An existing link is never removed: the new link is created under a
+ * temporary, hidden, name and then renamed over the old one. Readers
+ * always find either the old or the new link.
  */
 static int housedepot_revision_link (const char *target, const char *link) {
-    if (unlink (link)) {
-        if (errno != ENOENT) {
-            houselog_trace (HOUSE_FAILURE, "LINK", "CANNOT REMOVE %s: %s", link, strerror(errno));
-            return -1;
+
+    char temp[1024];
+    const char *name;
+    int dir = housedepot_index_at (link, &name);
+    if (dir < 0) {
+        houselog_trace (HOUSE_FAILURE, "LINK", "CANNOT ACCESS %s: %s", link, strerror(errno));
+        return -1;
+    }
+    const char *base = strrchr (target, '/');
+    base = base ? base + 1 : target;
+    snprintf (temp, sizeof(temp), ".%s.new", name);
+
+    if (symlinkat (base, dir, temp)) {
+        if (errno == EEXIST) {
+            unlinkat (dir, temp, 0); // Left over from a crash.
+            if (symlinkat (base, dir, temp) == 0) goto created;
         }
+        houselog_trace (HOUSE_FAILURE, "LINK", "CANNOT CREATE %s: %s", temp, strerror(errno));
+        return -1;
     }
-    char *relative = strdup (target);
-    char *base = strrchr (relative, '/');
-    base = base ? base + 1 : relative;
-    int result = symlink(base, link);
-    if (result) {
-        houselog_trace (HOUSE_FAILURE, "LINK", "CANNOT CREATE %s: %s", link, strerror(errno));
+created:
+    if (renameat (dir, temp, dir, name)) {
+        houselog_trace (HOUSE_FAILURE, "LINK", "CANNOT RENAME TO %s: %s", link, strerror(errno));
+        unlinkat (dir, temp, 0);
+        return -1;
     }
-    free (relative);
-    return result;
+    return 0;
 }
 
-/* Read a link and return a target that uses an absolute path.
- * If the target is relative, this means using the same absolute
- * path as the link itself.
- * This is done so because this module uses absolute paths
- * all the way through.
+/* Switch multiple links to the same target. With io_uring, all the links
+ * are switched using one system call. Return the number of links that
+ * were switched: the links are switched in order, and this stops at
+ * the first failure.
  */
-static int housedepot_revision_readlink (const char *link,
-                                         char *target, int size) {
-    char relative[1024];
-    int pathsz = readlink (link, relative, sizeof(relative)-1);
-    if (pathsz <= 0) return pathsz;
-    relative[pathsz] = 0;
-    if ((link[0] != '/') || (relative[0] == '/')) {
-        strtcpy (target, relative, size); // Not relative, after all.
-        return pathsz;
-    }
-    strtcpy (target, link, size);
-    char *cursor = strrchr (target, '/');
-    if (!cursor) return 0;
-    int offset = (int) (cursor - target);
-    return offset + snprintf (target+offset, size-offset, "/%s", relative);
-}
-
-static int housedepot_revision_same (const char *filename,
-                                     const char *data, int length) {
-    char buffer[1024];
-    int count;
-    int offset = 0;
-
-    int fd = open (filename, O_RDONLY);
-    if (fd < 0) return 0;
+static int housedepot_revision_links (const char *target,
+                                      const char **links, int count) {
+    int i;
 
-    do {
-        count = read (fd, buffer, sizeof(buffer));
-        if (count > 0) {
-            int next = offset + count;
-            if (next > length) {
-                close(fd);
-                return 0; // The existing file is longer.
-            }
-            if (bcmp (data+offset, buffer, count)) {
-                close(fd);
-                return 0; // Bytes are different.
-            }
-            offset = next;
+    if (housedepot_uring_active () && (count <= 4)) {
+        char temp[4][1024];
+        const char *base = strrchr (target, '/');
+        base = base ? base + 1 : target;
+        for (i = 0; i < count; ++i) {
+            const char *name;
+            int dir = housedepot_index_at (links[i], &name);
+            if (dir < 0) break;
+            snprintf (temp[i], sizeof(temp[i]), ".%s.new", name);
+            housedepot_uring_link (dir, base, temp[i], name);
         }
-    } while (count == sizeof(buffer));
-    close(fd);
+        if ((housedepot_uring_submit () == 0) && (i >= count)) return count;
+        // Otherwise do it again the usual way, with the error traces.
+    }
+    for (i = 0; i < count; ++i) {
+        if (housedepot_revision_link (target, links[i])) break;
+    }
+    return i;
+}
 
-    if (offset < length) return 0; // The existing file is shorter.
-    return 1;
+/* Remove a file or link, relative to its (already open) directory.
+ */
+static void housedepot_revision_unlink (const char *filename) {
+    const char *name;
+    int dir = housedepot_index_at (filename, &name);
+    if (dir < 0) return;
+    unlinkat (dir, name, 0);
 }
 
 static void housedepot_revision_touch (const char *filename, time_t timestamp) {
 
     if (timestamp > 0) {
-        struct utimbuf ut;
-        ut.actime = ut.modtime = timestamp;
-        utime (filename, &ut);
+        const char *name;
+        int dir = housedepot_index_at (filename, &name);
+        if (dir < 0) return;
+
+        // Never change the time of a blob shared with other revisions.
+        struct stat fs;
+        if (fstatat (dir, name, &fs, 0) || (fs.st_nlink > 1)) return;
+
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = timestamp;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        utimensat (dir, name, times, 0);
     }
 }
 
-const char *housedepot_revision_checkin (const char *clientname,
-                                         const char *filename,
-                                         time_t      timestamp,
-                                         const char *data, int length) {
-    int pathsz;
+/* The storage work deferred to the workers. Each job gets its own copy of
+ * everything it needs, including its directory, since the index belongs
+ * to the main thread. The jobs for a file are keyed by its name, so that
+ * they are executed in order. A failure is returned with the job, to be
+ * reported from the main thread.
+ */
+typedef struct {
+    int   dir;
+    char *filename;
+    int   older;
+    int   revision;
+    int   newer;
+    int   revisions; // Bounds the delta chains (rebase, materialize).
+    char *data;
+    int   length;
+    int  *list; // Revisions to remove, when pruning.
+    int   count;
+    int   resized; // The revision was materialized, see size.
+    long long size;
+    char *failure;
+} housedepot_revision_deferred;
+
+// A revision stored back in full has a new size: the index, and the
+// manifest, must match the file, or this would look like an external change.
+//
+static void housedepot_revision_resize (const char *filename,
+                                        int revision, long long size) {
+
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    housedepot_index_revision *item = housedepot_index_find (file, revision);
+    if ((!item) || (item->size == size)) return;
+    housedepot_index_add (file, revision, size, item->time);
+}
+
+static void housedepot_revision_retire_job (void *context) {
+
+    housedepot_revision_deferred *job = (housedepot_revision_deferred *)context;
+    housedepot_storage_directory (job->dir);
+    housedepot_storage_retire (job->filename, job->revision,
+                               job->newer, job->data, job->length);
+    job->failure = housedepot_storage_failed ();
+    housedepot_storage_directory (-1);
+}
+
+static void housedepot_revision_materialize_job (void *context) {
+
+    housedepot_revision_deferred *job = (housedepot_revision_deferred *)context;
+    char fullname[1024];
+    snprintf (fullname, sizeof(fullname), "%s%c%d",
+              job->filename, FRM, job->revision);
+    housedepot_storage_directory (job->dir);
+    job->size = housedepot_storage_materialize (fullname, job->revisions);
+    job->resized = (job->size >= 0);
+    job->failure = housedepot_storage_failed ();
+    housedepot_storage_directory (-1);
+}
+
+static void housedepot_revision_remove_job (void *context) {
+
+    housedepot_revision_deferred *job = (housedepot_revision_deferred *)context;
+    char fullname[1024];
+    snprintf (fullname, sizeof(fullname), "%s%c%d",
+              job->filename, FRM, job->revision);
+    housedepot_storage_directory (job->dir);
+    housedepot_storage_rebase (job->filename, job->older, job->revision,
+                               job->newer, job->revisions);
+    housedepot_storage_remove (fullname);
+    job->failure = housedepot_storage_failed ();
+    housedepot_storage_directory (-1);
+}
+
+static void housedepot_revision_prune_job (void *context) {
+
+    housedepot_revision_deferred *job = (housedepot_revision_deferred *)context;
+    char fullname[1024];
+    int i;
+    housedepot_storage_directory (job->dir);
+    for (i = 0; i < job->count; ++i) {
+        snprintf (fullname, sizeof(fullname), "%s%c%d",
+                  job->filename, FRM, job->list[i]);
+        housedepot_storage_remove (fullname);
+    }
+    job->failure = housedepot_storage_failed ();
+    housedepot_storage_directory (-1);
+}
+
+static void housedepot_revision_deferred_done (void *context) {
+
+    housedepot_revision_deferred *job = (housedepot_revision_deferred *)context;
+    if (job->failure) {
+        houselog_trace (HOUSE_FAILURE, job->filename, "%s", job->failure);
+        free (job->failure);
+    }
+    if (job->resized)
+        housedepot_revision_resize (job->filename, job->revision, job->size);
+    if (job->dir >= 0) close (job->dir);
+    if (job->data) free (job->data);
+    if (job->list) free (job->list);
+    free (job->filename);
+    free (job);
+}
+
+static void housedepot_revision_submit (housedepot_worker_job *action,
+                                        housedepot_revision_deferred *job) {
+
+    const char *name;
+    int dir = housedepot_index_at (job->filename, &name);
+    job->dir = (dir >= 0) ? dup (dir) : -1;
+    if (job->dir < 0) {
+        // Cannot hand it over: do it now, using the index.
+        action (job);
+        housedepot_revision_deferred_done (job);
+        return;
+    }
+    housedepot_worker_submit (job->filename, action,
+                              housedepot_revision_deferred_done, job);
+}
+
+static void housedepot_revision_defer (housedepot_worker_job *action,
+                                       const char *filename,
+                                       int older, int revision, int newer,
+                                       int revisions,
+                                       const char *data, int length) {
+
+    housedepot_revision_deferred *job =
+        calloc (1, sizeof(housedepot_revision_deferred));
+    if (!job) return;
+    job->filename = strdup (filename);
+    if (!job->filename) {
+        free (job);
+        return;
+    }
+    job->older = older;
+    job->revision = revision;
+    job->newer = newer;
+    job->revisions = revisions;
+    if (data) {
+        job->data = malloc (length + 1);
+        if (job->data) {
+            memcpy (job->data, data, length);
+            job->length = length;
+        }
+    }
+    housedepot_revision_submit (action, job);
+}
+
+/* A checkin is done in two phases: first all new revision files are
+ * written, then all the links are switched. This allows committing
+ * multiple files as one transaction: no link is modified until all
+ * the files were successfully stored. If switching the links fails for
+ * one file, the links already switched are restored to their previous
+ * revision before the batch is canceled, so that no file of the batch
+ * is published.
+ */
+#define HOUSEDEPOT_REVISION_BATCH 64
+
+typedef struct {
+    char *clientname;
+    char *filename;
+    int newrev;
+    int previous;
+    int previouscurrent;
+    const char *data;
+    int length;
+    char *copy;        // Staged only: the data, owned by the entry.
+    long long commit;  // Staged only: the group commit it belongs to.
+    const char *error; // Staged only: the outcome of its transaction.
+} housedepot_revision_entry;
+
+static housedepot_revision_entry
+           housedepot_revision_pending[HOUSEDEPOT_REVISION_BATCH];
+
+static int housedepot_revision_pending_count = 0;
+
+static void housedepot_revision_release (housedepot_revision_entry *entry) {
+    free (entry->clientname);
+    free (entry->filename);
+    free (entry->copy);
+}
+
+static void housedepot_revision_batch_clear (void) {
+
+    int i;
+    for (i = 0; i < housedepot_revision_pending_count; ++i)
+        housedepot_revision_release (housedepot_revision_pending + i);
+    housedepot_revision_pending_count = 0;
+}
+
+void housedepot_revision_batch_start (void) {
+    housedepot_revision_batch_clear ();
+}
+
+const char *housedepot_revision_batch_add (const char *clientname,
+                                           const char *filename,
+                                           time_t      timestamp,
+                                           const char *data, int length) {
     int newrev;
     char fullname[1024];
-    char link[1024];
 
     const char *basename = strrchr(filename, '/');
     if (!basename) return "invalid file path";
@@ -376,25 +764,47 @@ const char *housedepot_revision_checkin (const char *clientname,
 
     if (strchr(filename, FRM)) return "invalid character in name";
 
+    if (housedepot_revision_pending_count >= HOUSEDEPOT_REVISION_BATCH)
+        return "too many files";
+
+    housedepot_index_file *file = housedepot_index_get (filename, 1);
+    if (!file) return "cannot index file";
+
+    int i;
+    for (i = 0; i < housedepot_revision_pending_count; ++i) {
+        if (!strcmp (housedepot_revision_pending[i].filename, filename))
+            return "file listed twice";
+    }
+
     // Retrieve which revision number to use for this new file revision.
-    // (Increment latest.)
+    // (Increment latest, or the most recent revision if latest is missing.)
     //
-    snprintf (link, sizeof(link), "%s%c%s", filename, FRM, "latest");
-    pathsz = housedepot_revision_readlink (link, fullname, sizeof(fullname));
-    if (pathsz <= 0) {
-        newrev = 1;
-    } else {
+    newrev = file->latest;
+    if (file->count > 0) {
+        int last = file->revisions[file->count-1].revision;
+        if (last > newrev) newrev = last;
+    }
+    newrev += 1;
+
+    housedepot_index_revision *latest =
+        housedepot_index_find (file, file->latest);
+    if (latest) {
+        snprintf (fullname, sizeof(fullname),
+                  "%s%c%d", filename, FRM, file->latest);
         housedepot_trace (HOUSE_INFO, filename, "FOUND", "latest", fullname);
-        char *rev = strrchr (fullname, FRM);
-        if (!rev) return "invalid revision database";
-        newrev = atoi (rev+1) + 1;
-        if (newrev <= 1) return "invalid revision number";
+        const char *rev = strrchr (fullname, FRM);
 
         // Compare with the existing latest revision to avoid duplicates.
+        // The file content is read only if the sizes match.
         //
-        if (housedepot_revision_same (fullname, data, length)) {
+        if ((latest->size == length) &&
+            housedepot_storage_same (fullname, data, length)) {
             housedepot_trace (HOUSE_INFO, filename, "DUPLICATES", rev+1, 0);
-            housedepot_revision_touch (fullname, timestamp);
+            housedepot_metrics_count (HOUSEDEPOT_METRICS_DUPLICATE, 1);
+            if (timestamp > 0) {
+                housedepot_revision_touch (fullname, timestamp);
+                housedepot_index_add (file, file->latest, latest->size, timestamp);
+            }
             return 0; // Silently ignore this duplicate otherwise.
         }
     }
@@ -403,68 +813,436 @@ const char *housedepot_revision_checkin (const char *clientname,
     //
     snprintf (fullname, sizeof(fullname), "%s%c%d", filename, FRM, newrev);
     housedepot_trace (HOUSE_INFO, filename, "NEW", "REVISION", fullname);
-    int fd = open (fullname, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd < 0) {
-        houselog_trace (HOUSE_FAILURE, "FILE", "CANNOT CREATE REVISION %d: %s", newrev, strerror(errno));
-        return "Cannot open for writing";
-    }
-    if (write (fd, data, length) != length) {
-        houselog_trace (HOUSE_FAILURE, "FILE", "CANNOT WRITE REVISION %d: %s", newrev, strerror(errno));
-        close(fd);
-        unlink (fullname); // Leave the repository consistent.
-        return "Cannot write the data";
-    }
-    close(fd);
+    time_t mtime;
+    const char *error =
+        housedepot_storage_write (fullname, timestamp, data, length, &mtime);
+    if (error) return error;
+    housedepot_index_add (file, newrev, length, mtime);
+
+    housedepot_revision_entry *entry =
+        housedepot_revision_pending + housedepot_revision_pending_count++;
+    memset (entry, 0, sizeof(housedepot_revision_entry));
+    entry->clientname = strdup (clientname);
+    entry->filename = strdup (filename);
+    entry->newrev = newrev;
+    entry->data = data;
+    entry->length = length;
+    return 0;
+}
+
+/* Remove the new revision of an entry that will not be published.
+ */
+static void housedepot_revision_discard (housedepot_revision_entry *entry) {
 
-    housedepot_revision_touch (fullname, timestamp);
+    char fullname[1024];
+    snprintf (fullname, sizeof(fullname),
+              "%s%c%d", entry->filename, FRM, entry->newrev);
+    housedepot_trace (HOUSE_INFO, entry->filename, "CANCEL", fullname, 0);
+    housedepot_storage_remove (fullname);
+    housedepot_index_file *file = housedepot_index_get (entry->filename, 0);
+    if (file) housedepot_index_remove (file, entry->newrev);
+}
 
-    // Set the standard tags as symbolic links: ~latest and ~current.
+void housedepot_revision_batch_cancel (void) {
+
+    int i;
+    for (i = 0; i < housedepot_revision_pending_count; ++i)
+        housedepot_revision_discard (housedepot_revision_pending + i);
+    housedepot_revision_batch_clear ();
+}
+
+static const char *housedepot_revision_switch
+                       (housedepot_revision_entry *entry) {
+
+    char fullname[1024];
+    char latest[1024];
+    char current[1024];
+
+    const char *filename = entry->filename;
+    int newrev = entry->newrev;
+
+    // The tags are restored to these revisions if the transaction fails.
+    // (A staged checkin may follow another one for the same file.)
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    entry->previous = file ? file->latest : 0;
+    entry->previouscurrent = file ? file->current : 0;
+    if ((!file) || (!housedepot_index_find (file, newrev)))
+        return "The new revision was removed";
+
+    snprintf (fullname, sizeof(fullname), "%s%c%d", filename, FRM, newrev);
+
+    // Set the standard tags as symbolic links: ~latest and ~current,
+    // and then the default file.
     //
     housedepot_trace (HOUSE_INFO, filename, "UPDATE", "latest", fullname);
-    if (housedepot_revision_link (fullname, link))
-        return "Cannot create link for the latest tag";
-
     housedepot_trace (HOUSE_INFO, filename, "UPDATE", "current", fullname);
-    snprintf (link, sizeof(link), "%s%c%s", filename, FRM, "current");
-    if (housedepot_revision_link (fullname, link))
-        return "Cannot create link for the current tag";
+    snprintf (latest, sizeof(latest), "%s%c%s", filename, FRM, "latest");
+    snprintf (current, sizeof(current), "%s%c%s", filename, FRM, "current");
+    const char *links[3] = {latest, current, filename};
+
+    int switched = housedepot_revision_links (fullname, links, 3);
+    if (switched > 0) housedepot_index_tag_set (file, "latest", newrev);
+    if (switched > 1) housedepot_index_tag_set (file, "current", newrev);
+    switch (switched) {
+        case 0: return "Cannot create link for the latest tag";
+        case 1: return "Cannot create link for the current tag";
+        case 2: return "Cannot create link for default file";
+    }
+    housedepot_storage_modified (filename);
+    return 0;
+}
+
+/* Point the standard tags and the default file back to the revisions
+ * they had before the batch, or remove them if there were none.
+ */
+static void housedepot_revision_restore (housedepot_revision_entry *entry) {
+
+    char link[1024];
+    char target[1024];
+
+    const char *filename = entry->filename;
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    if (!file) return;
+
+    const char *tags[2] = {"latest", "current"};
+    int revisions[2] = {entry->previous, entry->previouscurrent};
+    int t;
+    for (t = 0; t < 2; ++t) {
+        snprintf (link, sizeof(link), "%s%c%s", filename, FRM, tags[t]);
+        if (revisions[t] > 0) {
+            snprintf (target, sizeof(target),
+                      "%s%c%d", filename, FRM, revisions[t]);
+            housedepot_revision_link (target, link);
+            housedepot_index_tag_set (file, tags[t], revisions[t]);
+        } else {
+            housedepot_revision_unlink (link);
+            housedepot_index_tag_remove (file, tags[t]);
+        }
+    }
+    // The default file always follows the current tag.
+    if (revisions[1] > 0)
+        housedepot_revision_link (target, filename);
+    else
+        housedepot_revision_unlink (filename);
+    housedepot_storage_modified (filename);
+}
 
-    if (housedepot_revision_link (fullname, filename))
-        return "Cannot create link for default file";
+static void housedepot_revision_publish (housedepot_revision_entry *entry) {
+
+    const char *clientname = entry->clientname;
+    const char *filename = entry->filename;
+    int newrev = entry->newrev;
+    int previous = entry->previous;
+    int previouscurrent = entry->previouscurrent;
+
+    housedepot_cache_put (filename, newrev, entry->data, entry->length);
+
+    // The previous latest and current revisions may now be stored in a more
+    // compact way. Only the delta method needs a copy of the new content.
+    //
+    int compacts = housedepot_storage_compacts (filename);
+    if (compacts && (previous > 0)) {
+        if (compacts > 1)
+            housedepot_revision_defer (housedepot_revision_retire_job,
+                                       filename, 0, previous, newrev, 0,
+                                       entry->data, entry->length);
+        else
+            housedepot_revision_defer (housedepot_revision_retire_job,
+                                       filename, 0, previous, newrev, 0, 0, 0);
+    }
+    if (compacts && (previouscurrent > 0) && (previouscurrent != previous))
+        housedepot_revision_defer (housedepot_revision_retire_job,
+                                   filename, 0, previouscurrent, newrev,
+                                   0, 0, 0);
 
     houselog_event ("FILE", clientname, "CHECKED IN", "REVISION %d", newrev);
+    housedepot_event_record (filename, clientname, "checkin", newrev, 0);
+}
 
-    housedepot_revision_set_update_timestamp ();
+/* Switch the links of all the files of one transaction, and publish
+ * them, or else restore every link switched so far, including the ones
+ * of the file that failed, and then discard the new revisions.
+ */
+static const char *housedepot_revision_transact
+                       (housedepot_revision_entry *entries, int count) {
+
+    const char *error = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        error = housedepot_revision_switch (entries + i);
+        if (error) break;
+    }
+    if (error) {
+        int j;
+        for (j = 0; j <= i; ++j) housedepot_revision_restore (entries + j);
+        for (j = 0; j < count; ++j) housedepot_revision_discard (entries + j);
+        return error;
+    }
+    for (i = 0; i < count; ++i) housedepot_revision_publish (entries + i);
+    if (count > 0) housedepot_revision_set_update_timestamp ();
     return 0;
 }
 
+const char *housedepot_revision_batch_commit (void) {
+
+    // The new revisions must be on disk before any link points to them.
+    // All the files of the batch are flushed together, and then all the
+    // directories once the links were switched.
+    //
+    housedepot_storage_flush ();
+    const char *error =
+        housedepot_revision_transact (housedepot_revision_pending,
+                                      housedepot_revision_pending_count);
+    housedepot_storage_sync ();
+    housedepot_revision_batch_clear ();
+    return error;
+}
+
+const char *housedepot_revision_checkin (const char *clientname,
+                                         const char *filename,
+                                         time_t      timestamp,
+                                         const char *data, int length) {
+
+    housedepot_revision_batch_start ();
+    const char *error = housedepot_revision_batch_add
+                            (clientname, filename, timestamp, data, length);
+    if (error) {
+        housedepot_revision_batch_cancel ();
+        return error;
+    }
+    return housedepot_revision_batch_commit ();
+}
+
+/* Group commit: a batch of checkins to a durable repository may be staged
+ * instead of committed. The staged batches are committed together when the
+ * commit window expires, using only two rounds of flushes for all of them:
+ * first a worker flushes all the new revision files, then all the links
+ * are switched, and then a worker flushes all the modified directories.
+ * Each batch remains a separate transaction: a batch that fails does not
+ * affect the others. The checkins staged while a group commit is in
+ * progress are committed as soon as it completes.
+ *
+ * The outcome of the most recent group commits is kept, so that the
+ * clients waiting on the notification listener can be answered.
+ */
+#define HOUSEDEPOT_REVISION_OUTCOMES 1024
+
+typedef struct {
+    housedepot_revision_entry *entries;
+    int count;
+    int size;
+} housedepot_revision_group;
+
+static housedepot_revision_group housedepot_revision_staged;
+static housedepot_revision_group housedepot_revision_flushing;
+
+static int housedepot_revision_armed = 0;
+static int housedepot_revision_committing = 0;
+
+static long long housedepot_revision_issued = 0;
+static long long housedepot_revision_done = 0;
+static const char *housedepot_revision_outcomes[HOUSEDEPOT_REVISION_OUTCOMES];
+
+typedef struct {
+    void *pending;
+    char *failure;
+} housedepot_revision_flush_context;
+
+static void housedepot_revision_flush_job (void *context) {
+    housedepot_revision_flush_context *job = context;
+    job->failure = housedepot_storage_commit (job->pending);
+}
+
+// Flush all the pending files and directories in a worker.
+//
+static void housedepot_revision_flush (housedepot_worker_job *done) {
+
+    housedepot_revision_flush_context *job =
+        malloc (sizeof(housedepot_revision_flush_context));
+    if (!job) {
+        housedepot_storage_sync ();
+        done (0);
+        return;
+    }
+    job->pending = housedepot_storage_detach ();
+    job->failure = 0;
+    housedepot_worker_submit ("commit",
+                              housedepot_revision_flush_job, done, job);
+}
+
+// Report the failure of a flush job, if any. Return 1 if it failed.
+//
+static int housedepot_revision_flushed (void *context) {
+
+    housedepot_revision_flush_context *job = context;
+    if (!job) return 0;
+    int failed = (job->failure != 0);
+    if (failed) {
+        houselog_trace (HOUSE_FAILURE, "COMMIT", "%s", job->failure);
+        free (job->failure);
+    }
+    free (job);
+    return failed;
+}
+
+// Return the number of consecutive entries that belong to the same batch.
+//
+static int housedepot_revision_batch_size (int i) {
+
+    housedepot_revision_entry *entries = housedepot_revision_flushing.entries;
+    int count = 1;
+    while ((i + count < housedepot_revision_flushing.count) &&
+           (entries[i+count].commit == entries[i].commit)) count += 1;
+    return count;
+}
+
+static void housedepot_revision_commit_cycle (void);
+
+static void housedepot_revision_commit_synced (void *context) {
+
+    const char *failure =
+        housedepot_revision_flushed (context) ? "Cannot sync the directories" : 0;
+
+    housedepot_revision_entry *entries = housedepot_revision_flushing.entries;
+    int i;
+    for (i = 0; i < housedepot_revision_flushing.count; ++i) {
+        long long commit = entries[i].commit;
+        const char *error = entries[i].error;
+        if (!error) error = failure;
+        housedepot_revision_outcomes[commit % HOUSEDEPOT_REVISION_OUTCOMES] =
+            error;
+        if (commit > housedepot_revision_done) housedepot_revision_done = commit;
+        housedepot_revision_release (entries + i);
+    }
+    free (entries);
+    memset (&housedepot_revision_flushing, 0, sizeof(housedepot_revision_group));
+    housedepot_revision_committing = 0;
+
+    // The checkins staged meanwhile have waited long enough.
+    housedepot_revision_commit_cycle ();
+}
+
+static void housedepot_revision_commit_flushed (void *context) {
+
+    int failed = housedepot_revision_flushed (context);
+
+    housedepot_revision_entry *entries = housedepot_revision_flushing.entries;
+    int i = 0;
+    while (i < housedepot_revision_flushing.count) {
+        int count = housedepot_revision_batch_size (i);
+        const char *error = "Cannot sync the new revisions";
+        int j;
+        if (failed) {
+            for (j = 0; j < count; ++j)
+                housedepot_revision_discard (entries + i + j);
+        } else {
+            error = housedepot_revision_transact (entries + i, count);
+        }
+        for (j = 0; j < count; ++j) entries[i+j].error = error;
+        i += count;
+    }
+    housedepot_revision_flush (housedepot_revision_commit_synced);
+}
+
+static void housedepot_revision_commit_cycle (void) {
+
+    if (housedepot_revision_committing) return; // Will resume when done.
+    if (housedepot_revision_staged.count <= 0) return;
+
+    housedepot_revision_flushing = housedepot_revision_staged;
+    memset (&housedepot_revision_staged, 0, sizeof(housedepot_revision_group));
+    housedepot_revision_committing = 1;
+    housedepot_revision_flush (housedepot_revision_commit_flushed);
+}
+
+static void housedepot_revision_commit_window (int fd, int mode) {
+
+    uint64_t expirations;
+    if (read (fd, &expirations, sizeof(expirations)) < 0) return;
+    housedepot_revision_armed = 0;
+    housedepot_revision_commit_cycle ();
+}
+
+long long housedepot_revision_batch_stage (void) {
+
+    int count = housedepot_revision_pending_count;
+    if ((housedepot_revision_window < 0) || (count <= 0)) return 0;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (!housedepot_storage_durable (housedepot_revision_pending[i].filename))
+            return 0;
+    }
+
+    housedepot_revision_group *staged = &housedepot_revision_staged;
+    if (staged->count + count > staged->size) {
+        int size = staged->size ? staged->size * 2 : 64;
+        while (size < staged->count + count) size *= 2;
+        housedepot_revision_entry *entries =
+            realloc (staged->entries, size * sizeof(housedepot_revision_entry));
+        if (!entries) return 0;
+        staged->entries = entries;
+        staged->size = size;
+    }
+
+    // The data provided by the caller does not live long enough.
+    for (i = 0; i < count; ++i) {
+        housedepot_revision_entry *entry = housedepot_revision_pending + i;
+        entry->copy = malloc (entry->length + 1);
+        if (!entry->copy) break;
+        memcpy (entry->copy, entry->data, entry->length);
+        entry->data = entry->copy;
+    }
+    if (i < count) return 0; // The copies are released with the batch.
+
+    long long commit = ++housedepot_revision_issued;
+    for (i = 0; i < count; ++i) {
+        housedepot_revision_pending[i].commit = commit;
+        staged->entries[staged->count++] = housedepot_revision_pending[i];
+    }
+    housedepot_revision_pending_count = 0; // Now owned by the staged list.
+
+    if (housedepot_revision_window == 0) {
+        housedepot_revision_commit_cycle ();
+    } else if ((!housedepot_revision_armed) &&
+               (!housedepot_revision_committing)) {
+        struct itimerspec window;
+        memset (&window, 0, sizeof(window));
+        window.it_value.tv_sec = housedepot_revision_window / 1000;
+        window.it_value.tv_nsec = (housedepot_revision_window % 1000) * 1000000;
+        if (timerfd_settime (housedepot_revision_timer, 0, &window, 0))
+            housedepot_revision_commit_cycle ();
+        else
+            housedepot_revision_armed = 1;
+    }
+    return commit;
+}
+
+long long housedepot_revision_committed (void) {
+    return housedepot_revision_done;
+}
+
+const char *housedepot_revision_outcome (long long commit) {
+
+    if ((commit <= 0) || (commit > housedepot_revision_done))
+        return "Unknown commit";
+    if (housedepot_revision_done - commit >= HOUSEDEPOT_REVISION_OUTCOMES)
+        return "Commit outcome expired";
+    return housedepot_revision_outcomes[commit % HOUSEDEPOT_REVISION_OUTCOMES];
+}
+
 static int housedepot_revision_resolve (const char *filename, const char *tag,
                                         char *result, int size) {
 
     if (! housedepot_revision_isvalid(tag)) return 0;
 
-    // Eliminate any existing revision/tag suffix.
-    //
-    strtcpy (result, filename, size);
-    char *sep = strrchr (result, FRM);
-    if (sep) *sep = 0;
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    int revision = housedepot_index_resolve (file, tag);
+    if (revision <= 0) return 0;
 
-    // Convert the tag name to a revision and append to the file name.
-    //
-    if (isdigit(tag[0])) {
-        int cursor = strlen(result);
-        snprintf (result+cursor, size-cursor, "%c%s", FRM, tag);
-    } else {
-        char link[1024];
-        snprintf (link, sizeof(link), "%s%c%s", result, FRM, tag);
-        int pathsz = housedepot_revision_readlink (link, result, size);
-        if (pathsz <= 0) return 0;
-    }
-    // Check if the resolved name points to an existing file.
-    int fd = open (result, O_RDONLY);
-    if (fd < 0) return 0;
-    close(fd);
-    return 1;
+    snprintf (result, size, "%s%c%d", filename, FRM, revision);
+    return revision;
 }
 
 const char *housedepot_revision_apply (const char *tag,
@@ -479,24 +1257,52 @@ const char *housedepot_revision_apply (const char *tag,
     if (!strcmp(tag, "all")) return "cannot assign the all tag name";
     if (!strcmp(tag, "latest")) return "cannot assign the latest tag name";
 
-    if (! housedepot_revision_resolve (filename, revision?revision:"current",
-                                       fullname, sizeof(fullname)))
-        return "invalid revision";
+    int rev = housedepot_revision_resolve
+                  (filename, revision?revision:"current",
+                   fullname, sizeof(fullname));
+    if (!rev) return "invalid revision";
 
     housedepot_trace (HOUSE_INFO, filename, "APPLY", tag, fullname);
 
+    // The current revision is stored back in full. If jobs are pending
+    // for this file, e.g. retiring this same revision, this is queued after
+    // them instead of waiting: the revision can be read meanwhile anyway.
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    int previous = 0;
+    if (!strcmp (tag, "current")) {
+        if (housedepot_worker_idle (filename)) {
+            long long size = housedepot_storage_materialize (fullname, file->count);
+            if (size >= 0) housedepot_revision_resize (filename, rev, size);
+        } else
+            housedepot_revision_defer (housedepot_revision_materialize_job,
+                                       filename, 0, rev, 0, file->count, 0, 0);
+        housedepot_cache_forget (filename);
+        previous = file->current;
+    }
+
     snprintf (link, sizeof(link), "%s%c%s", filename, FRM, tag);
     if (housedepot_revision_link (fullname, link))
         return "Cannot create the tag link";
+    housedepot_index_tag_set (file, tag, rev);
+    housedepot_storage_modified (filename);
 
     if (!strcmp (tag, "current")) {
         // Create the link for the GET target, i.e. the name without revision.
         if (housedepot_revision_link (fullname, filename))
             return "Cannot create link for default file";
+
+        // The previous current revision may now be stored in a more
+        // compact way.
+        if ((previous > 0) && (previous != rev) && (previous != file->latest)
+            && housedepot_storage_compacts (filename))
+            housedepot_revision_defer (housedepot_revision_retire_job,
+                                       filename, 0, previous, rev, 0, 0, 0);
     }
 
     const char *realrev = strrchr (fullname, FRM);
     if (!realrev) realrev = "~(invalid)"; // Thou shall not crash.
+    housedepot_storage_sync ();
+    housedepot_event_record (filename, clientname, "tag", rev, tag);
     houselog_event ("FILE", clientname, "APPLIED",
                     "TAG %s TO REVISION %s", tag, realrev+1);
 
@@ -504,66 +1310,6 @@ const char *housedepot_revision_apply (const char *tag,
     return 0;
 }
 
-static char *scandir_exact = 0;
-static char *scandir_pattern = 0;
-static int scandir_pattern_length = 0;
-
-static int housedepot_revision_filter (const struct dirent *e) {
-    if (!scandir_pattern) return 1; // Should never happen, avoid crash.
-    if (strncmp (e->d_name, scandir_pattern, scandir_pattern_length)) return 0;
-    return 1;
-}
-
-static int housedepot_revision_compare (const struct dirent **a,
-                                        const struct dirent **b) {
-
-    if ((*a)->d_type == DT_DIR) {
-        if ((*b)->d_type != DT_DIR) return 1; // Subdirectories last.
-        return 0;
-    }
-    if ((*b)->d_type == DT_DIR) return -1; // Subdirectories last.
-
-    const char *aname = strrchr((*a)->d_name, FRM);
-    const char *bname = strrchr((*b)->d_name, FRM);
-
-    if (!aname) return 0;
-    if (!bname) return 0;
-    aname += 1;
-    bname += 1;
-
-    if (isdigit(aname[0])) {
-        if (!isdigit(bname[0])) return 1; // Tags before revision (a > b).
-        int reva = atoi(aname);
-        int revb = atoi(bname);
-        if (reva < revb) return -1;
-        if (reva > revb) return 1;
-        return 0; // Should never happen (two file with the same name?)
-    }
-
-    if (isdigit(bname[0])) return -1; // Tags before revision (a < b).
-    return alphasort(a, b);
-}
-
-static int housedepot_revision_scanhistory (const char *filename,
-                                            struct dirent ***files) {
-
-    // Retrieve both the directory to scan and the file pattern to search.
-    //
-    static char dirname[1024];
-
-    snprintf (dirname, sizeof(dirname), "%s%c", filename, FRM);
-    scandir_pattern = strrchr (dirname, '/');
-    if (!scandir_pattern) return 0;
-    *(scandir_pattern++) = 0;
-    scandir_pattern_length = strlen(scandir_pattern);
-
-    int n = scandir (dirname, files, housedepot_revision_filter,
-                                     housedepot_revision_compare);
-    scandir_pattern = 0;
-    scandir_pattern_length = 0;
-    return n;
-}
-
 static void housedepot_revision_cleanscan (struct dirent **files, int n) {
     int i;
     for (i = 0; i < n; i++) {
@@ -572,145 +1318,136 @@ static void housedepot_revision_cleanscan (struct dirent **files, int n) {
     if (files) free (files);
 }
 
-static void housedepot_revision_getdir (const char *filename,
-                                        char *dirname, int size) {
-    strtcpy (dirname, filename, size);
-    char *dirsep = strrchr (dirname, '/');
-    if (dirsep) *dirsep = 0;
-    else {
-        dirname[0] = '.';
-        dirname[1] = 0;
-    }
-}
-
-static int housedepot_revision_purgefilter (const struct dirent *e) {
-    if (!scandir_exact) return 1; // Should never happen, avoid crash.
-    if (!strcmp (e->d_name, scandir_exact)) return 1;
-    return housedepot_revision_filter (e);
-}
-
-static int housedepot_revision_purgecompare (const struct dirent **a,
-                                             const struct dirent **b) {
-    return 0; // We do not care about order when purging.
-}
-
 const char *housedepot_revision_purge (const char *clientname,
                                        const char *filename) {
 
-    static char dirname[1024];
-    static char pattern[1024];
-
-    struct dirent **files = 0;
+    char pattern[1024];
+    const char *name;
 
-    strtcpy (dirname, filename, sizeof(dirname));
-    scandir_exact = strrchr (dirname, '/');
-    if (!scandir_exact) return "invalid name";
-    *(scandir_exact++) = 0;
+    // The pending jobs for this file must not recreate what is removed.
+    housedepot_worker_cancel (filename);
 
-    snprintf (pattern, sizeof(pattern), "%s%c", scandir_exact, FRM);
-    scandir_pattern = pattern;
-    scandir_pattern_length = strlen(scandir_pattern);
+    int dir = housedepot_index_at (filename, &name);
+    if (dir < 0) return "invalid name";
+    snprintf (pattern, sizeof(pattern), "%s%c", name, FRM);
+    int length = strlen(pattern);
 
-    int n = scandir (dirname, &files, housedepot_revision_purgefilter,
-                                      housedepot_revision_purgecompare);
+    // The directory stream uses its own descriptor: the index keeps its own.
+    DIR *d = fdopendir (dup (dir));
+    if (!d) return "invalid name";
+    rewinddir (d);
+    housedepot_metrics_count (HOUSEDEPOT_METRICS_SCAN, 1);
 
-    int i;
-    for (i = 0; i < n; i++) {
+    int n = 0;
+    struct dirent *ent;
+    while ((ent = readdir (d)) != 0) {
+        if (strcmp (ent->d_name, name) &&
+            strncmp (ent->d_name, pattern, length)) continue;
         char fullname[2048];
         snprintf (fullname, sizeof(fullname),
-                  "%s/%s", dirname, files[i]->d_name);
-        unlink (fullname);
+                  "%.*s%s", (int)(name - filename), filename, ent->d_name);
+        if (ent->d_type == DT_LNK)
+            housedepot_revision_unlink (fullname);
+        else
+            housedepot_storage_remove (fullname);
+        n += 1;
     }
+    closedir (d);
 
-    scandir_exact = 0;
-    scandir_pattern = 0;
-    scandir_pattern_length = 0;
-    housedepot_revision_cleanscan (files, n);
+    housedepot_index_forget (filename);
     if (n <= 0) return "no such file";
+    housedepot_event_record (filename, clientname, "delete", 0, "all");
     return 0;
 }
 
-const char *housedepot_revision_delete (const char *clientname,
-                                        const char *filename,
-                                        const char *revision) {
+static const char *housedepot_revision_erase (const char *clientname,
+                                              const char *filename,
+                                              const char *revision,
+                                              const char *action) {
 
     char fullname[1024];
-    char working[1024];
 
     if (!revision) return "revision is required";
     snprintf (fullname, sizeof(fullname), "%s%c%s", filename, FRM, revision);
 
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+
     if (!isdigit(revision[0])) {
         // This operation is about deleting a tag.
         if (!strcmp(revision, "current")) return "Cannot delete current";
         if (!strcmp(revision, "latest")) return "Cannot delete latest";
         if (!strcmp(revision, "all"))
             return housedepot_revision_purge (clientname, filename);
-        unlink (fullname);
+        housedepot_revision_unlink (fullname);
+        housedepot_index_tag_remove (file, revision);
         houselog_event ("FILE", clientname, "REMOVED", "TAG %s", revision);
+        housedepot_event_record (filename, clientname, "untag", 0, revision);
         return 0;
     }
 
     // Now the revision is a real revision, not a tag.
     // Protect the latest and current revisions against deletion.
     //
-    if (! housedepot_revision_resolve (filename, "current",
-                                       working, sizeof(working)))
-        return "broken current tag";
-    if (!strcmp (fullname, working)) return "cannot delete current";
+    int rev = atoi (revision);
+    int current = housedepot_index_resolve (file, "current");
+    if (!current) return "broken current tag";
+    if (rev == current) return "cannot delete current";
 
-    if (! housedepot_revision_resolve (filename, "latest",
-                                       working, sizeof(working)))
-        return "broken latest tag";
-    if (!strcmp (fullname, working)) return "cannot delete latest";
+    int latest = housedepot_index_resolve (file, "latest");
+    if (!latest) return "broken latest tag";
+    if (rev == latest) return "cannot delete latest";
 
     // So this revision is neither the latest or the current revision.
     // Now we must retrieve all tags that refer to this, and delete
-    // them first.
-    // Retrieve both the directory to scan and the file pattern to search.
+    // them first. (The index knows them: no need to scan the directory.)
     //
-    struct dirent **files = 0;
-    int n = housedepot_revision_scanhistory (filename, &files);
-
-    housedepot_revision_getdir (filename, working, sizeof(working));
-
     int i;
-    for (i = 0; i < n; i++) {
-        if (files[i]->d_type == DT_LNK) {
-            char link[1300];
-            char target[1024];
-            snprintf (link, sizeof(link), "%s/%s", working, files[i]->d_name);
-            int pathsz = housedepot_revision_readlink (link, target, sizeof(target));
-            if (pathsz <= 0) continue;
-            char *targetsep = strrchr (target, FRM);
-            if (targetsep) {
-                if (!strcmp (targetsep+1, revision)) {
-                    housedepot_trace
-                        (HOUSE_INFO, filename, "DELETE", files[i]->d_name, 0);
-                    unlink(link);
-                    const char *tag = strrchr (files[i]->d_name, FRM);
-                    if (!tag) tag = "~(invalid)"; // Do not crash.
-                    houselog_event ("FILE", clientname, "DELETED", "TAG %s", tag+1);
-                }
-            }
-        }
+    for (i = file->tagcount - 1; i >= 0; --i) {
+        if (file->tags[i].revision != rev) continue;
+        char link[1024];
+        char tag[256];
+        strtcpy (tag, file->tags[i].name, sizeof(tag));
+        snprintf (link, sizeof(link), "%s%c%s", filename, FRM, tag);
+        housedepot_trace (HOUSE_INFO, filename, "DELETE", link, 0);
+        housedepot_revision_unlink (link);
+        housedepot_index_tag_remove (file, tag);
+        houselog_event ("FILE", clientname, "DELETED", "TAG %s", tag);
+        housedepot_event_record (filename, clientname, "untag", rev, tag);
     }
-    housedepot_revision_cleanscan (files, n);
 
     // Now that all tag pointing to this revision were removed, we can delete
-    // the revision file itself.
+    // the revision file itself. The previous revision may be stored as a
+    // delta from this one.
     //
+    int older = 0;
+    int newer = 0;
+    for (i = 0; i < file->count; ++i) {
+        int r = file->revisions[i].revision;
+        if (r < rev) older = r;
+        else if (r > rev) {
+            newer = r;
+            break;
+        }
+    }
     housedepot_trace (HOUSE_INFO, filename, "DELETE", fullname, 0);
-    unlink(fullname);
+    housedepot_revision_defer (housedepot_revision_remove_job,
+                               filename, older, rev, newer, file->count,
+                               0, 0);
+    housedepot_index_remove (file, rev);
 
-    const char *realrev = strrchr (fullname, FRM);
-    if (!realrev) realrev = "~(invalid)"; // Thou shall not crash.
-    houselog_event ("FILE", clientname, "DELETED", "REVISION %s", realrev+1);
+    houselog_event ("FILE", clientname, "DELETED", "REVISION %s", revision);
+    housedepot_event_record (filename, clientname, action, rev, 0);
 
     housedepot_revision_set_update_timestamp ();
     return 0;
 }
 
+const char *housedepot_revision_delete (const char *clientname,
+                                        const char *filename,
+                                        const char *revision) {
+    return housedepot_revision_erase (clientname, filename, revision, "delete");
+}
+
 int housedepot_revision_visible (const char *group) {
 
     if (DepotVisibilityGroupsCount <= 0) return 1; // No filter, so OK.
@@ -734,276 +1471,461 @@ int housedepot_revision_visible (const char *group) {
     return notfound;
 }
 
+static void housedepot_revision_list_files (housedepot_json *json,
+                                            const char *clientname,
+                                            housedepot_index_directory *dir,
+                                            const char *group) {
+
+    housedepot_index_file *file;
+    for (file = dir->files; file; file = file->next) {
+        housedepot_index_revision *current =
+            housedepot_index_find (file, file->current);
+        if (!current) continue; // Deleted, or no current revision.
+
+        char name[1024];
+        char rev[16];
+        if (group)
+            snprintf (name, sizeof(name),
+                      "%s/%s/%s", clientname, group, file->basename);
+        else
+            snprintf (name, sizeof(name), "%s/%s", clientname, file->basename);
+        snprintf (rev, sizeof(rev), "%d", current->revision);
+
+        housedepot_json_object (json, 0);
+        housedepot_json_string (json, "name", name);
+        housedepot_json_string (json, "rev", rev);
+        housedepot_json_integer (json, "time", (long long)(current->time));
+        housedepot_json_close (json);
+    }
+}
+
 const char *housedepot_revision_list (const char *clientname,
                                       const char *dirname) {
 
-    static char buffer[16000];
+    static housedepot_json json = HOUSEDEPOT_JSON_INIT;
 
-    int i;
-    struct dirent **files = 0;
-
-    int cursor = snprintf (buffer, sizeof(buffer),
-                           "{\"host\":\"%s\",\"timestamp\":%d",
-                           housedepot_revision_host, (int)time(0));
-    if (housedepot_revision_portal)
-        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                           ",\"proxy\":\"%s\"", housedepot_revision_portal);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",\"files\":[");
+    housedepot_json_start (&json);
+    housedepot_json_object (&json, 0);
+    housedepot_json_header (&json,
+                            housedepot_revision_host,
+                            housedepot_revision_portal);
+    housedepot_json_array (&json, "files");
 
-    int n = scandir (dirname, &files, 0, housedepot_revision_compare);
-    const char *sep = "";
-
-    for (i = 0; i < n; i++) {
-        struct dirent *ent = files[i];
-        if (ent->d_name[0] == '.') continue; // Skip hidden files, . and ..
+    // The listing comes from the index: files first, then the files in
+    // each visible subdirectory. (Support only one level of subdirectory,
+    // see README.md)
+    //
+    housedepot_index_directory *dir = housedepot_index_directory_get (dirname);
+    if (dir) {
+        housedepot_revision_list_files (&json, clientname, dir, 0);
 
-        switch (ent->d_type) {
-        case DT_DIR:
-            { // This block is required by gcc..
+        housedepot_index_directory *group;
+        for (group = dir->children; group; group = group->sibling) {
 
             // Do not list any file outside of the defined authoritative groups
             // (may save them as backup).
-            if (!housedepot_revision_visible (ent->d_name)) continue;
+            if (!housedepot_revision_visible (group->name)) continue;
 
-            // Support only one level of subdirectory (see README.md)
-            int i2;
-            struct dirent **files2 = 0;
-            static char subdir[1024];
-            snprintf (subdir, sizeof(subdir), "%s/%s", dirname, ent->d_name);
-            int n2 = scandir (subdir, &files2, 0, housedepot_revision_compare);
-            if (n2 <= 0) break;
-
-            for (i2 = 0; i2 < n2; i2++) {
-                struct dirent *ent2 = files2[i2];
-                if (ent2->d_type != DT_LNK) continue; // One directory level.
-                if (strchr(ent2->d_name, FRM)) continue; // Skip tag links.
-
-                // This is a symbolic link to a current revision: retrieve
-                // the revision number by following the link.
-                char link[1024];
-                char target[1024];
-                snprintf (link, sizeof(link), "%s/%s/%s",
-                          dirname, ent->d_name, ent2->d_name);
-                int pathsz = housedepot_revision_readlink (link, target, sizeof(target));
-                if (pathsz <= 0) continue;
-                char *rev = strrchr(target, FRM);
-                if (!rev) continue;
-                struct stat fs;
-                if (stat (target, &fs) != 0) continue;
-                cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                                    "%s{\"name\":\"%s/%s/%s\",\"rev\":\"%s\",\"time\":%lld}",
-                                    sep, clientname, ent->d_name, ent2->d_name, rev+1, (long long)(fs.st_mtime));
-
-                sep = ",";
-            }
-            housedepot_revision_cleanscan (files2, n2);
-            }
-            break;
+            if (!housedepot_index_directory_get (group->path)) continue;
+            housedepot_revision_list_files (&json, clientname, group, group->name);
+        }
+    }
+    return housedepot_json_end (&json);
+}
 
-        case DT_LNK:
-            { // This block is required by some versions of gcc..
-            if (strchr(ent->d_name, FRM)) break; // Skip tag links.
-            char link[1024];
-            char target[1024];
-            snprintf (link, sizeof(link), "%s/%s", dirname, ent->d_name);
-            int pathsz = housedepot_revision_readlink (link, target, sizeof(target));
-            if (pathsz <= 0) break;
-            char *rev = strrchr(target, FRM);
-            if (!rev) break;
-            struct stat fs;
-            if (stat (target, &fs) != 0) break;
-            cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                                "%s{\"name\":\"%s/%s\",\"rev\":\"%s\",\"time\":%lld}",
-                                sep, clientname, ent->d_name, rev+1, (long long)(fs.st_mtime));
-            sep = ",";
-            }
-            break;
+static void housedepot_revision_bundle_file (housedepot_json *json,
+                                             const char *clientname,
+                                             const char *filename,
+                                             const char *revision) {
 
-        default:
-            // Ignore actual files: we are not asking for all revisions.
-            break;
+    housedepot_json_object (json, clientname);
+
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    int rev = housedepot_index_resolve (file, revision);
+    housedepot_index_revision *item = housedepot_index_find (file, rev);
+    if (!item) {
+        housedepot_json_string (json, "error", "no such revision");
+        housedepot_json_close (json);
+        return;
+    }
+    char resolved[16];
+    snprintf (resolved, sizeof(resolved), "%d", rev);
+    int fd = housedepot_revision_checkout (filename, resolved, 0);
+    struct stat fileinfo;
+    if ((fd < 0) || fstat (fd, &fileinfo) || (!S_ISREG(fileinfo.st_mode))) {
+        if (fd >= 0) close (fd);
+        housedepot_json_string (json, "error", "cannot read");
+        housedepot_json_close (json);
+        return;
+    }
+    char *content = malloc (fileinfo.st_size + 1);
+    int length = 0;
+    if (content) {
+        while (length < fileinfo.st_size) {
+            int count = read (fd, content + length, fileinfo.st_size - length);
+            if (count <= 0) break;
+            length += count;
         }
+        content[length] = 0;
+    }
+    close (fd);
+
+    // A JSON string cannot carry a null character: binary data is encoded.
+    //
+    char *encoded = 0;
+    if (content && (length == fileinfo.st_size) && memchr (content, 0, length)) {
+        encoded = malloc (((length + 2) / 3) * 4 + 1);
+        if (encoded)
+            EVP_EncodeBlock ((unsigned char *)encoded,
+                             (unsigned char *)content, length);
+        free (content);
+        content = encoded;
     }
-    snprintf (buffer+cursor, sizeof(buffer)-cursor, "]}");
-    housedepot_revision_cleanscan (files, n);
 
-    return buffer;
+    housedepot_json_integer (json, "rev", rev);
+    housedepot_json_integer (json, "time", (long long)(item->time));
+    if (content && (length == fileinfo.st_size)) {
+        if (encoded) housedepot_json_string (json, "encoding", "base64");
+        housedepot_json_string (json, "content", content);
+    } else
+        housedepot_json_string (json, "error", "cannot read");
+    free (content);
+    housedepot_json_close (json);
+}
+
+static void housedepot_revision_bundle_directory (housedepot_json *json,
+                                                  const char *clientname,
+                                                  housedepot_index_directory *dir,
+                                                  const char *revision,
+                                                  int visible) {
+
+    housedepot_index_file *file;
+    for (file = dir->files; file; file = file->next) {
+        if (!housedepot_index_find (file, file->current)) continue; // Deleted.
+        if ((!visible) && (!housedepot_revision_visible (file->basename)))
+            continue;
+        char name[1024];
+        snprintf (name, sizeof(name), "%s/%s", clientname, file->basename);
+        housedepot_revision_bundle_file (json, name, file->filename, revision);
+    }
+}
+
+const char *housedepot_revision_bundle (const char *clientname,
+                                        const char *dirname,
+                                        const char *files,
+                                        const char *revision,
+                                        int visible) {
+
+    static housedepot_json json = HOUSEDEPOT_JSON_INIT;
+
+    if (!revision) revision = "current";
+
+    housedepot_json_start (&json);
+    housedepot_json_object (&json, 0);
+    housedepot_json_header (&json,
+                            housedepot_revision_host,
+                            housedepot_revision_portal);
+    housedepot_json_object (&json, "files");
+
+    if (!housedepot_revision_isvalid (revision)) {
+        // Return an empty bundle.
+    } else if (files) {
+        char *list = strdup (files);
+        char *name = list;
+        while (name && *name) {
+            char *next = strchr (name, ',');
+            if (next) *(next++) = 0;
+
+            char uri[2048];
+            char filename[2048];
+            snprintf (uri, sizeof(uri), "%s/%s", clientname, name);
+            snprintf (filename, sizeof(filename), "%s/%s", dirname, name);
+
+            // Apply the same restrictions as for individual requests.
+            const char *error = 0;
+            char *group = strchr (name, '/');
+            if (strstr (name, "..") || strchr (name, FRM)) {
+                error = "invalid name";
+            } else if (group) {
+                *group = 0;
+                if (strchr (group+1, '/')) error = "invalid name";
+                else if (!housedepot_revision_visible (name)) error = "not visible";
+            } else if ((!visible) && (!housedepot_revision_visible (name))) {
+                error = "not visible";
+            }
+            if (error) {
+                housedepot_json_object (&json, uri);
+                housedepot_json_string (&json, "error", error);
+                housedepot_json_close (&json);
+            } else {
+                housedepot_revision_bundle_file (&json, uri, filename, revision);
+            }
+            name = next;
+        }
+        if (list)
+            free (list);
+        else
+            housedepot_json_string (&json, "error", "no more memory");
+    } else {
+        housedepot_index_directory *dir = housedepot_index_directory_get (dirname);
+        if (dir) {
+            housedepot_revision_bundle_directory
+                (&json, clientname, dir, revision, visible);
+
+            housedepot_index_directory *group;
+            for (group = dir->children; group; group = group->sibling) {
+                if (!housedepot_revision_visible (group->name)) continue;
+                if (!housedepot_index_directory_get (group->path)) continue;
+                char name[1024];
+                snprintf (name, sizeof(name), "%s/%s", clientname, group->name);
+                housedepot_revision_bundle_directory (&json, name, group, revision, 1);
+            }
+        }
+    }
+    return housedepot_json_end (&json);
 }
 
 const char *housedepot_revision_history (const char *clientname,
                                          const char *filename) {
 
-    static char buffer[16000];
+    static housedepot_json json = HOUSEDEPOT_JSON_INIT;
 
     int i;
-    static char dirname[1024];
-    struct dirent **files = 0;
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+
+    housedepot_json_start (&json);
+    housedepot_json_object (&json, 0);
+    housedepot_json_header (&json,
+                            housedepot_revision_host,
+                            housedepot_revision_portal);
+    housedepot_json_string (&json, "file", clientname);
+
+    housedepot_json_array (&json, "tags");
+    int count = file ? file->tagcount : 0;
+    for (i = 0; i < count; i++) {
+        housedepot_index_tag *tag = file->tags + i;
+        if (!housedepot_index_find (file, tag->revision)) continue; // Dangling.
+        housedepot_json_array (&json, 0);
+        housedepot_json_string (&json, 0, tag->name);
+        housedepot_json_integer (&json, 0, tag->revision);
+        housedepot_json_close (&json);
+    }
+    housedepot_json_close (&json);
+
+    housedepot_json_array (&json, "history");
+    count = file ? file->count : 0;
+    for (i = 0; i < count; i++) {
+        housedepot_index_revision *item = file->revisions + i;
+        housedepot_json_object (&json, 0);
+        housedepot_json_integer (&json, "rev", item->revision);
+        housedepot_json_integer (&json, "time", (long long)(item->time));
+        housedepot_json_close (&json);
+    }
+    return housedepot_json_end (&json);
+}
 
-    housedepot_revision_getdir (filename, dirname, sizeof(dirname));
+int housedepot_revision_prune (const char *clientname,
+                               const char *filename, int oldest) {
 
-    int n = housedepot_revision_scanhistory (filename, &files);
+    housedepot_index_file *file = housedepot_index_get (filename, 0);
+    if (!file) return 0; // No revision found.
+    if (file->latest <= 0) return 0; // Invalid revision database? Don't touch..
+    if (file->current <= 0) return 0; // Same..
 
-    int cursor = snprintf (buffer, sizeof(buffer),
-                           "{\"host\":\"%s\",\"timestamp\":%lld,\"file\":\"%s\"",
-                           housedepot_revision_host, (long long)time(0), clientname);
-    if (housedepot_revision_portal)
-        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                           ",\"proxy\":\"%s\"", housedepot_revision_portal);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",\"tags\":[");
+    int old = oldest;
+    if (old >= file->latest) old = file->latest - 1; // Never prune latest.
+    if (old < 1) return 0; // No revision is too old.
 
-    const char *sep = "";
-    int tags = 1;
+    // The revisions that are too old are the first items of the index,
+    // since it is ordered. The current revision is never deleted, even
+    // if it is old. A delta is always based on a more recent revision,
+    // so no remaining revision depends on a deleted one: no rebase needed.
+    //
+    int i;
+    int count = 0;
+    while ((count < file->count) && (file->revisions[count].revision <= old))
+        count += 1;
+    if (count <= 0) return 0;
+
+    housedepot_revision_deferred *job =
+        calloc (1, sizeof(housedepot_revision_deferred));
+    if (!job) return 0;
+    job->dir = -1;
+    job->filename = strdup (filename);
+    job->list = calloc (count, sizeof(int));
+    if ((!job->filename) || (!job->list)) {
+        housedepot_revision_deferred_done (job);
+        return 0;
+    }
+    for (i = 0; i < count; ++i) {
+        int rev = file->revisions[i].revision;
+        if (rev != file->current) job->list[job->count++] = rev;
+    }
+    if (job->count <= 0) {
+        housedepot_revision_deferred_done (job);
+        return 0;
+    }
 
-    for (i = 0; i < n; i++) {
-        struct dirent *ent = files[i];
-
-        switch (ent->d_type) {
-        case DT_LNK:
-            if (tags) {
-                const char *tagname = strrchr(ent->d_name, FRM);
-                char fullname[1024];
-                if (tagname &&
-                    housedepot_revision_resolve (filename, tagname+1,
-                                                 fullname, sizeof(fullname))) {
-                    const char *rev = strrchr (fullname, FRM);
-                    if (rev) {
-                        cursor +=
-                            snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                                      "%s[\"%s\",%s]", sep, tagname+1, rev+1);
-                        sep = ",";
-                    }
-                }
-            }
-            break;
-        case DT_REG:
-            if (tags) {
-                cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                                    "],\"history\":[");
-                sep = "";
-                tags = 0; // No more link representing tags.
-            }
-            const char *ver = strrchr(ent->d_name, FRM);
-            if (ver) {
-                char fullname[1300];
-                struct stat filestat;
-                snprintf (fullname, sizeof(fullname),
-                          "%s/%s", dirname, ent->d_name);
-                if (stat (fullname, &filestat) == 0) {
-                    cursor += 
-                        snprintf (buffer+cursor, sizeof(buffer)-cursor,
-                                  "%s{\"rev\":%s,\"time\":%lld}",
-                                  sep, ver+1, (long long)(filestat.st_mtime));
-                    sep = ",";
-                }
-            }
-            break;
-        default:
-            break;
-        }
+    // Remove the tags that point to these revisions. The index is updated
+    // later, in the same pass as the revisions.
+    //
+    for (i = 0; i < file->tagcount; ++i) {
+        int rev = file->tags[i].revision;
+        if ((rev > old) || (rev == file->current)) continue;
+        char link[1024];
+        snprintf (link, sizeof(link), "%s%c%s", filename, FRM, file->tags[i].name);
+        housedepot_trace (HOUSE_INFO, filename, "DELETE", link, 0);
+        housedepot_revision_unlink (link);
+        housedepot_event_record (filename, clientname,
+                                 "untag", rev, file->tags[i].name);
     }
-    snprintf (buffer+cursor, sizeof(buffer)-cursor, "]}");
 
-    housedepot_revision_cleanscan (files, n);
-    return buffer;
+    char last[16];
+    snprintf (last, sizeof(last), "%d", job->list[job->count-1]);
+    housedepot_trace (HOUSE_INFO, filename, "PRUNE", filename, last);
+
+    int pruned = job->count;
+    housedepot_metrics_count (HOUSEDEPOT_METRICS_PRUNED, pruned);
+    housedepot_revision_submit (housedepot_revision_prune_job, job);
+    housedepot_index_prune (file, old, file->current);
+
+    houselog_event ("FILE", clientname, "PRUNED",
+                    "%d REVISIONS UP TO %s", pruned, last);
+    housedepot_event_record (filename, clientname, "prune", atoi(last), 0);
+    housedepot_revision_set_update_timestamp ();
+    return pruned;
 }
 
-void housedepot_revision_prune (const char *clientname,
-                                const char *filename, int depth) {
+#define HOUSEDEPOT_REPAIR_MARKER ".relative"
+#define HOUSEDEPOT_REPAIR_SLICE  50 // Milliseconds per call.
 
-    if (depth < 2) return; // Never prune that bad..
+typedef struct housedepot_revision_repairing housedepot_revision_repairing;
 
-    // Retrieve the latest revision, and then decide the most recent revision
-    // to delete.
-    //
-    char link[1024];
-    char fullname[1024];
-    snprintf (link, sizeof(link), "%s%c%s", filename, FRM, "latest");
-    int pathsz = housedepot_revision_readlink (link, fullname, sizeof(fullname));
-    if (pathsz <= 0) return; // No revision found.
-    char *rev = strrchr (fullname, FRM);
-    if (!rev) return; // Invalid revision database? Don't touch..
+struct housedepot_revision_repairing {
+    housedepot_revision_repairing *next;
+    char *dirname;
+};
 
-    int old = atoi (rev+1) - depth;
-    if (old < 1) return; // No revision is too old.
+static housedepot_revision_repairing *housedepot_revision_repairs = 0;
 
-    // Scan this folder to remove revisions that are too old.
-    //
-    struct dirent **files = 0;
-    int n = housedepot_revision_scanhistory (filename, &files);
-    int i;
-    for (i = 0; i < n; i++) {
-        struct dirent *ent = files[i];
-        const char *sep = strrchr (ent->d_name, FRM);
-        if (sep) {
-           if (isdigit(*(++sep))) {
-              if (atoi(sep) <= old) {
-                 housedepot_trace
-                    (HOUSE_INFO, filename, "PRUNE", filename, ent->d_name);
-                 housedepot_revision_delete (clientname, filename, sep);
-              }
-           }
-        }
-    }
-    housedepot_revision_cleanscan (files, n);
+static struct dirent **housedepot_revision_repair_files = 0;
+static int housedepot_revision_repair_count = 0;
+static int housedepot_revision_repair_next = 0;
+static int housedepot_revision_repair_fixed = 0;
+
+// The group subdirectory being repaired, if any. This is where the next
+// call resumes when the previous one ran out of time in the middle of it.
+static DIR *housedepot_revision_repair_group = 0;
+static char housedepot_revision_repair_groupname[1024];
+
+static void housedepot_revision_repair_link (const char *link) {
+
+    char target[1024];
+    int pathsz = readlink (link, target, sizeof(target)-1);
+    if (pathsz <= 0) return;
+    target[pathsz] = 0;
+    if (target[0] != '/') return; // No repair needed.
+    housedepot_revision_link (target, link); // Repair as relative.
+    housedepot_revision_repair_fixed += 1;
 }
 
 void housedepot_revision_repair (const char *dirname) {
 
-    int i;
-    struct dirent **files = 0;
+    char marker[1024];
+    snprintf (marker, sizeof(marker), "%s/%s", dirname, HOUSEDEPOT_REPAIR_MARKER);
+    if (access (marker, F_OK) == 0) return; // Already repaired.
 
-    int n = scandir (dirname, &files, 0, housedepot_revision_compare);
+    housedepot_revision_repairing *item =
+        malloc (sizeof(housedepot_revision_repairing));
+    if (!item) return;
+    item->dirname = strdup (dirname);
+    item->next = 0;
 
-    for (i = 0; i < n; i++) {
-        struct dirent *ent = files[i];
-        if (ent->d_name[0] == '.') continue; // Skip hidden files, . and ..
+    housedepot_revision_repairing **cursor = &housedepot_revision_repairs;
+    while (*cursor) cursor = &((*cursor)->next);
+    *cursor = item;
+}
 
-        switch (ent->d_type) {
-        case DT_DIR:
-            { // This block is required by some versions of gcc..
-            // Support only one level of subdirectory (see README.md)
-            int i2;
-            struct dirent **files2 = 0;
-            static char subdir[1024];
-            snprintf (subdir, sizeof(subdir), "%s/%s", dirname, ent->d_name);
-            int n2 = scandir (subdir, &files2, 0, housedepot_revision_compare);
-            if (n2 <= 0) break;
-
-            for (i2 = 0; i2 < n2; i2++) {
-                struct dirent *ent2 = files2[i2];
-                if (ent2->d_type != DT_LNK) continue; // One directory level.
-                char link[1024];
-                char target[1024];
-                snprintf (link, sizeof(link), "%s/%s/%s",
-                          dirname, ent->d_name, ent2->d_name);
-                int pathsz = readlink (link, target, sizeof(target)-1);
-                if (pathsz <= 0) continue;
-                target[pathsz] = 0;
-                if (target[0] != '/') continue; // No repair needed.
-                housedepot_revision_link (target, link); // Repair as relative.
-            }
-            housedepot_revision_cleanscan (files2, n2);
-            }
-            break;
+static long long housedepot_revision_clock (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return ((long long)now.tv_sec * 1000) + (now.tv_usec / 1000);
+}
+
+void housedepot_revision_background (void) {
+
+    housedepot_revision_repairing *item = housedepot_revision_repairs;
+    if (!item) return;
+
+    const char *dirname = item->dirname;
+    if (!housedepot_revision_repair_files) {
+        housedepot_revision_repair_count =
+            scandir (dirname, &housedepot_revision_repair_files, 0, 0);
+        housedepot_revision_repair_next = 0;
+        housedepot_revision_repair_fixed = 0;
+    }
+
+    long long deadline = housedepot_revision_clock () + HOUSEDEPOT_REPAIR_SLICE;
+
+    for (;;) {
+
+        if (housedepot_revision_clock () >= deadline) return; // Resume later.
 
-        case DT_LNK:
-            { // This block is required by some versions of gcc..
-            char link[1024];
-            char target[1024];
-            snprintf (link, sizeof(link), "%s/%s", dirname, ent->d_name);
-            int pathsz = readlink (link, target, sizeof(target)-1);
-            if (pathsz <= 0) break;
-            target[pathsz] = 0;
-            if (target[0] != '/') break; // No repair needed.
-            housedepot_revision_link (target, link); // Repair as relative.
+        if (housedepot_revision_repair_group) {
+            struct dirent *ent2 = readdir (housedepot_revision_repair_group);
+            if (!ent2) {
+                closedir (housedepot_revision_repair_group);
+                housedepot_revision_repair_group = 0;
+                continue;
             }
-            break;
+            if (ent2->d_type != DT_LNK) continue; // One directory level.
+            char link2[1024];
+            if (snprintf (link2, sizeof(link2), "%s/%s",
+                          housedepot_revision_repair_groupname,
+                          ent2->d_name) >= sizeof(link2)) continue;
+            housedepot_revision_repair_link (link2);
+            continue;
+        }
+        int next = housedepot_revision_repair_next;
+        if (next >= housedepot_revision_repair_count) break;
 
-        default:
-            // Ignore actual files: no repair needed.
-            break;
+        struct dirent *ent = housedepot_revision_repair_files[next];
+        housedepot_revision_repair_next = next + 1;
+        if (ent->d_name[0] == '.') continue; // Skip hidden files, . and ..
+
+        char link[1024];
+        snprintf (link, sizeof(link), "%s/%s", dirname, ent->d_name);
+
+        if (ent->d_type == DT_LNK) {
+            housedepot_revision_repair_link (link);
+
+        } else if (ent->d_type == DT_DIR) {
+            // Support only one level of subdirectory (see README.md)
+            housedepot_revision_repair_group = opendir (link);
+            strtcpy (housedepot_revision_repair_groupname, link,
+                     sizeof(housedepot_revision_repair_groupname));
         }
     }
-    housedepot_revision_cleanscan (files, n);
+
+    // This repository is now complete: mark it, so that it is never
+    // scanned again.
+    //
+    if (housedepot_revision_repair_count >= 0) {
+        char marker[1024];
+        snprintf (marker, sizeof(marker),
+                  "%s/%s", dirname, HOUSEDEPOT_REPAIR_MARKER);
+        int fd = open (marker, O_WRONLY|O_CREAT, 0644);
+        if (fd >= 0) close (fd);
+        houselog_trace (HOUSE_INFO, dirname,
+                        "%d LINKS REPAIRED", housedepot_revision_repair_fixed);
+    }
+    housedepot_revision_cleanscan (housedepot_revision_repair_files,
+                                   housedepot_revision_repair_count);
+    housedepot_revision_repair_files = 0;
+    housedepot_revision_repair_count = 0;
+
+    housedepot_revision_repairs = item->next;
+    free (item->dirname);
+    free (item);
 }
 
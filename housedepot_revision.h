@@ -12,13 +12,30 @@ void housedepot_revision_initialize (const char *host,
 int housedepot_revision_visible (const char *group);
 
 int housedepot_revision_checkout (const char *filename,
-                                  const char *revision);
+                                  const char *revision, int *gzip);
+
+int housedepot_revision_stat (const char *filename,
+                              const char *revision, time_t *mtime);
+
+const char *housedepot_revision_cached (const char *filename, int revision);
 
 const char *housedepot_revision_checkin (const char *clientname,
                                          const char *filename,
                                          time_t      timestamp,
                                          const char *data, int length);
 
+void        housedepot_revision_batch_start (void);
+const char *housedepot_revision_batch_add (const char *clientname,
+                                           const char *filename,
+                                           time_t      timestamp,
+                                           const char *data, int length);
+const char *housedepot_revision_batch_commit (void);
+void        housedepot_revision_batch_cancel (void);
+
+long long   housedepot_revision_batch_stage (void);
+long long   housedepot_revision_committed (void);
+const char *housedepot_revision_outcome (long long commit);
+
 const char *housedepot_revision_apply (const char *tag,
                                        const char *clientname,
                                        const char *filename,
@@ -31,13 +48,21 @@ const char *housedepot_revision_delete (const char *clientname,
 const char *housedepot_revision_list (const char *clientname,
                                       const char *dirname);
 
+const char *housedepot_revision_bundle (const char *clientname,
+                                        const char *dirname,
+                                        const char *files,
+                                        const char *revision,
+                                        int visible);
+
 const char *housedepot_revision_history (const char *clientname,
                                          const char *filename);
 
-void housedepot_revision_prune (const char *clientname,
-                                const char *filename, int depth);
+int housedepot_revision_prune (const char *clientname,
+                               const char *filename, int oldest);
 
 void housedepot_revision_repair (const char *dirname);
+void housedepot_revision_background (void);
 
 long long housedepot_revision_get_update_timestamp (void);
+void housedepot_revision_set_update_timestamp (void);
 
@@ -0,0 +1,1311 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_storage.c - The storage of revision contents.
+ *
+ * DESCRIPTION
+ *
+ * This module writes and removes the revision files on behalf of the
+ * revision module, using the storage method selected for each repository.
+ *
+ * There are four storage methods:
+ *
+ *   copy:  each revision is a separate file. This is the default.
+ *
+ *   blob:  each content is stored once, in a file named after its SHA-256
+ *          hash, under the hidden directory .blobs of the repository. Each
+ *          revision file is a hard link to its content. Identical revisions,
+ *          even from different files or groups, share the same blob.
+ *
+ *   delta: the latest revision is stored in full, while older revisions
+ *          are stored as reverse deltas, i.e. the changes needed to rebuild
+ *          them from the next revision. An older revision is rebuilt when
+ *          it is checked out. A revision that becomes current is stored
+ *          back in full (after the pending jobs for this file), so that
+ *          the current revision is normally not rebuilt.
+ *
+ *   gzip:  the revisions that are neither current or latest are stored
+ *          compressed. A compressed revision can be sent as is to clients
+ *          that accept the gzip encoding, and is decompressed for the
+ *          other clients. A revision that becomes current is stored back
+ *          uncompressed.
+ *
+ * The revision files keep the same name in all methods, so that tags and
+ * links are not impacted. The method of a repository may change: the
+ * revisions stored with the previous method are still read according to
+ * their header, and are stored in full when they become current. With the blob method, the time of a revision
+ * is the time when this content was first stored.
+ *
+ * A delta file starts with a null character (which is never present in
+ * a text file), followed by a one line header and the replacement text:
+ *
+ *   \0HDDELTA <base revision> <prefix length> <suffix length>\n<text>
+ *
+ * The revision is rebuilt by taking the prefix and the suffix from the
+ * base revision, with the text in between. This simple model is meant
+ * for configuration files, where most changes are localized.
+ *
+ * A revision compressed by the gzip method also starts with a header, so
+ * that it cannot be confused with a file that was checked in already
+ * compressed (which is stored and served as is):
+ *
+ *   \0HDGZIP\n<gzip data>
+ *
+ * By default the data is left to the operating system to write back. If
+ * the durability of a repository is set to "fsync", the files written are
+ * flushed to disk before any link is switched to them, and the directories
+ * changed are flushed before the request completes. The flushes are done
+ * for a whole batch of files at once: each new revision file is flushed
+ * using fdatasync(), before any link is switched, and each modified
+ * directory is flushed once afterward. Only the files of the request are
+ * flushed, not the whole file system, which is often shared with the OS
+ * and its logs. A group commit detaches these pending flushes so that a
+ * worker performs them for several requests at once (see
+ * housedepot_revision.c).
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_storage_option (const char *dirname,
+ *                                 const char *name, const char *value);
+ *
+ *   Set a storage option for the specified repository. The options
+ *   supported are "storage", with value "copy", "blob", "delta" or "gzip",
+ *   and "durability", with value "none" or "fsync".
+ *
+ * int housedepot_storage_open (const char *fullname, int revisions,
+ *                              int *gzip);
+ *
+ *   Open the specified revision file for reading. If the revision is
+ *   stored as a delta, it is rebuilt in a temporary file. The number of
+ *   revisions of the file limits the length of the delta chain. If gzip is
+ *   not null, its input value indicates if the caller accepts gzip
+ *   compressed data, and its output value indicates if the returned
+ *   data is compressed. Otherwise a compressed revision is decompressed
+ *   in a temporary file. The revision is decoded according to its header,
+ *   not to the current storage method of the repository.
+ *
+ * int housedepot_storage_encoded (int fd);
+ *
+ *   Return 1 if the revision file open as fd is stored as a delta or
+ *   compressed, i.e. cannot be served as is, whatever the current storage
+ *   method.
+ *
+ * int housedepot_storage_same (const char *fullname,
+ *                              const char *data, int length);
+ *
+ *   Return 1 if the specified revision file has the same content as the
+ *   provided data.
+ *
+ * const char *housedepot_storage_write (const char *fullname,
+ *                                       time_t timestamp,
+ *                                       const char *data, int length,
+ *                                       time_t *mtime);
+ *
+ *   Create the specified revision file with the provided content. The
+ *   timestamp is applied if not 0. Return the time of the new revision
+ *   in mtime. Return 0 on success, an error text otherwise.
+ *
+ * void housedepot_storage_remove (const char *fullname);
+ *
+ *   Remove the specified revision file, and the blob it referenced if it
+ *   is no longer used.
+ *
+ * void housedepot_storage_retire (const char *filename, int revision,
+ *                                 int newer, const char *data, int length);
+ *
+ *   Called when a revision is no longer the latest or current revision:
+ *   with the delta method, store this revision as a delta from the newer
+ *   revision, which content is provided (if known: data may be null).
+ *   With the gzip method, compress this revision.
+ *
+ * int housedepot_storage_compacts (const char *filename);
+ *
+ *   Return 0 if retiring a revision of this file does nothing, 1 if it
+ *   does and 2 if it also uses the content of the newer revision. This
+ *   lets the caller avoid queuing (and copying data for) useless jobs.
+ *
+ * long long housedepot_storage_materialize (const char *fullname,
+ *                                          int revisions);
+ *
+ *   Make sure that the specified revision is stored in full and not
+ *   compressed. The number of revisions of the file limits the length
+ *   of the delta chain. Return the new size of the revision file if it
+ *   was rewritten, -1 otherwise.
+ *
+ * void housedepot_storage_rebase (const char *filename,
+ *                                 int older, int revision, int newer,
+ *                                 int revisions);
+ *
+ *   Called before a revision is deleted: make sure that the older revision
+ *   does not depend on the revision being deleted. The newer revision is
+ *   the new base, or 0 if there is none. The number of revisions of the
+ *   file, including the one being deleted, limits the length of the delta
+ *   chains.
+ *
+ * void housedepot_storage_flush (void);
+ *
+ *   Make all the revision files written since the last flush durable.
+ *   This must be called before switching links to these new files.
+ *
+ * void housedepot_storage_modified (const char *filename);
+ *
+ *   Declare that links were changed in the directory of the specified file.
+ *
+ * void housedepot_storage_sync (void);
+ *
+ *   Make all the pending changes durable, including the modified directories.
+ *   This is a no-op for the repositories without durability.
+ *
+ * int housedepot_storage_durable (const char *filename);
+ *
+ *   Return 1 if the file belongs to a repository with the fsync durability.
+ *
+ * void *housedepot_storage_detach (void);
+ * char *housedepot_storage_commit (void *pending);
+ *
+ *   Take over all the pending flushes, files and directories, and later
+ *   perform them. Detach returns 0 if nothing was pending. Commit may run
+ *   in a worker: it returns the first failure, if any, which the caller
+ *   must report from the main thread and free. The pending flushes are
+ *   released in all cases.
+ *
+ * void housedepot_storage_directory (int fd);
+ *
+ *   Access the revision files of the calling thread relative to the
+ *   specified directory instead of using the index, or cancel this when
+ *   fd is -1. This is used by the workers, as the index belongs to the
+ *   main thread. Only the retire, materialize, rebase and remove functions
+ *   may be called from a worker. If the job is canceled, these functions
+ *   no longer modify the repository.
+ *
+ * char *housedepot_storage_failed (void);
+ *
+ *   Return the first failure met by the calling worker since the last call,
+ *   or 0 if there was none. The caller must report it from the main thread,
+ *   since houselog is not thread safe, and free it. Outside of a worker
+ *   (no directory set), the failures are reported immediately.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include <houselog.h>
+
+#include "housedepot_index.h"
+#include "housedepot_uring.h"
+#include "housedepot_worker.h"
+#include "housedepot_storage.h"
+
+#define HOUSEDEPOT_STORAGE_COPY 0
+#define HOUSEDEPOT_STORAGE_BLOB 1
+#define HOUSEDEPOT_STORAGE_DELTA 2
+#define HOUSEDEPOT_STORAGE_GZIP  3
+
+#define HOUSEDEPOT_STORAGE_MAX 64
+
+// The repositories are declared from the main thread, but their options are
+// also read by the workers: all accesses are done under this lock.
+//
+static pthread_mutex_t housedepot_storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    char *path;
+    int   length;
+    int   method;
+    int   durable;
+} housedepot_storage_repositories[HOUSEDEPOT_STORAGE_MAX];
+
+static int housedepot_storage_count = 0;
+
+// The directories modified since the last sync, and the files written
+// since the last flush, for durable repositories. These lists grow as
+// needed: a group commit may involve many files.
+//
+typedef struct {
+    char **items;
+    int count;
+    int size;
+} housedepot_storage_list;
+
+static housedepot_storage_list housedepot_storage_dirty;
+static housedepot_storage_list housedepot_storage_unflushed;
+
+// The caller must hold housedepot_storage_lock.
+//
+static int housedepot_storage_search (const char *filename) {
+
+    int i;
+    for (i = 0; i < housedepot_storage_count; ++i) {
+        int length = housedepot_storage_repositories[i].length;
+        if ((!strncmp (filename, housedepot_storage_repositories[i].path, length))
+            && (filename[length] == '/')) return i;
+    }
+    return -1;
+}
+
+void housedepot_storage_option (const char *dirname,
+                                const char *name, const char *value) {
+
+    int i;
+    pthread_mutex_lock (&housedepot_storage_lock);
+    for (i = 0; i < housedepot_storage_count; ++i) {
+        if (!strcmp (housedepot_storage_repositories[i].path, dirname)) break;
+    }
+    if (i >= housedepot_storage_count) {
+        if (housedepot_storage_count >= HOUSEDEPOT_STORAGE_MAX) {
+            pthread_mutex_unlock (&housedepot_storage_lock);
+            return;
+        }
+        i = housedepot_storage_count;
+        housedepot_storage_repositories[i].path = strdup (dirname);
+        housedepot_storage_repositories[i].length = strlen(dirname);
+        housedepot_storage_repositories[i].method = HOUSEDEPOT_STORAGE_COPY;
+        housedepot_storage_repositories[i].durable = 0;
+        housedepot_storage_count = i + 1;
+    }
+
+    if (!strcmp (name, "storage")) {
+        if (!strcmp (value, "blob"))
+            housedepot_storage_repositories[i].method = HOUSEDEPOT_STORAGE_BLOB;
+        else if (!strcmp (value, "delta"))
+            housedepot_storage_repositories[i].method = HOUSEDEPOT_STORAGE_DELTA;
+        else if (!strcmp (value, "gzip"))
+            housedepot_storage_repositories[i].method = HOUSEDEPOT_STORAGE_GZIP;
+        else if (!strcmp (value, "copy"))
+            housedepot_storage_repositories[i].method = HOUSEDEPOT_STORAGE_COPY;
+        else
+            houselog_trace (HOUSE_FAILURE, dirname,
+                            "INVALID STORAGE METHOD %s", value);
+    } else if (!strcmp (name, "durability")) {
+        if (!strcmp (value, "fsync"))
+            housedepot_storage_repositories[i].durable = 1;
+        else if (!strcmp (value, "none"))
+            housedepot_storage_repositories[i].durable = 0;
+        else
+            houselog_trace (HOUSE_FAILURE, dirname,
+                            "INVALID DURABILITY %s", value);
+    }
+    pthread_mutex_unlock (&housedepot_storage_lock);
+}
+
+static void housedepot_storage_flushall (housedepot_storage_list *list,
+                                         int directory);
+
+static void housedepot_storage_append (housedepot_storage_list *list,
+                                       char *item, int directory) {
+    if (!item) return;
+    if (list->count >= list->size) {
+        int size = list->size ? list->size * 2 : 64;
+        char **items = realloc (list->items, size * sizeof(char *));
+        if (!items) {
+            // No memory to defer this one: flush it now.
+            housedepot_storage_list single = {&item, 1, 1};
+            housedepot_storage_flushall (&single, directory);
+            return;
+        }
+        list->items = items;
+        list->size = size;
+    }
+    list->items[list->count++] = item;
+}
+
+int housedepot_storage_durable (const char *filename) {
+    pthread_mutex_lock (&housedepot_storage_lock);
+    int i = housedepot_storage_search (filename);
+    int durable = (i < 0) ? 0 : housedepot_storage_repositories[i].durable;
+    pthread_mutex_unlock (&housedepot_storage_lock);
+    return durable;
+}
+
+void housedepot_storage_modified (const char *filename) {
+
+    if (!housedepot_storage_durable (filename)) return;
+
+    const char *sep = strrchr (filename, '/');
+    if (!sep) return;
+    int length = sep - filename;
+
+    int i;
+    for (i = 0; i < housedepot_storage_dirty.count; ++i) {
+        const char *dirty = housedepot_storage_dirty.items[i];
+        if ((!strncmp (dirty, filename, length)) && (!dirty[length])) return;
+    }
+    housedepot_storage_append (&housedepot_storage_dirty,
+                               strndup (filename, length), 1);
+}
+
+// Record that a new file was written, to be flushed by the next sync.
+//
+static void housedepot_storage_written (const char *fullname) {
+
+    if (!housedepot_storage_durable (fullname)) return;
+    housedepot_storage_append (&housedepot_storage_unflushed,
+                               strdup (fullname), 0);
+    housedepot_storage_modified (fullname);
+}
+
+/* The revision files are accessed relative to their directory, which the
+ * index keeps open. This avoids walking the full path on every access.
+ * (The blobs are still accessed using their full path.) A worker thread
+ * provides its own directory instead.
+ */
+static __thread int housedepot_storage_dirfd = -1;
+
+void housedepot_storage_directory (int fd) {
+    housedepot_storage_dirfd = fd;
+}
+
+/* houselog is not thread safe: a worker keeps its first failure until
+ * its job retrieves it, to be reported from the main thread.
+ */
+static __thread char housedepot_storage_failure_text[256];
+static __thread int housedepot_storage_keeping = 0;
+
+static void housedepot_storage_failure (const char *source, int line,
+                                        const char *level,
+                                        const char *object,
+                                        const char *format, ...) {
+    char text[200];
+    va_list args;
+    va_start (args, format);
+    vsnprintf (text, sizeof(text), format, args);
+    va_end (args);
+
+    if ((housedepot_storage_dirfd < 0) && (!housedepot_storage_keeping)) {
+        houselog_trace (source, line, level, object, "%s", text);
+        return;
+    }
+    if (housedepot_storage_failure_text[0]) return; // Keep the first.
+    snprintf (housedepot_storage_failure_text,
+              sizeof(housedepot_storage_failure_text), "%s %s", object, text);
+}
+
+char *housedepot_storage_failed (void) {
+
+    if (!housedepot_storage_failure_text[0]) return 0;
+    char *failure = strdup (housedepot_storage_failure_text);
+    housedepot_storage_failure_text[0] = 0;
+    return failure;
+}
+
+/* Flush the listed files, or directories, by their full path. This does
+ * not use the index, so that it can run in a worker.
+ */
+static void housedepot_storage_flushall (housedepot_storage_list *list,
+                                         int directory) {
+    int i;
+    for (i = 0; i < list->count; ++i) {
+        char *path = list->items[i];
+        int fd = open (path, O_RDONLY|O_CLOEXEC|(directory?O_DIRECTORY:0));
+        if (fd >= 0) {
+            if (directory ? fsync (fd) : fdatasync (fd))
+                housedepot_storage_failure (HOUSE_FAILURE, path,
+                                            "CANNOT SYNC: %s", strerror(errno));
+            close (fd);
+        } else if (directory || (errno != ENOENT)) {
+            // A canceled revision is not an error.
+            housedepot_storage_failure (HOUSE_FAILURE, path,
+                                        "CANNOT OPEN: %s", strerror(errno));
+        }
+        free (path);
+    }
+    list->count = 0;
+}
+
+void housedepot_storage_flush (void) {
+    housedepot_storage_flushall (&housedepot_storage_unflushed, 0);
+}
+
+void housedepot_storage_sync (void) {
+    housedepot_storage_flush ();
+    housedepot_storage_flushall (&housedepot_storage_dirty, 1);
+}
+
+/* A group commit takes over the pending files and directories, so that
+ * they are flushed by a worker while new checkins are accepted.
+ */
+typedef struct {
+    housedepot_storage_list files;
+    housedepot_storage_list directories;
+} housedepot_storage_detached;
+
+void *housedepot_storage_detach (void) {
+
+    if ((housedepot_storage_unflushed.count <= 0) &&
+        (housedepot_storage_dirty.count <= 0)) return 0;
+
+    housedepot_storage_detached *detached =
+        malloc (sizeof(housedepot_storage_detached));
+    if (!detached) {
+        housedepot_storage_sync (); // Better late than never.
+        return 0;
+    }
+    detached->files = housedepot_storage_unflushed;
+    detached->directories = housedepot_storage_dirty;
+    memset (&housedepot_storage_unflushed, 0, sizeof(housedepot_storage_list));
+    memset (&housedepot_storage_dirty, 0, sizeof(housedepot_storage_list));
+    return detached;
+}
+
+char *housedepot_storage_commit (void *pending) {
+
+    if (!pending) return 0;
+    housedepot_storage_detached *detached = pending;
+
+    // The failures are kept for the caller to report from the main thread.
+    housedepot_storage_keeping = 1;
+    housedepot_storage_flushall (&(detached->files), 0);
+    housedepot_storage_flushall (&(detached->directories), 1);
+    free (detached->files.items);
+    free (detached->directories.items);
+    free (detached);
+
+    housedepot_storage_keeping = 0;
+    return housedepot_storage_failed ();
+}
+
+static int housedepot_storage_at (const char *fullname, const char **name) {
+    if (housedepot_storage_dirfd < 0)
+        return housedepot_index_at (fullname, name);
+    const char *sep = strrchr (fullname, '/');
+    *name = sep ? sep + 1 : fullname;
+    return housedepot_storage_dirfd;
+}
+
+static int housedepot_storage_openat (const char *fullname,
+                                      int flags, mode_t mode) {
+    const char *name;
+    int dir = housedepot_storage_at (fullname, &name);
+    if (dir < 0) return -1;
+    return openat (dir, name, flags, mode);
+}
+
+static int housedepot_storage_stat (const char *fullname,
+                                    struct stat *fs, int flags) {
+    const char *name;
+    int dir = housedepot_storage_at (fullname, &name);
+    if (dir < 0) return -1;
+    return fstatat (dir, name, fs, flags);
+}
+
+static void housedepot_storage_unlink (const char *fullname) {
+    const char *name;
+    int dir = housedepot_storage_at (fullname, &name);
+    if (dir < 0) return;
+    unlinkat (dir, name, 0);
+}
+
+static int housedepot_storage_method (const char *filename) {
+    pthread_mutex_lock (&housedepot_storage_lock);
+    int i = housedepot_storage_search (filename);
+    int method = (i < 0) ? HOUSEDEPOT_STORAGE_COPY
+                         : housedepot_storage_repositories[i].method;
+    pthread_mutex_unlock (&housedepot_storage_lock);
+    return method;
+}
+
+static void housedepot_storage_hex (const unsigned char *digest, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < 32; ++i) {
+        *(hex++) = digits[digest[i] >> 4];
+        *(hex++) = digits[digest[i] & 0x0f];
+    }
+    *hex = 0;
+}
+
+/* Build the name of the blob for the provided content. If data is null,
+ * the content is read from the specified revision file.
+ */
+static int housedepot_storage_blob (const char *fullname,
+                                    const char *data, int length,
+                                    char *blob, int size) {
+
+    // The path of a repository never changes once declared.
+    pthread_mutex_lock (&housedepot_storage_lock);
+    int i = housedepot_storage_search (fullname);
+    const char *root = (i < 0) ? 0 : housedepot_storage_repositories[i].path;
+    pthread_mutex_unlock (&housedepot_storage_lock);
+    if (!root) return -1;
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestlength = 0;
+    if (data) {
+        if (!EVP_Digest (data, length, digest, &digestlength, EVP_sha256(), 0))
+            return -1;
+    } else {
+        int fd = housedepot_storage_openat (fullname, O_RDONLY, 0);
+        if (fd < 0) return -1;
+        EVP_MD_CTX *context = EVP_MD_CTX_new ();
+        EVP_DigestInit_ex (context, EVP_sha256(), 0);
+        char buffer[8192];
+        int count;
+        while ((count = read (fd, buffer, sizeof(buffer))) > 0) {
+            EVP_DigestUpdate (context, buffer, count);
+        }
+        close (fd);
+        EVP_DigestFinal_ex (context, digest, &digestlength);
+        EVP_MD_CTX_free (context);
+        if (count < 0) return -1;
+    }
+    if (digestlength != 32) return -1;
+
+    char hex[65];
+    housedepot_storage_hex (digest, hex);
+    snprintf (blob, size, "%s/.blobs/%2.2s/%s", root, hex, hex);
+    return 0;
+}
+
+static int housedepot_storage_same_content (const char *fullname,
+                                            const char *data, int length) {
+    char buffer[1024];
+    int count;
+    int offset = 0;
+
+    int fd = housedepot_storage_openat (fullname, O_RDONLY, 0);
+    if (fd < 0) return 0;
+
+    do {
+        count = read (fd, buffer, sizeof(buffer));
+        if (count > 0) {
+            int next = offset + count;
+            if (next > length) {
+                close(fd);
+                return 0; // The existing file is longer.
+            }
+            if (bcmp (data+offset, buffer, count)) {
+                close(fd);
+                return 0; // Bytes are different.
+            }
+            offset = next;
+        }
+    } while (count == sizeof(buffer));
+    close(fd);
+
+    if (offset < length) return 0; // The existing file is shorter.
+    return 1;
+}
+
+int housedepot_storage_same (const char *fullname,
+                             const char *data, int length) {
+
+    if (housedepot_storage_method (fullname) == HOUSEDEPOT_STORAGE_BLOB) {
+        // Same content means same hash, so same blob: no need to read.
+        char blob[1024];
+        struct stat revisionstat;
+        struct stat blobstat;
+        if (housedepot_storage_blob (fullname, data, length,
+                                     blob, sizeof(blob))) return 0;
+        if (stat (blob, &blobstat)) return 0;
+        if (housedepot_storage_stat (fullname, &revisionstat, 0)) return 0;
+        return (blobstat.st_ino == revisionstat.st_ino) &&
+               (blobstat.st_dev == revisionstat.st_dev);
+    }
+    return housedepot_storage_same_content (fullname, data, length);
+}
+
+static void housedepot_storage_touch (const char *filename, time_t timestamp) {
+
+    if (timestamp > 0) {
+        struct utimbuf ut;
+        ut.actime = ut.modtime = timestamp;
+        utime (filename, &ut);
+    }
+}
+
+static const char *housedepot_storage_copy (const char *fullname,
+                                            time_t timestamp,
+                                            const char *data, int length,
+                                            time_t *mtime) {
+
+    if (housedepot_uring_active () && (housedepot_storage_dirfd < 0)) {
+        const char *name;
+        int dir = housedepot_storage_at (fullname, &name);
+        if ((dir >= 0) &&
+            (housedepot_uring_write (dir, name, data, length, mtime) == 0)) {
+            if (timestamp > 0) {
+                struct timespec times[2];
+                times[0].tv_sec = times[1].tv_sec = timestamp;
+                times[0].tv_nsec = times[1].tv_nsec = 0;
+                utimensat (dir, name, times, 0);
+                *mtime = timestamp;
+            }
+            return 0;
+        }
+        // Otherwise try again the usual way.
+    }
+
+    int fd = housedepot_storage_openat (fullname, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    if (fd < 0) {
+        houselog_trace (HOUSE_FAILURE, fullname, "CANNOT CREATE: %s", strerror(errno));
+        return "Cannot open for writing";
+    }
+    if (write (fd, data, length) != length) {
+        houselog_trace (HOUSE_FAILURE, fullname, "CANNOT WRITE: %s", strerror(errno));
+        close(fd);
+        housedepot_storage_unlink (fullname); // Leave the repository consistent.
+        return "Cannot write the data";
+    }
+    if (timestamp > 0) {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = timestamp;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        futimens (fd, times);
+        *mtime = timestamp;
+    } else {
+        struct stat fs;
+        *mtime = (fstat (fd, &fs) == 0) ? fs.st_mtime : time(0);
+    }
+    close(fd);
+    return 0;
+}
+
+static int housedepot_storage_mkdir (const char *path) {
+    if (mkdir (path, 0755) == 0) return 0;
+    if (errno == EEXIST) return 0;
+    return -1;
+}
+
+static const char *housedepot_storage_share (const char *fullname,
+                                             time_t timestamp,
+                                             const char *data, int length,
+                                             time_t *mtime) {
+    char blob[1024];
+    struct stat fs;
+
+    if (housedepot_storage_blob (fullname, data, length, blob, sizeof(blob)))
+        return housedepot_storage_copy (fullname, timestamp, data, length, mtime);
+
+    if (stat (blob, &fs)) {
+        // This is a new content: write the blob, using a temporary name
+        // so that a blob is never seen partially written.
+        //
+        char *sep = strrchr (blob, '/');
+        *sep = 0;
+        char *top = strrchr (blob, '/');
+        *top = 0;
+        int ok = (housedepot_storage_mkdir (blob) == 0);
+        *top = '/';
+        if (ok) ok = (housedepot_storage_mkdir (blob) == 0);
+        *sep = '/';
+
+        char temp[1024];
+        snprintf (temp, sizeof(temp), "%.*s/.newXXXXXX", (int)(sep - blob), blob);
+        int fd = ok ? mkstemp (temp) : -1;
+        if (fd < 0) {
+            houselog_trace (HOUSE_FAILURE, blob, "CANNOT CREATE: %s", strerror(errno));
+            return housedepot_storage_copy (fullname, timestamp, data, length, mtime);
+        }
+        fchmod (fd, 0644);
+        if (write (fd, data, length) != length) {
+            houselog_trace (HOUSE_FAILURE, blob, "CANNOT WRITE: %s", strerror(errno));
+            close (fd);
+            unlink (temp);
+            return housedepot_storage_copy (fullname, timestamp, data, length, mtime);
+        }
+        close (fd);
+        housedepot_storage_touch (temp, timestamp);
+        if (rename (temp, blob)) {
+            unlink (temp);
+            return housedepot_storage_copy (fullname, timestamp, data, length, mtime);
+        }
+        if (stat (blob, &fs)) return "Cannot access the blob";
+
+        // The new blob's name, and its directory, must be durable too.
+        housedepot_storage_modified (blob);
+        *sep = 0;
+        housedepot_storage_modified (blob);
+        *sep = '/';
+    }
+
+    housedepot_storage_unlink (fullname); // Should not exist, but just in case.
+    const char *name;
+    int dir = housedepot_storage_at (fullname, &name);
+    if ((dir < 0) || linkat (AT_FDCWD, blob, dir, name, 0)) {
+        // Too many links, or any other reason: fall back to a plain copy.
+        houselog_trace (HOUSE_FAILURE, fullname, "CANNOT LINK TO %s: %s", blob, strerror(errno));
+        return housedepot_storage_copy (fullname, timestamp, data, length, mtime);
+    }
+    // The blob's own time belongs to all the revisions that share it:
+    // the time of this revision is only kept in the index.
+    *mtime = (timestamp > 0) ? timestamp : time(0);
+    return 0;
+}
+
+const char *housedepot_storage_write (const char *fullname,
+                                      time_t timestamp,
+                                      const char *data, int length,
+                                      time_t *mtime) {
+
+    const char *error;
+    if (housedepot_storage_method (fullname) == HOUSEDEPOT_STORAGE_BLOB)
+        error = housedepot_storage_share (fullname, timestamp, data, length, mtime);
+    else
+        error = housedepot_storage_copy (fullname, timestamp, data, length, mtime);
+    if (!error) housedepot_storage_written (fullname);
+    return error;
+}
+
+void housedepot_storage_remove (const char *fullname) {
+
+    // If this revision is the last user of a blob, remove the blob as well.
+    // This must be checked before the revision file is removed, as its
+    // content is needed to find the blob. Reading the content is slow, so
+    // it is done before entering the protected section, which the main
+    // thread may wait for.
+    //
+    char blob[1024];
+    struct stat fs;
+    int last = 0;
+    if ((housedepot_storage_stat (fullname, &fs, AT_SYMLINK_NOFOLLOW) == 0) &&
+        S_ISREG(fs.st_mode) && (fs.st_nlink == 2)) {
+        struct stat blobstat;
+        last = (housedepot_storage_blob (fullname, 0, 0, blob, sizeof(blob)) == 0) &&
+               (stat (blob, &blobstat) == 0) &&
+               (blobstat.st_ino == fs.st_ino) && (blobstat.st_dev == fs.st_dev);
+    }
+
+    // A file with the same name may have been created after a cancel.
+    if (!housedepot_worker_enter ()) return;
+
+    // The file must still be the one that was checked above.
+    if (last) {
+        struct stat now;
+        if ((housedepot_storage_stat (fullname, &now, AT_SYMLINK_NOFOLLOW) == 0) &&
+            (now.st_ino == fs.st_ino) && (now.st_dev == fs.st_dev) &&
+            (now.st_nlink == 2)) {
+            unlink (blob);
+        }
+    }
+    housedepot_storage_unlink (fullname);
+    housedepot_worker_leave ();
+}
+
+/* The delta storage method --------------------------------------------- */
+
+static const char housedepot_storage_magic[] = "\0HDDELTA";
+#define HOUSEDEPOT_STORAGE_MAGIC (sizeof(housedepot_storage_magic) - 1)
+
+// The header of the revisions compressed by the gzip method.
+static const char housedepot_storage_gzipped[] = "\0HDGZIP\n";
+#define HOUSEDEPOT_STORAGE_GZIPPED (sizeof(housedepot_storage_gzipped) - 1)
+
+static char *housedepot_storage_load (const char *fullname, int *length) {
+
+    int fd = housedepot_storage_openat (fullname, O_RDONLY, 0);
+    if (fd < 0) return 0;
+
+    struct stat fs;
+    if (fstat (fd, &fs) || (fs.st_size > 0x7fffffff)) {
+        close (fd);
+        return 0;
+    }
+    char *buffer = malloc (fs.st_size + 1);
+    if (!buffer) {
+        close (fd);
+        return 0;
+    }
+    int size = 0;
+    while (size < fs.st_size) {
+        int count = read (fd, buffer + size, fs.st_size - size);
+        if (count <= 0) break;
+        size += count;
+    }
+    close (fd);
+    buffer[size] = 0;
+    *length = size;
+    return buffer;
+}
+
+static int housedepot_storage_isdelta (const char *data, int length) {
+    if (length < HOUSEDEPOT_STORAGE_MAGIC) return 0;
+    return memcmp (data, housedepot_storage_magic, HOUSEDEPOT_STORAGE_MAGIC) == 0;
+}
+
+static int housedepot_storage_isgzip (const char *data, int length);
+static char *housedepot_storage_inflate (const char *data, int length,
+                                         int *size);
+
+/* Load the specified revision file, decompressing it if it was compressed
+ * by the gzip method. The result may still be a delta.
+ */
+static char *housedepot_storage_decompress (const char *fullname, int *length) {
+
+    int size;
+    char *data = housedepot_storage_load (fullname, &size);
+    if (!data) return 0;
+    if (!housedepot_storage_isgzip (data, size)) {
+        *length = size;
+        return data;
+    }
+    char *inflated = housedepot_storage_inflate
+                         (data + HOUSEDEPOT_STORAGE_GZIPPED,
+                          size - HOUSEDEPOT_STORAGE_GZIPPED, length);
+    free (data);
+    return inflated;
+}
+
+static void housedepot_storage_basename (const char *fullname, int base,
+                                         char *name, int size) {
+    const char *sep = strrchr (fullname, '~');
+    int length = sep ? (int)(sep - fullname) : strlen(fullname);
+    snprintf (name, size, "%.*s~%d", length, fullname, base);
+}
+
+/* Return the full content of the specified revision, rebuilding it
+ * if it is stored as a delta. Deltas may be chained: the chain is
+ * followed until a full revision is found, and then each delta is
+ * applied in reverse order. A chain ends with a full revision, so it
+ * holds fewer deltas than the file has revisions: a longer chain is
+ * a loop, caused by a corrupted delta header. Any revision in the chain
+ * may have been compressed, if the storage method changed.
+ */
+static char *housedepot_storage_content (const char *fullname,
+                                         int revisions, int *length) {
+
+    int size;
+    char *data = housedepot_storage_decompress (fullname, &size);
+    if (!data) return 0;
+
+    char **chain = 0;
+    int depth = 0;
+    int allocated = 0;
+    char name[1024];
+
+    while (housedepot_storage_isdelta (data, size)) {
+        if (depth >= revisions - 1) {
+            housedepot_storage_failure
+                (HOUSE_FAILURE, fullname,
+                 "DELTA CHAIN LONGER THAN %d REVISIONS", revisions);
+            goto failure;
+        }
+        if (depth >= allocated) {
+            allocated = allocated ? allocated * 2 : 16;
+            char **larger = realloc (chain, allocated * sizeof(char *));
+            if (!larger) goto failure;
+            chain = larger;
+        }
+        chain[depth++] = data;
+        int base = atoi (data + HOUSEDEPOT_STORAGE_MAGIC);
+        housedepot_storage_basename (fullname, base, name, sizeof(name));
+        data = housedepot_storage_decompress (name, &size);
+        if (!data) goto failure;
+    }
+
+    while (depth > 0) {
+        char *delta = chain[--depth];
+        int base, prefix, suffix;
+        char *text = strchr (delta + HOUSEDEPOT_STORAGE_MAGIC, '\n');
+        if ((!text) ||
+            (sscanf (delta + HOUSEDEPOT_STORAGE_MAGIC,
+                     "%d %d %d", &base, &prefix, &suffix) != 3) ||
+            (prefix < 0) || (suffix < 0) || (prefix + suffix > size)) {
+            free (delta);
+            goto failure;
+        }
+        text += 1;
+        int textlength = strlen (text);
+        int rebuilt = prefix + textlength + suffix;
+        char *result = malloc (rebuilt + 1);
+        if (!result) {
+            free (delta);
+            goto failure;
+        }
+        memcpy (result, data, prefix);
+        memcpy (result + prefix, text, textlength);
+        memcpy (result + prefix + textlength, data + size - suffix, suffix);
+        result[rebuilt] = 0;
+        free (delta);
+        free (data);
+        data = result;
+        size = rebuilt;
+    }
+    free (chain);
+    *length = size;
+    return data;
+
+failure:
+    housedepot_storage_failure (HOUSE_FAILURE, fullname,
+                                "CANNOT REBUILD REVISION");
+    free (data);
+    while (depth > 0) free (chain[--depth]);
+    free (chain);
+    return 0;
+}
+
+/* Replace the specified revision file, keeping its time. The new file is
+ * first written under a temporary name and then renamed, so that there is
+ * never a partially written revision.
+ */
+static int housedepot_storage_replace (const char *fullname,
+                                       const char *header, int headerlength,
+                                       const char *data, int length) {
+    struct stat fs;
+    if (housedepot_storage_stat (fullname, &fs, 0)) return -1;
+
+    char temp[1024];
+    const char *sep = strrchr (fullname, '/');
+    if (!sep) return -1;
+    snprintf (temp, sizeof(temp),
+              "%.*s/.storeXXXXXX", (int)(sep - fullname), fullname);
+    int fd = mkstemp (temp);
+    if (fd < 0) return -1;
+    fchmod (fd, 0644);
+
+    if (((headerlength > 0) &&
+         (write (fd, header, headerlength) != headerlength)) ||
+        (write (fd, data, length) != length)) {
+        housedepot_storage_failure (HOUSE_FAILURE, fullname,
+                                    "CANNOT WRITE: %s", strerror(errno));
+        close (fd);
+        unlink (temp);
+        return -1;
+    }
+    struct timespec times[2];
+    times[0] = fs.st_atim;
+    times[1] = fs.st_mtim;
+    futimens (fd, times);
+
+    // The old content is lost once renamed: the new one must be on disk.
+    if (housedepot_storage_durable (fullname)) fdatasync (fd);
+    close (fd);
+
+    // The file may have been removed meanwhile: do not create it again.
+    if (!housedepot_worker_enter ()) {
+        unlink (temp);
+        return -1;
+    }
+    int failed = rename (temp, fullname);
+    housedepot_worker_leave ();
+    if (failed) {
+        unlink (temp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Return the provided content as an anonymous temporary file.
+ */
+static int housedepot_storage_anonymous (const char *data, int length) {
+
+    char temp[] = P_tmpdir "/housedepotXXXXXX";
+    int fd = mkstemp (temp);
+    if (fd < 0) return -1;
+    unlink (temp);
+    if (write (fd, data, length) != length) {
+        close (fd);
+        return -1;
+    }
+    lseek (fd, 0, SEEK_SET);
+    return fd;
+}
+
+int housedepot_storage_encoded (int fd) {
+
+    char magic[HOUSEDEPOT_STORAGE_GZIPPED];
+    int count = pread (fd, magic, sizeof(magic), 0);
+    if (count <= 0) return 0;
+    return housedepot_storage_isdelta (magic, count) ||
+           housedepot_storage_isgzip (magic, count);
+}
+
+int housedepot_storage_open (const char *fullname, int revisions, int *gzip) {
+
+    int accepted = gzip ? *gzip : 0;
+    if (gzip) *gzip = 0;
+
+    int fd = housedepot_storage_openat (fullname, O_RDONLY, 0);
+    if (fd < 0) return fd;
+
+    // The storage method may have changed since this revision was stored:
+    // only its header tells how it must be read.
+    //
+    char magic[HOUSEDEPOT_STORAGE_GZIPPED];
+    int count = pread (fd, magic, sizeof(magic), 0);
+    if (count <= 0) return fd;
+
+    int length;
+    char *data;
+    if (housedepot_storage_isdelta (magic, count)) {
+        close (fd);
+        data = housedepot_storage_content (fullname, revisions, &length);
+    } else {
+        if (!housedepot_storage_isgzip (magic, count)) return fd;
+        if (accepted) {
+            // Send the compressed data as is, without the header.
+            lseek (fd, HOUSEDEPOT_STORAGE_GZIPPED, SEEK_SET);
+            *gzip = 1;
+            return fd;
+        }
+        close (fd);
+        int size;
+        char *compressed = housedepot_storage_load (fullname, &size);
+        if (!compressed) return -1;
+        data = housedepot_storage_inflate
+                   (compressed + HOUSEDEPOT_STORAGE_GZIPPED,
+                    size - HOUSEDEPOT_STORAGE_GZIPPED, &length);
+        free (compressed);
+    }
+    if (!data) return -1;
+
+    fd = housedepot_storage_anonymous (data, length);
+    free (data);
+    return fd;
+}
+
+static int housedepot_storage_delta (const char *fullname, int base,
+                                     const char *data, int length,
+                                     const char *newer, int newerlength) {
+
+    // Find the common prefix and suffix.
+    //
+    int limit = (length < newerlength) ? length : newerlength;
+    int prefix = 0;
+    while ((prefix < limit) && (data[prefix] == newer[prefix])) prefix += 1;
+    limit -= prefix;
+    int suffix = 0;
+    while ((suffix < limit) &&
+           (data[length-suffix-1] == newer[newerlength-suffix-1])) suffix += 1;
+
+    char header[128];
+    memcpy (header, housedepot_storage_magic, HOUSEDEPOT_STORAGE_MAGIC);
+    int headerlength = HOUSEDEPOT_STORAGE_MAGIC +
+        snprintf (header + HOUSEDEPOT_STORAGE_MAGIC,
+                  sizeof(header) - HOUSEDEPOT_STORAGE_MAGIC,
+                  "%d %d %d\n", base, prefix, suffix);
+
+    int textlength = length - prefix - suffix;
+    if (memchr (data + prefix, 0, textlength)) return -1; // Not text.
+    if (headerlength + textlength >= length) return -1; // Not worth it.
+
+    return housedepot_storage_replace (fullname, header, headerlength,
+                                       data + prefix, textlength);
+}
+
+static void housedepot_storage_compress (const char *fullname);
+
+int housedepot_storage_compacts (const char *filename) {
+    switch (housedepot_storage_method (filename)) {
+        case HOUSEDEPOT_STORAGE_DELTA: return 2;
+        case HOUSEDEPOT_STORAGE_GZIP: return 1;
+    }
+    return 0;
+}
+
+void housedepot_storage_retire (const char *filename, int revision,
+                                int newer, const char *data, int length) {
+
+    char fullname[1024];
+    snprintf (fullname, sizeof(fullname), "%s~%d", filename, revision);
+
+    switch (housedepot_storage_method (filename)) {
+        case HOUSEDEPOT_STORAGE_DELTA: break;
+        case HOUSEDEPOT_STORAGE_GZIP:
+            housedepot_storage_compress (fullname);
+            return;
+        default: return;
+    }
+    if (!data) return; // The delta method needs the newer content.
+
+    // The revision may have been compressed before the method changed.
+    int size;
+    char *content = housedepot_storage_decompress (fullname, &size);
+    if (!content) return;
+    if (!housedepot_storage_isdelta (content, size))
+        housedepot_storage_delta (fullname, newer, content, size, data, length);
+    free (content);
+}
+
+long long housedepot_storage_materialize (const char *fullname, int revisions) {
+
+    // Whatever the current method, the revision may have been stored as
+    // a delta or compressed: only its header tells.
+    int fd = housedepot_storage_openat (fullname, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    int encoded = housedepot_storage_encoded (fd);
+    close (fd);
+    if (!encoded) return -1;
+
+    int size;
+    char *content = housedepot_storage_content (fullname, revisions, &size);
+    if (!content) return -1;
+    int failed = housedepot_storage_replace (fullname, 0, 0, content, size);
+    free (content);
+    return failed ? -1 : size;
+}
+
+void housedepot_storage_rebase (const char *filename,
+                                int older, int revision, int newer,
+                                int revisions) {
+
+    if (older <= 0) return; // Nothing depends on this revision.
+
+    // The older revision may have been stored as a delta before the method
+    // changed: only its header tells.
+    //
+    char fullname[1024];
+    snprintf (fullname, sizeof(fullname), "%s~%d", filename, older);
+
+    int fd = housedepot_storage_openat (fullname, O_RDONLY, 0);
+    if (fd < 0) return;
+    char header[64];
+    int count = pread (fd, header, sizeof(header) - 1, 0);
+    close (fd);
+    if (count <= 0) return;
+    header[count] = 0;
+    int base = housedepot_storage_isdelta (header, count) ?
+                   atoi (header + HOUSEDEPOT_STORAGE_MAGIC) : 0;
+    if (base != revision) return; // Does not depend on the deleted revision.
+
+    int size;
+    char *content = housedepot_storage_content (fullname, revisions, &size);
+    if (!content) return;
+
+    // With another method, the older revision is now stored in full.
+    int rebased = -1;
+    if ((newer > 0) &&
+        (housedepot_storage_method (filename) == HOUSEDEPOT_STORAGE_DELTA)) {
+        char newername[1024];
+        int newersize;
+        snprintf (newername, sizeof(newername), "%s~%d", filename, newer);
+        char *newercontent = housedepot_storage_content
+                                  (newername, revisions, &newersize);
+        if (newercontent) {
+            rebased = housedepot_storage_delta (fullname, newer, content, size,
+                                                newercontent, newersize);
+            free (newercontent);
+        }
+    }
+    if (rebased) housedepot_storage_replace (fullname, 0, 0, content, size);
+    free (content);
+}
+
+/* The gzip storage method ---------------------------------------------- */
+
+// Only the data compressed by this module has the header: a revision that
+// was already gzip data when checked in is not decompressed.
+//
+static int housedepot_storage_isgzip (const char *data, int length) {
+    if (length < HOUSEDEPOT_STORAGE_GZIPPED) return 0;
+    return memcmp (data, housedepot_storage_gzipped,
+                   HOUSEDEPOT_STORAGE_GZIPPED) == 0;
+}
+
+static char *housedepot_storage_deflate (const char *data, int length,
+                                         int *size) {
+    z_stream stream;
+    memset (&stream, 0, sizeof(stream));
+    if (deflateInit2 (&stream, Z_BEST_COMPRESSION,
+                      Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    int limit = deflateBound (&stream, length);
+    char *buffer = malloc (limit);
+    if (!buffer) {
+        deflateEnd (&stream);
+        return 0;
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *)buffer;
+    stream.avail_out = limit;
+    if (deflate (&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd (&stream);
+        free (buffer);
+        return 0;
+    }
+    *size = stream.total_out;
+    deflateEnd (&stream);
+    return buffer;
+}
+
+static char *housedepot_storage_inflate (const char *data, int length,
+                                         int *size) {
+    z_stream stream;
+    memset (&stream, 0, sizeof(stream));
+    if (inflateInit2 (&stream, 15 + 16) != Z_OK) return 0;
+
+    int allocated = length * 4 + 1024;
+    char *buffer = malloc (allocated);
+    if (!buffer) goto failure;
+
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = length;
+    for (;;) {
+        stream.next_out = (Bytef *)(buffer + stream.total_out);
+        stream.avail_out = allocated - stream.total_out;
+        int status = inflate (&stream, Z_NO_FLUSH);
+        if (status == Z_STREAM_END) break;
+        if ((status != Z_OK) && (status != Z_BUF_ERROR)) goto failure;
+        if (stream.avail_out > 0) goto failure; // Truncated data.
+        allocated *= 2;
+        char *larger = realloc (buffer, allocated);
+        if (!larger) goto failure;
+        buffer = larger;
+    }
+    *size = stream.total_out;
+    inflateEnd (&stream);
+    return buffer;
+
+failure:
+    housedepot_storage_failure (HOUSE_FAILURE, "GZIP", "CANNOT DECOMPRESS");
+    inflateEnd (&stream);
+    free (buffer);
+    return 0;
+}
+
+static void housedepot_storage_compress (const char *fullname) {
+
+    int size;
+    char *content = housedepot_storage_load (fullname, &size);
+    if (!content) return;
+
+    // A delta kept from a previous method is already compact, and could
+    // not be sent as is to the clients.
+    if (!housedepot_storage_isgzip (content, size) &&
+        !housedepot_storage_isdelta (content, size)) {
+        int length;
+        char *compressed = housedepot_storage_deflate (content, size, &length);
+        if (compressed) {
+            if (length + HOUSEDEPOT_STORAGE_GZIPPED < size) // Worth it?
+                housedepot_storage_replace (fullname,
+                                            housedepot_storage_gzipped,
+                                            HOUSEDEPOT_STORAGE_GZIPPED,
+                                            compressed, length);
+            free (compressed);
+        }
+    }
+    free (content);
+}
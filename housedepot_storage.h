@@ -0,0 +1,40 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_storage.h - The storage of revision contents.
+ */
+
+void housedepot_storage_option (const char *dirname,
+                                const char *name, const char *value);
+
+int housedepot_storage_same (const char *fullname,
+                             const char *data, int length);
+
+const char *housedepot_storage_write (const char *fullname,
+                                      time_t timestamp,
+                                      const char *data, int length,
+                                      time_t *mtime);
+
+void housedepot_storage_remove (const char *fullname);
+
+int housedepot_storage_open (const char *fullname, int revisions, int *gzip);
+int housedepot_storage_encoded (int fd);
+
+void housedepot_storage_retire (const char *filename, int revision,
+                                int newer, const char *data, int length);
+
+int housedepot_storage_compacts (const char *filename);
+
+long long housedepot_storage_materialize (const char *fullname, int revisions);
+
+void housedepot_storage_rebase (const char *filename,
+                                int older, int revision, int newer,
+                                int revisions);
+
+void housedepot_storage_flush (void);
+void housedepot_storage_modified (const char *filename);
+void housedepot_storage_sync (void);
+int  housedepot_storage_durable (const char *filename);
+void *housedepot_storage_detach (void);
+char *housedepot_storage_commit (void *pending);
+void housedepot_storage_directory (int fd);
+char *housedepot_storage_failed (void);
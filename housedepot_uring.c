@@ -0,0 +1,383 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_uring.c - Batch the storage system calls using io_uring.
+ *
+ * DESCRIPTION
+ *
+ * A checkin costs multiple system calls: creating the revision file,
+ * writing it, closing it, retrieving its time, and then creating and
+ * renaming each link. This module submits such a sequence as one batch
+ * of linked io_uring requests, i.e. using one system call.
+ *
+ * This is only used when enabled with the -uring option, and only if the
+ * kernel supports all the operations needed. Otherwise, or if a batch
+ * fails, the caller falls back to the usual system calls. The ring is
+ * only accessed from the main thread.
+ *
+ * Opening a file into a fixed file slot requires Linux 5.15, while the
+ * operations themselves are older: this is tested when the ring is
+ * created. An operation that fails with EINVAL or EBADF means that the
+ * kernel does not support the way it is used: the ring is then disabled,
+ * instead of failing every checkin.
+ *
+ * This module uses the kernel interface directly: it does not depend on
+ * liburing.
+ *
+ * The GET requests are not impacted: echttp transfers the content from
+ * the file descriptor provided, once the response headers were sent.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_uring_initialize (int argc, const char **argv);
+ *
+ *   Create the ring if the -uring option is present.
+ *
+ * int housedepot_uring_active (void);
+ *
+ *   Return 1 if the io_uring path is enabled and available.
+ *
+ * int housedepot_uring_write (int dir, const char *name,
+ *                             const char *data, int length, time_t *mtime);
+ *
+ *   Create the named file in the specified directory, with the provided
+ *   content, and return its time. Return 0 on success, -1 on failure.
+ *
+ * void housedepot_uring_link (int dir, const char *target,
+ *                             const char *temp, const char *name);
+ *
+ *   Queue the creation of a symbolic link under a temporary name, and
+ *   its renaming over the specified name. Nothing is done until submitted:
+ *   the names must remain valid until then.
+ *
+ * int housedepot_uring_submit (void);
+ *
+ *   Execute all the queued operations, and wait for their completion.
+ *   Return 0 if all were successful, -1 otherwise.
+ */
+
+#define _GNU_SOURCE // For statx().
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <houselog.h>
+
+#include "housedepot_uring.h"
+
+#define HOUSEDEPOT_URING_DEPTH 64
+
+static int housedepot_uring_fd = -1;
+
+static unsigned *housedepot_uring_sqhead;
+static unsigned *housedepot_uring_sqtail;
+static unsigned *housedepot_uring_sqmask;
+static unsigned *housedepot_uring_sqarray;
+static struct io_uring_sqe *housedepot_uring_sqes;
+
+static unsigned *housedepot_uring_cqhead;
+static unsigned *housedepot_uring_cqtail;
+static unsigned *housedepot_uring_cqmask;
+static struct io_uring_cqe *housedepot_uring_cqes;
+
+// The operations queued, and the result expected from each.
+static int housedepot_uring_queued = 0;
+static int housedepot_uring_expected[HOUSEDEPOT_URING_DEPTH];
+static int housedepot_uring_results[HOUSEDEPOT_URING_DEPTH];
+static int housedepot_uring_overflow = 0;
+
+static const int housedepot_uring_needed[] = {
+    IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_STATX,
+    IORING_OP_SYMLINKAT, IORING_OP_RENAMEAT, -1
+};
+
+static int housedepot_uring_supported (void) {
+
+    size_t size = sizeof(struct io_uring_probe)
+                      + (IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = calloc (1, size);
+    if (!probe) return 0;
+    if (syscall (__NR_io_uring_register, housedepot_uring_fd,
+                 IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+        free (probe);
+        return 0;
+    }
+    int i;
+    for (i = 0; housedepot_uring_needed[i] >= 0; ++i) {
+        int op = housedepot_uring_needed[i];
+        if ((op > probe->last_op) ||
+            (!(probe->ops[op].flags & IO_URING_OP_SUPPORTED))) break;
+    }
+    free (probe);
+    if (housedepot_uring_needed[i] >= 0) return 0;
+
+    // One fixed file slot, so that a write can use the file just opened.
+    int slot = -1;
+    if (syscall (__NR_io_uring_register, housedepot_uring_fd,
+                 IORING_REGISTER_FILES, &slot, 1) < 0) return 0;
+    return 1;
+}
+
+static const char *housedepot_uring_setup (void) {
+
+    struct io_uring_params params;
+    memset (&params, 0, sizeof(params));
+    housedepot_uring_fd =
+        syscall (__NR_io_uring_setup, HOUSEDEPOT_URING_DEPTH, &params);
+    if (housedepot_uring_fd < 0) return strerror(errno);
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+        return "kernel too old";
+
+    size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqsize = params.cq_off.cqes
+                        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqsize > sqsize) sqsize = cqsize;
+
+    char *rings = mmap (0, sqsize, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE,
+                        housedepot_uring_fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) return strerror(errno);
+
+    housedepot_uring_sqes =
+        mmap (0, params.sq_entries * sizeof(struct io_uring_sqe),
+              PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              housedepot_uring_fd, IORING_OFF_SQES);
+    if (housedepot_uring_sqes == MAP_FAILED) return strerror(errno);
+
+    housedepot_uring_sqhead = (unsigned *)(rings + params.sq_off.head);
+    housedepot_uring_sqtail = (unsigned *)(rings + params.sq_off.tail);
+    housedepot_uring_sqmask = (unsigned *)(rings + params.sq_off.ring_mask);
+    housedepot_uring_sqarray = (unsigned *)(rings + params.sq_off.array);
+    housedepot_uring_cqhead = (unsigned *)(rings + params.cq_off.head);
+    housedepot_uring_cqtail = (unsigned *)(rings + params.cq_off.tail);
+    housedepot_uring_cqmask = (unsigned *)(rings + params.cq_off.ring_mask);
+    housedepot_uring_cqes =
+        (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    if (!housedepot_uring_supported ()) return "operations not supported";
+    return 0;
+}
+
+int housedepot_uring_active (void) {
+    return housedepot_uring_fd >= 0;
+}
+
+static void housedepot_uring_disable (const char *reason) {
+    houselog_trace (HOUSE_FAILURE, "IO_URING", "DISABLED: %s", reason);
+    close (housedepot_uring_fd);
+    housedepot_uring_fd = -1;
+    housedepot_uring_queued = 0;
+}
+
+static struct io_uring_sqe *housedepot_uring_next (int flags, int expected) {
+
+    if (housedepot_uring_fd < 0) return 0;
+    if (housedepot_uring_queued >= HOUSEDEPOT_URING_DEPTH) return 0;
+
+    unsigned tail = *housedepot_uring_sqtail + housedepot_uring_queued;
+    unsigned index = tail & *housedepot_uring_sqmask;
+    struct io_uring_sqe *sqe = housedepot_uring_sqes + index;
+    memset (sqe, 0, sizeof(*sqe));
+    sqe->flags = flags;
+    sqe->user_data = housedepot_uring_queued;
+    housedepot_uring_sqarray[index] = index;
+    housedepot_uring_expected[housedepot_uring_queued++] = expected;
+    return sqe;
+}
+
+int housedepot_uring_submit (void) {
+
+    int count = housedepot_uring_queued;
+    int failed = housedepot_uring_overflow;
+    housedepot_uring_overflow = 0;
+    if (count <= 0) return failed ? -1 : 0;
+    if (housedepot_uring_fd < 0) return -1;
+    housedepot_uring_queued = 0;
+
+    __atomic_store_n (housedepot_uring_sqtail,
+                      *housedepot_uring_sqtail + count, __ATOMIC_RELEASE);
+
+    int submitted = syscall (__NR_io_uring_enter, housedepot_uring_fd,
+                             count, count, IORING_ENTER_GETEVENTS, 0, 0);
+    if ((submitted < 0) && (errno == EINTR)) submitted = count;
+    if (submitted != count) {
+        // The ring state is now unknown: do not use it anymore.
+        housedepot_uring_disable (strerror(errno));
+        return -1;
+    }
+
+    int completed = 0;
+    int unsupported = 0;
+    while (completed < count) {
+        unsigned head = *housedepot_uring_cqhead;
+        unsigned tail = __atomic_load_n (housedepot_uring_cqtail,
+                                         __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if ((syscall (__NR_io_uring_enter, housedepot_uring_fd,
+                          0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0) &&
+                (errno != EINTR)) {
+                housedepot_uring_disable (strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        while (head != tail) {
+            struct io_uring_cqe *cqe =
+                housedepot_uring_cqes + (head & *housedepot_uring_cqmask);
+            int expected = housedepot_uring_expected[cqe->user_data];
+            housedepot_uring_results[cqe->user_data] = cqe->res;
+            if (cqe->res != expected) {
+                failed = 1;
+                if ((cqe->res == -EINVAL) || (cqe->res == -EBADF))
+                    unsupported = -(cqe->res);
+            }
+            head += 1;
+            completed += 1;
+        }
+        __atomic_store_n (housedepot_uring_cqhead, head, __ATOMIC_RELEASE);
+    }
+    if (unsupported) housedepot_uring_disable (strerror(unsupported));
+    return failed ? -1 : 0;
+}
+
+// Test that a file can be opened into a fixed slot and closed from there.
+// An older kernel may ignore the slot and return a regular descriptor.
+//
+static const char *housedepot_uring_fixed (void) {
+
+    struct io_uring_sqe *sqe = housedepot_uring_next (0, 0);
+    if (!sqe) return "no ring";
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)"/";
+    sqe->open_flags = O_RDONLY|O_DIRECTORY;
+    sqe->file_index = 1; // Slot 0.
+    if (housedepot_uring_submit ()) {
+        int fd = housedepot_uring_results[0];
+        if (fd > 0) close (fd);
+        return "fixed files not supported";
+    }
+    sqe = housedepot_uring_next (0, 0);
+    if (!sqe) return "no ring";
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    if (housedepot_uring_submit ()) return "fixed files not supported";
+    return 0;
+}
+
+void housedepot_uring_initialize (int argc, const char **argv) {
+
+    int i;
+    int enabled = 0;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-uring", argv[i])) enabled = 1;
+    }
+    if (!enabled) return;
+
+    const char *error = housedepot_uring_setup ();
+    if (!error) error = housedepot_uring_fixed ();
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, "IO_URING", "NOT AVAILABLE: %s", error);
+        if (housedepot_uring_fd >= 0) close (housedepot_uring_fd);
+        housedepot_uring_fd = -1;
+        return;
+    }
+    houselog_trace (HOUSE_INFO, "IO_URING", "ENABLED");
+}
+
+int housedepot_uring_write (int dir, const char *name,
+                            const char *data, int length, time_t *mtime) {
+
+    static struct statx fs;
+
+    if (housedepot_uring_queued > HOUSEDEPOT_URING_DEPTH - 4) return -1;
+
+    // The file is opened into the fixed slot 0, so that the write and
+    // close operations can refer to it. The close is done even if the
+    // write failed, but the time is retrieved only if all went well.
+    //
+    struct io_uring_sqe *sqe = housedepot_uring_next (IOSQE_IO_LINK, 0);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir;
+    sqe->addr = (unsigned long)name;
+    sqe->len = 0644;
+    sqe->open_flags = O_WRONLY|O_TRUNC|O_CREAT;
+    sqe->file_index = 1; // Slot 0.
+
+    sqe = housedepot_uring_next (IOSQE_IO_HARDLINK|IOSQE_FIXED_FILE, length);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = 0;
+    sqe->addr = (unsigned long)data;
+    sqe->len = length;
+    sqe->off = 0;
+
+    sqe = housedepot_uring_next (IOSQE_IO_LINK, 0);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+
+    sqe = housedepot_uring_next (0, 0);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir;
+    sqe->addr = (unsigned long)name;
+    sqe->len = STATX_MTIME;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->off = (unsigned long)(&fs);
+
+    if (housedepot_uring_submit ()) return -1;
+    *mtime = fs.stx_mtime.tv_sec;
+    return 0;
+}
+
+void housedepot_uring_link (int dir, const char *target,
+                            const char *temp, const char *name) {
+
+    if (housedepot_uring_queued > HOUSEDEPOT_URING_DEPTH - 2) {
+        housedepot_uring_overflow = 1; // Force the caller to fall back.
+        return;
+    }
+    struct io_uring_sqe *sqe = housedepot_uring_next (IOSQE_IO_LINK, 0);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_SYMLINKAT;
+    sqe->fd = dir;
+    sqe->addr = (unsigned long)target;
+    sqe->off = (unsigned long)temp;
+
+    sqe = housedepot_uring_next (0, 0);
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->fd = dir;
+    sqe->addr = (unsigned long)temp;
+    sqe->len = dir;
+    sqe->off = (unsigned long)name;
+}
@@ -0,0 +1,14 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_uring.h - Batch the storage system calls using io_uring.
+ */
+
+void housedepot_uring_initialize (int argc, const char **argv);
+int  housedepot_uring_active (void);
+
+int  housedepot_uring_write (int dir, const char *name,
+                             const char *data, int length, time_t *mtime);
+
+void housedepot_uring_link (int dir, const char *target,
+                            const char *temp, const char *name);
+int  housedepot_uring_submit (void);
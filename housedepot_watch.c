@@ -0,0 +1,271 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_watch.c - Detect changes made to the repositories on disk.
+ *
+ * DESCRIPTION
+ *
+ * The repositories may be modified behind the service's back, for example
+ * when files are restored by hand or by rsync. This module watches the
+ * repositories' parent directory, each repository and each group
+ * subdirectory using inotify, so that the resident index is never stale.
+ *
+ * Every change reported is checked against the index: the changes made by
+ * this service are already reflected in the index and are ignored, while
+ * any other change invalidates the index of the directory, which is then
+ * loaded again on its next access. An invalidation also changes the update
+ * timestamp and records a reset event for the repository, so that clients
+ * know that they must reload.
+ *
+ * A new directory created in the parent directory is a new repository,
+ * which is declared using the provided callback.
+ *
+ * SYNOPSYS
+ *
+ * typedef void housedepot_watch_callback (const char *name);
+ *
+ * void housedepot_watch_initialize (const char *parent,
+ *                                   housedepot_watch_callback *discover);
+ *
+ *   Start watching the parent directory of all repositories. The discover
+ *   function is called with the name of each new repository directory.
+ *
+ * void housedepot_watch_repository (const char *path);
+ *
+ *   Start watching the specified repository and its group subdirectories.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include <houselog.h>
+
+#include "housedepot_event.h"
+#include "housedepot_index.h"
+#include "housedepot_revision.h"
+#include "housedepot_watch.h"
+
+#define HOUSEDEPOT_WATCH_MAX 1024
+
+#define HOUSEDEPOT_WATCH_PARENT     0
+#define HOUSEDEPOT_WATCH_REPOSITORY 1
+#define HOUSEDEPOT_WATCH_GROUP      2
+
+#define HOUSEDEPOT_WATCH_FILES (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+                                IN_CLOSE_WRITE|IN_ATTRIB| \
+                                IN_DELETE_SELF|IN_MOVE_SELF)
+
+static int housedepot_watch_fd = -1;
+
+static struct {
+    int wd;
+    int kind;
+    char *path;
+} housedepot_watch_table[HOUSEDEPOT_WATCH_MAX];
+
+static int housedepot_watch_count = 0;
+
+static housedepot_watch_callback *housedepot_watch_discover = 0;
+
+static void housedepot_watch_add (const char *path, int kind) {
+
+    if (housedepot_watch_fd < 0) return;
+
+    int mask = (kind == HOUSEDEPOT_WATCH_PARENT) ?
+                   (IN_CREATE|IN_MOVED_TO|IN_ONLYDIR) :
+                   (HOUSEDEPOT_WATCH_FILES|IN_ONLYDIR);
+    int wd = inotify_add_watch (housedepot_watch_fd, path, mask);
+    if (wd < 0) {
+        houselog_trace (HOUSE_FAILURE, path, "CANNOT WATCH: %s", strerror(errno));
+        return;
+    }
+
+    int i;
+    for (i = 0; i < housedepot_watch_count; ++i) {
+        if (housedepot_watch_table[i].wd == wd) return; // Already watched.
+    }
+    for (i = 0; i < housedepot_watch_count; ++i) {
+        if (housedepot_watch_table[i].wd < 0) break; // Reuse a free slot.
+    }
+    if (i >= housedepot_watch_count) {
+        if (housedepot_watch_count >= HOUSEDEPOT_WATCH_MAX) {
+            inotify_rm_watch (housedepot_watch_fd, wd);
+            return;
+        }
+        i = housedepot_watch_count++;
+    }
+    housedepot_watch_table[i].wd = wd;
+    housedepot_watch_table[i].kind = kind;
+    housedepot_watch_table[i].path = strdup (path);
+}
+
+static int housedepot_watch_search (int wd) {
+    int i;
+    for (i = 0; i < housedepot_watch_count; ++i) {
+        if (housedepot_watch_table[i].wd == wd) return i;
+    }
+    return -1;
+}
+
+static void housedepot_watch_remove (int i) {
+    free (housedepot_watch_table[i].path);
+    housedepot_watch_table[i].path = 0;
+    housedepot_watch_table[i].wd = -1;
+}
+
+static void housedepot_watch_invalidate (const char *path) {
+    housedepot_index_invalidate (path);
+    housedepot_event_invalidate (path);
+}
+
+// Handle one change. Return 1 if the index was invalidated.
+//
+static int housedepot_watch_event (const struct inotify_event *event) {
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Some changes were lost: nothing in the index can be trusted.
+        housedepot_watch_invalidate (0);
+        return 1;
+    }
+
+    int i = housedepot_watch_search (event->wd);
+    if (i < 0) return 0;
+    const char *path = housedepot_watch_table[i].path;
+
+    if (event->mask & IN_IGNORED) {
+        // The directory was removed, or is no longer accessible.
+        housedepot_watch_invalidate (path);
+        housedepot_watch_remove (i);
+        return 1;
+    }
+    if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) {
+        housedepot_watch_invalidate (path);
+        return 1;
+    }
+    if ((!event->len) || (event->name[0] == '.')) return 0;
+
+    char child[1024];
+    snprintf (child, sizeof(child), "%s/%s", path, event->name);
+
+    switch (housedepot_watch_table[i].kind) {
+
+    case HOUSEDEPOT_WATCH_PARENT:
+        if (!(event->mask & IN_ISDIR)) return 0;
+        if (housedepot_watch_discover)
+            housedepot_watch_discover (event->name);
+        return 1;
+
+    case HOUSEDEPOT_WATCH_REPOSITORY:
+        if (event->mask & IN_ISDIR) {
+            // A group was added or removed: the repository's list of
+            // groups must be loaded again, unless the index already
+            // knows, e.g. the group was created by a checkin.
+            if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
+                housedepot_watch_add (child, HOUSEDEPOT_WATCH_GROUP);
+                if (housedepot_index_known (child)) return 0;
+            } else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
+                if (!housedepot_index_known (child)) return 0;
+                housedepot_index_invalidate (child);
+            } else
+                return 0;
+            housedepot_watch_invalidate (path);
+            return 1;
+        }
+        // Files may be stored at the root of the repository too.
+        // Fall through.
+
+    case HOUSEDEPOT_WATCH_GROUP:
+        if (event->mask & IN_ISDIR) return 0; // Only one level of groups.
+        if (!housedepot_index_verify (path, event->name)) return 0;
+        housedepot_event_invalidate (path);
+        return 1;
+    }
+    return 0;
+}
+
+static void housedepot_watch_receive (int fd, int mode) {
+
+    char buffer[8192]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    int invalidated = 0;
+    for (;;) {
+        int length = read (fd, buffer, sizeof(buffer));
+        if (length <= 0) break;
+
+        const char *cursor = buffer;
+        while (cursor < buffer + length) {
+            const struct inotify_event *event =
+                (const struct inotify_event *)cursor;
+            invalidated |= housedepot_watch_event (event);
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (invalidated) {
+        housedepot_event_reset ();
+        housedepot_revision_set_update_timestamp ();
+    }
+}
+
+void housedepot_watch_initialize (const char *parent,
+                                  housedepot_watch_callback *discover) {
+
+    if (housedepot_watch_fd >= 0) return;
+
+    housedepot_watch_fd = inotify_init1 (IN_NONBLOCK);
+    if (housedepot_watch_fd < 0) {
+        houselog_trace (HOUSE_FAILURE, parent,
+                        "CANNOT WATCH: %s", strerror(errno));
+        return;
+    }
+    housedepot_watch_discover = discover;
+    housedepot_watch_add (parent, HOUSEDEPOT_WATCH_PARENT);
+    echttp_listen (housedepot_watch_fd, 1, housedepot_watch_receive, 0);
+}
+
+void housedepot_watch_repository (const char *path) {
+
+    housedepot_watch_add (path, HOUSEDEPOT_WATCH_REPOSITORY);
+
+    DIR *d = opendir (path);
+    if (!d) return;
+    struct dirent *ent;
+    while ((ent = readdir (d))) {
+        if (ent->d_name[0] == '.') continue; // Skip hidden entries.
+        if (ent->d_type != DT_DIR) continue; // Only the groups.
+        char group[1024];
+        snprintf (group, sizeof(group), "%s/%s", path, ent->d_name);
+        housedepot_watch_add (group, HOUSEDEPOT_WATCH_GROUP);
+    }
+    closedir (d);
+}
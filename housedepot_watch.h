@@ -0,0 +1,11 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_watch.h - Detect changes made to the repositories on disk.
+ */
+
+typedef void housedepot_watch_callback (const char *name);
+
+void housedepot_watch_initialize (const char *parent,
+                                  housedepot_watch_callback *discover);
+
+void housedepot_watch_repository (const char *path);
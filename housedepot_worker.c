@@ -0,0 +1,336 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * housedepot_worker.c - Run the slow storage operations in the background.
+ *
+ * DESCRIPTION
+ *
+ * Some storage operations do not need to complete before the response is
+ * sent, for example compressing older revisions or removing pruned ones.
+ * This module runs these operations in a small pool of threads, so that
+ * a slow disk does not delay the other requests.
+ *
+ * Each job is identified by a key, typically the file name: all jobs with
+ * the same key are executed by the same thread, in the order they were
+ * submitted. The completion function of each job is called later from the
+ * echttp loop, so that it may safely access the rest of the application.
+ *
+ * The job function runs in a separate thread and must only access what
+ * was provided in its context.
+ *
+ * The echttp loop never waits for a worker. An operation that must not
+ * overlap with the jobs of a file either queues its own job with the same
+ * key, so that it runs after them, or cancels them. A canceled job that
+ * was not started yet is skipped, and a running job is told when it tries
+ * to modify the repository (see housedepot_worker_enter). The completion
+ * function is called in all cases.
+ *
+ * If the number of workers is 0, the jobs are executed immediately.
+ *
+ * SYNOPSYS
+ *
+ * void housedepot_worker_initialize (int argc, const char **argv);
+ *
+ *   Start the workers. The number of threads is set using the
+ *   -workers=N option (default: 2, maximum: 16).
+ *
+ * typedef void housedepot_worker_job (void *context);
+ *
+ * void housedepot_worker_submit (const char *key,
+ *                                housedepot_worker_job *job,
+ *                                housedepot_worker_job *done,
+ *                                void *context);
+ *
+ *   Queue a job. The done function (if not null) is called from the echttp
+ *   loop after the job has completed: it is typically used to release the
+ *   context.
+ *
+ * int housedepot_worker_idle (const char *key);
+ *
+ *   Return 1 if no job with the same key is queued, running, or waiting
+ *   for its done function to be called.
+ *
+ * void housedepot_worker_cancel (const char *key);
+ *
+ *   Cancel all the jobs with the same key that are queued or running.
+ *   This is used before an operation that must not overlap with these jobs,
+ *   for example removing all the files they work on.
+ *
+ * int  housedepot_worker_enter (void);
+ * void housedepot_worker_leave (void);
+ *
+ *   Protect a short modification of the repository made by the current
+ *   job, e.g. a rename, against a concurrent cancel. Enter returns 0 if the
+ *   job was canceled: the modification must not be done, and leave must
+ *   not be called. Outside of a worker thread, enter always returns 1.
+ *
+ * int housedepot_worker_pending (void);
+ *
+ *   Return the number of jobs not yet completed.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <echttp.h>
+
+#include "housedepot_worker.h"
+
+#define HOUSEDEPOT_WORKER_MAX 16
+
+typedef struct housedepot_worker_item housedepot_worker_item;
+
+struct housedepot_worker_item {
+    housedepot_worker_item *next;
+    housedepot_worker_job *job;
+    housedepot_worker_job *done;
+    void *context;
+    char *key;
+    int canceled; // Protected by the lock of the worker.
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    housedepot_worker_item *running;
+    housedepot_worker_item *first;
+    housedepot_worker_item *last;
+} housedepot_worker_pool[HOUSEDEPOT_WORKER_MAX];
+
+static int housedepot_worker_count = 0;
+
+// The completed jobs, waiting for their done function to be called.
+static pthread_mutex_t housedepot_worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static housedepot_worker_item *housedepot_worker_completed = 0;
+static int housedepot_worker_signal[2] = {-1, -1};
+
+static int housedepot_worker_queued = 0; // Only accessed from the loop.
+
+// The job run by the current thread, and the worker it belongs to.
+static __thread housedepot_worker_item *housedepot_worker_current = 0;
+static __thread int housedepot_worker_self = -1;
+
+static int housedepot_worker_select (const char *key) {
+
+    unsigned int hash = 2166136261u; // FNV-1a.
+    while (*key) {
+        hash ^= (unsigned char)(*(key++));
+        hash *= 16777619u;
+    }
+    return hash % housedepot_worker_count;
+}
+
+static void *housedepot_worker_run (void *arg) {
+
+    int w = (int)(long)arg;
+    housedepot_worker_self = w;
+
+    pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+    for (;;) {
+        housedepot_worker_item *item = housedepot_worker_pool[w].first;
+        if (!item) {
+            pthread_cond_wait (&(housedepot_worker_pool[w].wakeup),
+                               &(housedepot_worker_pool[w].lock));
+            continue;
+        }
+        housedepot_worker_pool[w].first = item->next;
+        if (!item->next) housedepot_worker_pool[w].last = 0;
+        housedepot_worker_pool[w].running = item;
+        int canceled = item->canceled;
+        pthread_mutex_unlock (&(housedepot_worker_pool[w].lock));
+
+        if (!canceled) {
+            housedepot_worker_current = item;
+            item->job (item->context);
+            housedepot_worker_current = 0;
+        }
+
+        // A cancel must not see this item once it was handed back.
+        pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+        housedepot_worker_pool[w].running = 0;
+        pthread_mutex_unlock (&(housedepot_worker_pool[w].lock));
+
+        pthread_mutex_lock (&housedepot_worker_lock);
+        item->next = housedepot_worker_completed;
+        housedepot_worker_completed = item;
+        pthread_mutex_unlock (&housedepot_worker_lock);
+        char signal = 1;
+        if (write (housedepot_worker_signal[1], &signal, 1) < 0) {
+            // Already signaled: the pipe is full.
+        }
+
+        pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+    }
+    return 0;
+}
+
+static void housedepot_worker_complete (int fd, int mode) {
+
+    char buffer[256];
+    while (read (fd, buffer, sizeof(buffer)) > 0) ;
+
+    pthread_mutex_lock (&housedepot_worker_lock);
+    housedepot_worker_item *item = housedepot_worker_completed;
+    housedepot_worker_completed = 0;
+    pthread_mutex_unlock (&housedepot_worker_lock);
+
+    while (item) {
+        housedepot_worker_item *next = item->next;
+        if (item->done) item->done (item->context);
+        free (item->key);
+        free (item);
+        housedepot_worker_queued -= 1;
+        item = next;
+    }
+}
+
+void housedepot_worker_initialize (int argc, const char **argv) {
+
+    const char *option = "2";
+    int i;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-workers=", argv[i], &option);
+    }
+    int count = atoi (option);
+    if (count <= 0) return;
+    if (count > HOUSEDEPOT_WORKER_MAX) count = HOUSEDEPOT_WORKER_MAX;
+
+    if (pipe (housedepot_worker_signal)) return;
+    fcntl (housedepot_worker_signal[0], F_SETFL, O_NONBLOCK);
+    fcntl (housedepot_worker_signal[1], F_SETFL, O_NONBLOCK);
+    echttp_listen (housedepot_worker_signal[0], 1, housedepot_worker_complete, 0);
+
+    for (i = 0; i < count; ++i) {
+        pthread_mutex_init (&(housedepot_worker_pool[i].lock), 0);
+        pthread_cond_init (&(housedepot_worker_pool[i].wakeup), 0);
+        housedepot_worker_pool[i].running = 0;
+        housedepot_worker_pool[i].first = 0;
+        housedepot_worker_pool[i].last = 0;
+        if (pthread_create (&(housedepot_worker_pool[i].thread), 0,
+                            housedepot_worker_run, (void *)(long)i)) break;
+        housedepot_worker_count = i + 1;
+    }
+}
+
+void housedepot_worker_submit (const char *key,
+                               housedepot_worker_job *job,
+                               housedepot_worker_job *done,
+                               void *context) {
+
+    housedepot_worker_item *item = 0;
+    if (housedepot_worker_count > 0)
+        item = malloc (sizeof(housedepot_worker_item));
+    if (item) {
+        item->key = strdup (key);
+        if (!item->key) {
+            free (item);
+            item = 0;
+        }
+    }
+    if (!item) {
+        job (context);
+        if (done) done (context);
+        return;
+    }
+    item->next = 0;
+    item->job = job;
+    item->done = done;
+    item->context = context;
+    item->canceled = 0;
+    housedepot_worker_queued += 1;
+
+    int w = housedepot_worker_select (key);
+    pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+    if (housedepot_worker_pool[w].last)
+        housedepot_worker_pool[w].last->next = item;
+    else
+        housedepot_worker_pool[w].first = item;
+    housedepot_worker_pool[w].last = item;
+    pthread_cond_signal (&(housedepot_worker_pool[w].wakeup));
+    pthread_mutex_unlock (&(housedepot_worker_pool[w].lock));
+}
+
+int housedepot_worker_idle (const char *key) {
+
+    if (housedepot_worker_count <= 0) return 1;
+
+    int idle = 1;
+    int w = housedepot_worker_select (key);
+    pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+    housedepot_worker_item *item = housedepot_worker_pool[w].running;
+    if (item && !strcmp (item->key, key)) idle = 0;
+    for (item = housedepot_worker_pool[w].first; item; item = item->next) {
+        if (!strcmp (item->key, key)) idle = 0;
+    }
+    pthread_mutex_unlock (&(housedepot_worker_pool[w].lock));
+    if (!idle) return 0;
+
+    pthread_mutex_lock (&housedepot_worker_lock);
+    for (item = housedepot_worker_completed; item; item = item->next) {
+        if (!strcmp (item->key, key)) idle = 0;
+    }
+    pthread_mutex_unlock (&housedepot_worker_lock);
+    return idle;
+}
+
+void housedepot_worker_cancel (const char *key) {
+
+    if (housedepot_worker_count <= 0) return;
+
+    int w = housedepot_worker_select (key);
+    pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+    housedepot_worker_item *item = housedepot_worker_pool[w].running;
+    if (item && !strcmp (item->key, key)) item->canceled = 1;
+    for (item = housedepot_worker_pool[w].first; item; item = item->next) {
+        if (!strcmp (item->key, key)) item->canceled = 1;
+    }
+    pthread_mutex_unlock (&(housedepot_worker_pool[w].lock));
+}
+
+int housedepot_worker_enter (void) {
+
+    if (!housedepot_worker_current) return 1;
+
+    int w = housedepot_worker_self;
+    pthread_mutex_lock (&(housedepot_worker_pool[w].lock));
+    if (housedepot_worker_current->canceled) {
+        pthread_mutex_unlock (&(housedepot_worker_pool[w].lock));
+        return 0;
+    }
+    return 1;
+}
+
+void housedepot_worker_leave (void) {
+
+    if (!housedepot_worker_current) return;
+    pthread_mutex_unlock (&(housedepot_worker_pool[housedepot_worker_self].lock));
+}
+
+int housedepot_worker_pending (void) {
+    return housedepot_worker_queued;
+}
@@ -0,0 +1,21 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * housedepot_worker.h - Run the slow storage operations in the background.
+ */
+
+void housedepot_worker_initialize (int argc, const char **argv);
+
+typedef void housedepot_worker_job (void *context);
+
+void housedepot_worker_submit (const char *key,
+                               housedepot_worker_job *job,
+                               housedepot_worker_job *done,
+                               void *context);
+
+int housedepot_worker_idle (const char *key);
+void housedepot_worker_cancel (const char *key);
+
+int  housedepot_worker_enter (void);
+void housedepot_worker_leave (void);
+
+int housedepot_worker_pending (void);
@@ -0,0 +1,793 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * depotbench.c - An HTTP load generator for HouseDepot.
+ *
+ * DESCRIPTION
+ *
+ * This program starts a HouseDepot service on an empty, temporary, root
+ * directory, fills a synthetic repository using PUT and POST requests,
+ * and then runs a mix of requests for a fixed duration, from multiple
+ * concurrent clients. It reports the throughput and the latency
+ * percentiles for each kind of request, so that the performance of the
+ * service can be compared from one version to the next on the same
+ * machine.
+ *
+ * The kinds of requests are:
+ *
+ *   get      GET of the current revision of a file.
+ *   rev      GET of a specific revision (?revision=N).
+ *   put      PUT of a new revision.
+ *   tag      POST of a tag (?revision=N&tag=NAME).
+ *   all      GET of the list of files in a group (/all).
+ *   history  GET of the history of a file (?revision=all).
+ *
+ * Each client uses its own persistent HTTP connection, and sends its next
+ * request as soon as the previous response was received. The files and
+ * the kinds of requests are picked at random, using a fixed seed, so that
+ * two runs send the same sequences of requests.
+ *
+ * The synthetic repository is named "bench". It contains groups of up to
+ * 100 files, each file with the same number of revisions and tags.
+ *
+ * SYNOPSYS
+ *
+ * depotbench [-server=PATH] [-port=N] [-root=PATH] [-url=URL]
+ *            [-files=N] [-revisions=N] [-tags=N] [-size=N]
+ *            [-clients=N] [-duration=N] [-mix=KIND:WEIGHT,...] [-keep]
+ *            [service options..]
+ *
+ *   -server:    the HouseDepot program to start (default: ./housedepot).
+ *   -port:      the HTTP port used by the service (default: 8099).
+ *   -root:      the root directory for the service. The default is a new
+ *               temporary directory, removed at the end unless -keep.
+ *   -url:       run against a service that is already running, for example
+ *               http://localhost:8099. The bench repository must exist.
+ *   -files:     the number of files created (default: 100).
+ *   -revisions: the number of revisions of each file (default: 20).
+ *   -tags:      the number of tags on each file (default: 5).
+ *   -size:      the size of each revision, in bytes (default: 256).
+ *   -clients:   the number of concurrent clients (default: 8).
+ *   -duration:  the duration of the measurement, in seconds (default: 10).
+ *   -mix:       the weight of each kind of requests (default:
+ *               get:60,rev:10,put:10,tag:5,all:5,history:10).
+ *
+ * All other options are passed to the service, e.g. -uring.
+ */
+
+#define _GNU_SOURCE // For nftw().
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEPOTBENCH_GROUP 100 // Files per group directory.
+
+enum {
+    DEPOTBENCH_GET,
+    DEPOTBENCH_REV,
+    DEPOTBENCH_PUT,
+    DEPOTBENCH_TAG,
+    DEPOTBENCH_ALL,
+    DEPOTBENCH_HISTORY,
+    DEPOTBENCH_KINDS
+};
+
+static const char *depotbench_names[DEPOTBENCH_KINDS] = {
+    "get", "rev", "put", "tag", "all", "history"
+};
+
+static int depotbench_weights[DEPOTBENCH_KINDS] = {60, 10, 10, 5, 5, 10};
+
+static const char *depotbench_server = "./housedepot";
+static const char *depotbench_root = 0;
+static const char *depotbench_url = 0;
+static int depotbench_port = 8099;
+static int depotbench_files = 100;
+static int depotbench_revisions = 20;
+static int depotbench_tags = 5;
+static int depotbench_size = 256;
+static int depotbench_clients = 8;
+static int depotbench_duration = 10;
+static int depotbench_keep = 0;
+
+static char depotbench_host[256] = "127.0.0.1";
+static struct sockaddr_storage depotbench_address;
+static socklen_t depotbench_addresslength;
+
+static volatile int depotbench_running = 0;
+
+typedef struct {
+    long long *samples; // Latency in microseconds.
+    int count;
+    int size;
+    int errors;
+} depotbench_series;
+
+typedef struct {
+    int id;
+    int socket;
+    unsigned int seed;
+    int first;   // First file to populate.
+    int last;    // Last file to populate (excluded).
+    int updates; // Used to make each PUT content unique.
+    char *content;
+    char buffer[65536];
+    depotbench_series series[DEPOTBENCH_KINDS];
+} depotbench_client;
+
+static long long depotbench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static int depotbench_option (const char *name,
+                              const char *arg, const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, name, length)) return 0;
+    *value = arg + length;
+    return 1;
+}
+
+static void depotbench_record (depotbench_series *series,
+                               long long latency, int ok) {
+    if (!ok) {
+        series->errors += 1;
+        return;
+    }
+    if (series->count >= series->size) {
+        series->size = series->size ? series->size * 2 : 4096;
+        series->samples =
+            realloc (series->samples, series->size * sizeof(long long));
+        if (!series->samples) {
+            fprintf (stderr, "depotbench: out of memory\n");
+            exit (1);
+        }
+    }
+    series->samples[series->count++] = latency;
+}
+
+// HTTP client. ----------------------------------------------------------
+
+static int depotbench_resolve (const char *url) {
+
+    const char *host = strstr (url, "://");
+    host = host ? host + 3 : url;
+
+    const char *colon = strchr (host, ':');
+    const char *slash = strchr (host, '/');
+    int length = colon ? colon - host : (slash ? slash - host : strlen(host));
+    if (length <= 0 || length >= sizeof(depotbench_host)) return 0;
+    memcpy (depotbench_host, host, length);
+    depotbench_host[length] = 0;
+    depotbench_port = colon ? atoi (colon + 1) : 80;
+
+    struct addrinfo hints = {0};
+    struct addrinfo *result = 0;
+    char port[16];
+    snprintf (port, sizeof(port), "%d", depotbench_port);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (depotbench_host, port, &hints, &result) || !result) {
+        fprintf (stderr, "depotbench: unknown host %s\n", depotbench_host);
+        return 0;
+    }
+    memcpy (&depotbench_address, result->ai_addr, result->ai_addrlen);
+    depotbench_addresslength = result->ai_addrlen;
+    freeaddrinfo (result);
+    return 1;
+}
+
+static int depotbench_connect (void) {
+
+    int s = socket (depotbench_address.ss_family, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    if (connect (s, (struct sockaddr *)&depotbench_address,
+                 depotbench_addresslength) < 0) {
+        close (s);
+        return -1;
+    }
+    int one = 1;
+    setsockopt (s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+static int depotbench_send (int s, const char *data, int length) {
+    while (length > 0) {
+        int sent = send (s, data, length, 0);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+// Read one response and return its status, or 0 if the connection failed.
+// The content is read and discarded. The connection is closed if the
+// server asked for it.
+//
+static int depotbench_receive (depotbench_client *client) {
+
+    char *buffer = client->buffer;
+    int size = sizeof(client->buffer) - 1;
+    int length = 0;
+    char *body = 0;
+
+    while (!body) {
+        if (length >= size) return 0; // Headers too large.
+        int received = recv (client->socket, buffer + length, size - length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) continue;
+            return 0;
+        }
+        length += received;
+        buffer[length] = 0;
+        body = strstr (buffer, "\r\n\r\n");
+    }
+    body += 4;
+
+    int status = 0;
+    if (sscanf (buffer, "HTTP/%*d.%*d %d", &status) != 1) return 0;
+
+    // Header names are case insensitive, but not their values.
+    long long contentlength = -1;
+    int keepalive = (strncmp (buffer, "HTTP/1.0", 8) != 0);
+    char *line;
+    for (line = strstr (buffer, "\r\n"); line && line < body;
+         line = strstr (line, "\r\n")) {
+        line += 2;
+        if (!strncasecmp (line, "Content-Length:", 15)) {
+            contentlength = atoll (line + 15);
+        } else if (!strncasecmp (line, "Connection:", 11)) {
+            const char *value = line + 11;
+            while (*value == ' ') value += 1;
+            if (!strncasecmp (value, "close", 5)) keepalive = 0;
+            else if (!strncasecmp (value, "keep-alive", 10)) keepalive = 1;
+        }
+    }
+
+    long long remaining;
+    if (contentlength >= 0) {
+        remaining = contentlength - (length - (body - buffer));
+        while (remaining > 0) {
+            int received = recv (client->socket, buffer, size, 0);
+            if (received <= 0) {
+                if (received < 0 && errno == EINTR) continue;
+                return 0;
+            }
+            remaining -= received;
+        }
+    } else {
+        // No length: the content ends when the connection is closed.
+        while (recv (client->socket, buffer, size, 0) > 0) ;
+        keepalive = 0;
+    }
+    if (!keepalive) {
+        close (client->socket);
+        client->socket = -1;
+    }
+    return status;
+}
+
+// Send one request and wait for its response. Return the HTTP status,
+// or 0 if the service could not be reached. A request is retried once
+// on a new connection, since the service may have closed an idle one.
+//
+static int depotbench_request (depotbench_client *client,
+                               const char *method, const char *uri,
+                               const char *data, int length) {
+
+    char header[1024];
+    int headerlength =
+        snprintf (header, sizeof(header),
+                  "%s %s HTTP/1.1\r\n"
+                  "Host: %s:%d\r\n"
+                  "Content-Length: %d\r\n"
+                  "\r\n",
+                  method, uri, depotbench_host, depotbench_port, length);
+    if (headerlength >= sizeof(header)) return 0;
+
+    int attempt;
+    for (attempt = 0; attempt < 2; ++attempt) {
+        int reused = (client->socket >= 0);
+        if (!reused) {
+            client->socket = depotbench_connect ();
+            if (client->socket < 0) return 0;
+        }
+        if (depotbench_send (client->socket, header, headerlength) &&
+            depotbench_send (client->socket, data, length)) {
+            int status = depotbench_receive (client);
+            if (status) return status;
+        }
+        if (client->socket >= 0) {
+            close (client->socket);
+            client->socket = -1;
+        }
+        if (!reused) break;
+    }
+    return 0;
+}
+
+// The synthetic repository. ---------------------------------------------
+
+static void depotbench_file (int file, char *uri, int size) {
+    snprintf (uri, size, "/depot/bench/group%d/file%d.txt",
+              file / DEPOTBENCH_GROUP, file);
+}
+
+// Build a new, unique, content for one file.
+//
+static int depotbench_content (depotbench_client *client,
+                               int file, const char *origin, int update) {
+    int length = snprintf (client->content, depotbench_size + 1,
+                           "file %d %s %d.%d\n",
+                           file, origin, client->id, update);
+    if (length > depotbench_size) length = depotbench_size;
+    while (length < depotbench_size) {
+        client->content[length] = 'a' + (length % 26);
+        length += 1;
+    }
+    return length;
+}
+
+static int depotbench_tag (int index) {
+    // Spread the tags over the history of the file.
+    if (depotbench_tags <= 0) return 1;
+    int revision = 1 + (index * depotbench_revisions) / depotbench_tags;
+    return (revision > depotbench_revisions) ? depotbench_revisions : revision;
+}
+
+static void *depotbench_populate (void *context) {
+
+    depotbench_client *client = (depotbench_client *)context;
+    char uri[512];
+    char base[256];
+    int file, i;
+
+    for (file = client->first; file < client->last; ++file) {
+        depotbench_file (file, base, sizeof(base));
+        for (i = 1; i <= depotbench_revisions; ++i) {
+            int length = depotbench_content (client, file, "revision", i);
+            int status = depotbench_request (client, "PUT", base,
+                                             client->content, length);
+            if (status != 200) {
+                fprintf (stderr, "depotbench: PUT %s failed (%d)\n",
+                         base, status);
+                client->series[DEPOTBENCH_PUT].errors += 1;
+                break;
+            }
+        }
+        for (i = 0; i < depotbench_tags; ++i) {
+            snprintf (uri, sizeof(uri), "%s?revision=%d&tag=bench%d",
+                      base, depotbench_tag(i), i);
+            int status = depotbench_request (client, "POST", uri, "", 0);
+            if (status != 200) {
+                fprintf (stderr, "depotbench: POST %s failed (%d)\n",
+                         uri, status);
+                client->series[DEPOTBENCH_TAG].errors += 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int depotbench_pick (depotbench_client *client) {
+
+    static int total = 0;
+    if (!total) {
+        int i;
+        for (i = 0; i < DEPOTBENCH_KINDS; ++i) total += depotbench_weights[i];
+    }
+    int value = rand_r (&(client->seed)) % total;
+    int kind;
+    for (kind = 0; kind < DEPOTBENCH_KINDS - 1; ++kind) {
+        if (value < depotbench_weights[kind]) break;
+        value -= depotbench_weights[kind];
+    }
+    return kind;
+}
+
+static void *depotbench_run (void *context) {
+
+    depotbench_client *client = (depotbench_client *)context;
+    char uri[512];
+    char base[256];
+
+    while (depotbench_running) {
+
+        int kind = depotbench_pick (client);
+        int file = rand_r (&(client->seed)) % depotbench_files;
+        int revision = 1 + (rand_r (&(client->seed)) % depotbench_revisions);
+        const char *method = "GET";
+        const char *data = "";
+        int length = 0;
+
+        depotbench_file (file, base, sizeof(base));
+
+        switch (kind) {
+        case DEPOTBENCH_GET:
+            snprintf (uri, sizeof(uri), "%s", base);
+            break;
+        case DEPOTBENCH_REV:
+            snprintf (uri, sizeof(uri), "%s?revision=%d", base, revision);
+            break;
+        case DEPOTBENCH_PUT:
+            method = "PUT";
+            snprintf (uri, sizeof(uri), "%s", base);
+            length = depotbench_content (client, file,
+                                         "update", ++client->updates);
+            data = client->content;
+            break;
+        case DEPOTBENCH_TAG:
+            method = "POST";
+            snprintf (uri, sizeof(uri), "%s?revision=%d&tag=bench%d",
+                      base, revision,
+                      depotbench_tags ? revision % depotbench_tags : 0);
+            break;
+        case DEPOTBENCH_ALL:
+            snprintf (uri, sizeof(uri), "/depot/bench/group%d/all",
+                      file / DEPOTBENCH_GROUP);
+            break;
+        case DEPOTBENCH_HISTORY:
+            snprintf (uri, sizeof(uri), "%s?revision=all", base);
+            break;
+        }
+
+        long long start = depotbench_now ();
+        int status = depotbench_request (client, method, uri, data, length);
+        long long latency = depotbench_now () - start;
+
+        if (!depotbench_running) break; // Do not count an interrupted request.
+        depotbench_record (&(client->series[kind]), latency, status == 200);
+    }
+    return 0;
+}
+
+// Service management. ---------------------------------------------------
+
+static pid_t depotbench_pid = 0;
+
+static int depotbench_start (int argc, const char **argv) {
+
+    char path[1024];
+    snprintf (path, sizeof(path), "%s/bench", depotbench_root);
+    if (mkdir (path, 0755) && errno != EEXIST) {
+        fprintf (stderr, "depotbench: cannot create %s\n", path);
+        return 0;
+    }
+
+    char root[1100];
+    char service[64];
+    snprintf (root, sizeof(root), "-root=%s", depotbench_root);
+    snprintf (service, sizeof(service), "-http-service=%d", depotbench_port);
+
+    const char **args = calloc (argc + 4, sizeof(const char *));
+    int count = 0;
+    args[count++] = depotbench_server;
+    args[count++] = root;
+    args[count++] = service;
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (argv[i]) args[count++] = argv[i];
+    }
+    args[count] = 0;
+
+    depotbench_pid = fork ();
+    if (depotbench_pid < 0) {
+        fprintf (stderr, "depotbench: fork failed\n");
+        return 0;
+    }
+    if (depotbench_pid == 0) {
+        // Keep the service output separate from the report.
+        snprintf (path, sizeof(path), "%s/housedepot.log", depotbench_root);
+        int log = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2 (log, 1);
+            dup2 (log, 2);
+            close (log);
+        }
+        execv (depotbench_server, (char * const *)args);
+        fprintf (stderr, "cannot execute %s: %s\n",
+                 depotbench_server, strerror(errno));
+        _exit (1);
+    }
+    free (args);
+    return 1;
+}
+
+// Wait until the service accepts requests, or gave up.
+//
+static int depotbench_ready (void) {
+
+    depotbench_client probe = {0};
+    probe.socket = -1;
+
+    int i;
+    for (i = 0; i < 200; ++i) {
+        if (depotbench_pid > 0 &&
+            waitpid (depotbench_pid, 0, WNOHANG) == depotbench_pid) {
+            depotbench_pid = 0;
+            fprintf (stderr, "depotbench: %s exited (see %s/housedepot.log)\n",
+                     depotbench_server, depotbench_root);
+            return 0;
+        }
+        if (depotbench_request (&probe, "GET", "/depot/all", "", 0) == 200) {
+            if (probe.socket >= 0) close (probe.socket);
+            return 1;
+        }
+        usleep (50000);
+    }
+    fprintf (stderr, "depotbench: no response on port %d\n", depotbench_port);
+    return 0;
+}
+
+static void depotbench_stop (void) {
+    if (depotbench_pid > 0) {
+        kill (depotbench_pid, SIGTERM);
+        waitpid (depotbench_pid, 0, 0);
+        depotbench_pid = 0;
+    }
+}
+
+static int depotbench_remove (const char *path, const struct stat *s,
+                              int flag, struct FTW *ftw) {
+    remove (path);
+    return 0;
+}
+
+// Report. ---------------------------------------------------------------
+
+static int depotbench_compare (const void *a, const void *b) {
+    long long la = *((const long long *)a);
+    long long lb = *((const long long *)b);
+    return (la > lb) - (la < lb);
+}
+
+static double depotbench_percentile (const depotbench_series *series,
+                                     double percent) {
+    if (series->count <= 0) return 0.0;
+    int index = (int)((series->count * percent) / 100.0 + 0.999999) - 1;
+    if (index < 0) index = 0;
+    if (index >= series->count) index = series->count - 1;
+    return series->samples[index] / 1000.0;
+}
+
+static void depotbench_print (const char *name,
+                              const depotbench_series *series, double seconds) {
+    printf ("%-8s %9d %7d %10.1f %9.3f %9.3f %9.3f\n",
+            name, series->count, series->errors, series->count / seconds,
+            depotbench_percentile (series, 50.0),
+            depotbench_percentile (series, 99.0),
+            depotbench_percentile (series, 99.9));
+}
+
+static void depotbench_merge (depotbench_series *to,
+                              const depotbench_series *from) {
+    int i;
+    for (i = 0; i < from->count; ++i) {
+        depotbench_record (to, from->samples[i], 1);
+    }
+    to->errors += from->errors;
+}
+
+static int depotbench_mix (const char *mix) {
+
+    int weights[DEPOTBENCH_KINDS] = {0};
+    const char *cursor = mix;
+
+    while (*cursor) {
+        int kind;
+        for (kind = 0; kind < DEPOTBENCH_KINDS; ++kind) {
+            int length = strlen(depotbench_names[kind]);
+            if (!strncmp (cursor, depotbench_names[kind], length) &&
+                cursor[length] == ':') {
+                cursor += length + 1;
+                break;
+            }
+        }
+        if (kind >= DEPOTBENCH_KINDS) return 0;
+        weights[kind] = atoi (cursor);
+        if (weights[kind] < 0) return 0;
+        while (*cursor && *cursor != ',') cursor += 1;
+        if (*cursor == ',') cursor += 1;
+    }
+    int total = 0;
+    int i;
+    for (i = 0; i < DEPOTBENCH_KINDS; ++i) total += weights[i];
+    if (total <= 0) return 0;
+    memcpy (depotbench_weights, weights, sizeof(weights));
+    return 1;
+}
+
+int main (int argc, const char **argv) {
+
+    const char *value;
+    int i;
+
+    signal (SIGPIPE, SIG_IGN);
+
+    for (i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (depotbench_option ("-server=", arg, &depotbench_server)) {
+        } else if (depotbench_option ("-root=", arg, &depotbench_root)) {
+        } else if (depotbench_option ("-url=", arg, &depotbench_url)) {
+        } else if (depotbench_option ("-port=", arg, &value)) {
+            depotbench_port = atoi (value);
+        } else if (depotbench_option ("-files=", arg, &value)) {
+            depotbench_files = atoi (value);
+        } else if (depotbench_option ("-revisions=", arg, &value)) {
+            depotbench_revisions = atoi (value);
+        } else if (depotbench_option ("-tags=", arg, &value)) {
+            depotbench_tags = atoi (value);
+        } else if (depotbench_option ("-size=", arg, &value)) {
+            depotbench_size = atoi (value);
+        } else if (depotbench_option ("-clients=", arg, &value)) {
+            depotbench_clients = atoi (value);
+        } else if (depotbench_option ("-duration=", arg, &value)) {
+            depotbench_duration = atoi (value);
+        } else if (depotbench_option ("-mix=", arg, &value)) {
+            if (!depotbench_mix (value)) {
+                fprintf (stderr, "depotbench: invalid mix %s\n", value);
+                return 1;
+            }
+        } else if (!strcmp (arg, "-keep")) {
+            depotbench_keep = 1;
+        } else {
+            continue; // A service option.
+        }
+        argv[i] = 0; // Not passed to the service.
+    }
+    if (depotbench_files <= 0 || depotbench_revisions <= 0 ||
+        depotbench_tags < 0 || depotbench_size < 32 ||
+        depotbench_clients <= 0 || depotbench_duration <= 0) {
+        fprintf (stderr, "depotbench: invalid option value\n");
+        return 1;
+    }
+    if (depotbench_tags > depotbench_revisions)
+        depotbench_tags = depotbench_revisions;
+
+    int temporary = 0;
+    char tmproot[] = "/tmp/depotbench.XXXXXX";
+    if (depotbench_url) {
+        if (!depotbench_resolve (depotbench_url)) return 1;
+    } else {
+        if (!depotbench_root) {
+            depotbench_root = mkdtemp (tmproot);
+            if (!depotbench_root) {
+                fprintf (stderr, "depotbench: cannot create %s\n", tmproot);
+                return 1;
+            }
+            temporary = 1;
+        }
+        char url[64];
+        snprintf (url, sizeof(url), "http://127.0.0.1:%d", depotbench_port);
+        if (!depotbench_resolve (url)) return 1;
+        if (!depotbench_start (argc, argv)) return 1;
+    }
+    int status = 1;
+    if (!depotbench_ready ()) goto cleanup;
+
+    depotbench_client *clients =
+        calloc (depotbench_clients, sizeof(depotbench_client));
+    pthread_t *threads = calloc (depotbench_clients, sizeof(pthread_t));
+
+    int workers = depotbench_clients;
+    if (workers > depotbench_files) workers = depotbench_files;
+    for (i = 0; i < depotbench_clients; ++i) {
+        clients[i].id = i;
+        clients[i].socket = -1;
+        clients[i].seed = 12345 + i;
+        clients[i].content = malloc (depotbench_size + 1);
+        if (i < workers) {
+            clients[i].first = (depotbench_files * i) / workers;
+            clients[i].last = (depotbench_files * (i + 1)) / workers;
+        }
+    }
+
+    printf ("depotbench: %d files, %d revisions, %d tags, %d bytes, "
+            "%d clients, %d seconds\n",
+            depotbench_files, depotbench_revisions, depotbench_tags,
+            depotbench_size, depotbench_clients, depotbench_duration);
+
+    // Build the synthetic repository.
+    long long start = depotbench_now ();
+    for (i = 0; i < workers; ++i) {
+        pthread_create (&threads[i], 0, depotbench_populate, &clients[i]);
+    }
+    for (i = 0; i < workers; ++i) pthread_join (threads[i], 0);
+    long long elapsed = depotbench_now () - start;
+    int failed = 0;
+    for (i = 0; i < workers; ++i) {
+        failed += clients[i].series[DEPOTBENCH_PUT].errors
+                      + clients[i].series[DEPOTBENCH_TAG].errors;
+        memset (clients[i].series, 0, sizeof(clients[i].series));
+    }
+    int checkins = depotbench_files * depotbench_revisions;
+    printf ("populate: %d checkins and %d tags in %lld ms (%d failed)\n",
+            checkins, depotbench_files * depotbench_tags,
+            elapsed / 1000, failed);
+    if (failed) goto cleanup;
+
+    // Measure.
+    depotbench_running = 1;
+    start = depotbench_now ();
+    for (i = 0; i < depotbench_clients; ++i) {
+        pthread_create (&threads[i], 0, depotbench_run, &clients[i]);
+    }
+    sleep (depotbench_duration);
+    depotbench_running = 0;
+    elapsed = depotbench_now () - start;
+    for (i = 0; i < depotbench_clients; ++i) pthread_join (threads[i], 0);
+
+    double seconds = elapsed / 1000000.0;
+    depotbench_series total = {0};
+    printf ("%-8s %9s %7s %10s %9s %9s %9s\n",
+            "request", "count", "errors", "per sec",
+            "p50 ms", "p99 ms", "p999 ms");
+    int kind;
+    for (kind = 0; kind < DEPOTBENCH_KINDS; ++kind) {
+        if (!depotbench_weights[kind]) continue;
+        depotbench_series merged = {0};
+        for (i = 0; i < depotbench_clients; ++i) {
+            depotbench_merge (&merged, &(clients[i].series[kind]));
+        }
+        depotbench_merge (&total, &merged);
+        qsort (merged.samples, merged.count, sizeof(long long),
+               depotbench_compare);
+        depotbench_print (depotbench_names[kind], &merged, seconds);
+        free (merged.samples);
+    }
+    qsort (total.samples, total.count, sizeof(long long), depotbench_compare);
+    depotbench_print ("total", &total, seconds);
+    status = total.errors ? 1 : 0;
+
+cleanup:
+    depotbench_stop ();
+    if (temporary) {
+        if (depotbench_keep) {
+            printf ("depotbench: repository kept in %s\n", depotbench_root);
+        } else {
+            nftw (depotbench_root, depotbench_remove, 16, FTW_DEPTH|FTW_PHYS);
+        }
+    }
+    return status;
+}
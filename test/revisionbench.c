@@ -0,0 +1,630 @@
+/* HouseDepot - a log and ressource file storage service.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * revisionbench.c - Measure the revision module without HTTP.
+ *
+ * DESCRIPTION
+ *
+ * This program links with the HouseDepot storage library (libhousedepot.a)
+ * and calls the revision functions directly, so that the cost of the
+ * storage layer (index, directory scans, links, revision files) is
+ * measured without the cost of the HTTP requests.
+ *
+ * For each combination of file count and history length, a synthetic
+ * repository is generated using checkins and tags, and then each
+ * operation is measured on randomly selected files:
+ *
+ *   generate     one checkin or tag while generating the repository.
+ *   checkout     checkout of the current revision.
+ *   checkout-rev checkout of a specific revision number.
+ *   checkout-tag checkout of a user tag.
+ *   history      history of one file.
+ *   list         list of one group (the index is already loaded).
+ *   scan         list of one group after its index was dropped, i.e.
+ *                the group directory is scanned again.
+ *   reload       list of all groups after the whole index was dropped,
+ *                the same as after a restart without manifests.
+ *   checkin      checkin of a new revision.
+ *   delete       delete of one revision in the middle of the history.
+ *   prune        prune of the older half of the history.
+ *
+ * The storage jobs are executed immediately (-workers=0), so that their
+ * cost is included in the operation that caused them.
+ *
+ * The repositories are named after their size, e.g. "bench-100x20" for 100
+ * files with 20 revisions each, and contain groups of up to 100 files.
+ * A repository that already exists in the root directory is reused as is,
+ * so that a large repository can be generated once, using -root.
+ * The bench uses random files from a fixed seed, so that two runs
+ * perform the same sequences of operations.
+ *
+ * SYNOPSYS
+ *
+ * revisionbench [-root=PATH] [-files=N,..] [-revisions=N,..] [-tags=N]
+ *               [-size=N] [-iterations=N] [-storage=METHOD] [-keep]
+ *               [options..]
+ *
+ *   -root:       the directory where the repositories are generated. The
+ *                default is a new temporary directory, removed at the end
+ *                unless -keep.
+ *   -files:      a list of file counts (default: 100,1000).
+ *   -revisions:  a list of history lengths (default: 10,100).
+ *   -tags:       the number of tags on each file (default: 5).
+ *   -size:       the size of each revision, in bytes (default: 256).
+ *   -iterations: the number of times each operation is measured
+ *                (default: 1000).
+ *   -storage:    the storage method for the repositories (default: copy).
+ *
+ * All other options are passed to the HouseDepot modules, e.g. -uring,
+ * -no-manifest or -cache=0.
+ *
+ * A file history must remain smaller than 64 KB, about 2000 revisions:
+ * larger responses would be sent as a file transfer by echttp.
+ */
+
+#define _GNU_SOURCE // For nftw().
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "houselog.h"
+
+#include "housedepot_cache.h"
+#include "housedepot_index.h"
+#include "housedepot_manifest.h"
+#include "housedepot_retention.h"
+#include "housedepot_revision.h"
+#include "housedepot_storage.h"
+#include "housedepot_uring.h"
+#include "housedepot_worker.h"
+
+#define REVISIONBENCH_GROUP 100 // Files per group directory.
+#define REVISIONBENCH_RELOADS 3
+#define REVISIONBENCH_MAX 16
+
+static const char *revisionbench_root = 0;
+static int revisionbench_files[REVISIONBENCH_MAX] = {100, 1000};
+static int revisionbench_filecount = 2;
+static int revisionbench_revisions[REVISIONBENCH_MAX] = {10, 100};
+static int revisionbench_revisioncount = 2;
+static int revisionbench_tags = 5;
+static int revisionbench_size = 256;
+static int revisionbench_iterations = 1000;
+static const char *revisionbench_storage = 0;
+static int revisionbench_keep = 0;
+
+static char *revisionbench_content = 0;
+static unsigned int revisionbench_seed = 12345;
+
+typedef struct {
+    long long *samples; // Nanoseconds.
+    int count;
+    int size;
+    int errors;
+} revisionbench_series;
+
+// The repository being measured.
+static char revisionbench_path[512];
+static char revisionbench_uri[256];
+static int revisionbench_filetotal;
+static int revisionbench_depth;
+
+static long long revisionbench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static int revisionbench_option (const char *name,
+                                 const char *arg, const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, name, length)) return 0;
+    *value = arg + length;
+    return 1;
+}
+
+static int revisionbench_list (const char *value, int *list) {
+    int count = 0;
+    while (*value && count < REVISIONBENCH_MAX) {
+        list[count] = atoi (value);
+        if (list[count] <= 0) return 0;
+        count += 1;
+        value = strchr (value, ',');
+        if (!value) break;
+        value += 1;
+    }
+    return count;
+}
+
+static void revisionbench_record (revisionbench_series *series,
+                                  long long start, int ok) {
+    long long elapsed = revisionbench_now () - start;
+    if (!ok) {
+        series->errors += 1;
+        return;
+    }
+    if (series->count >= series->size) {
+        series->size = series->size ? series->size * 2 : 4096;
+        series->samples =
+            realloc (series->samples, series->size * sizeof(long long));
+        if (!series->samples) {
+            fprintf (stderr, "revisionbench: out of memory\n");
+            exit (1);
+        }
+    }
+    series->samples[series->count++] = elapsed;
+}
+
+static int revisionbench_compare (const void *a, const void *b) {
+    long long la = *((const long long *)a);
+    long long lb = *((const long long *)b);
+    return (la > lb) - (la < lb);
+}
+
+static double revisionbench_percentile (const revisionbench_series *series,
+                                        double percent) {
+    if (series->count <= 0) return 0.0;
+    int index = (int)((series->count * percent) / 100.0 + 0.999999) - 1;
+    if (index < 0) index = 0;
+    if (index >= series->count) index = series->count - 1;
+    return series->samples[index] / 1000.0;
+}
+
+static void revisionbench_report (const char *name,
+                                  revisionbench_series *series) {
+
+    long long total = 0;
+    int i;
+    for (i = 0; i < series->count; ++i) total += series->samples[i];
+    qsort (series->samples, series->count, sizeof(long long),
+           revisionbench_compare);
+
+    printf ("%6d %5d %-12s %8d %6d %10.1f %10.1f %10.1f\n",
+            revisionbench_filetotal, revisionbench_depth, name,
+            series->count, series->errors,
+            series->count ? (total / 1000.0) / series->count : 0.0,
+            revisionbench_percentile (series, 50.0),
+            revisionbench_percentile (series, 99.0));
+    fflush (stdout);
+
+    free (series->samples);
+    memset (series, 0, sizeof(*series));
+}
+
+// The synthetic repository. ---------------------------------------------
+
+static void revisionbench_file (int file, char *filename, int filesize,
+                                char *clientname, int clientsize) {
+    snprintf (filename, filesize, "%s/group%d/file%d.txt",
+              revisionbench_path, file / REVISIONBENCH_GROUP, file);
+    snprintf (clientname, clientsize, "%s/group%d/file%d.txt",
+              revisionbench_uri, file / REVISIONBENCH_GROUP, file);
+}
+
+static void revisionbench_group (int group, char *path, int size) {
+    snprintf (path, size, "%s/group%d", revisionbench_path, group);
+}
+
+// Build a new, unique, content for one file.
+//
+static int revisionbench_data (int file, const char *origin, int update) {
+    int length = snprintf (revisionbench_content, revisionbench_size + 1,
+                           "file %d %s %d\n", file, origin, update);
+    if (length > revisionbench_size) length = revisionbench_size;
+    while (length < revisionbench_size) {
+        revisionbench_content[length] = 'a' + (length % 26);
+        length += 1;
+    }
+    return length;
+}
+
+static int revisionbench_tag (int index) {
+    // Spread the tags over the history of the file.
+    int revision = 1 + (index * revisionbench_depth) / revisionbench_tags;
+    return (revision > revisionbench_depth) ? revisionbench_depth : revision;
+}
+
+static int revisionbench_random (int range) {
+    return rand_r (&revisionbench_seed) % range;
+}
+
+static int revisionbench_generate (void) {
+
+    char filename[1024];
+    char clientname[512];
+    char path[1100];
+    char tag[32];
+    char revision[32];
+    revisionbench_series series = {0};
+    int file, i;
+
+    int groups = (revisionbench_filetotal + REVISIONBENCH_GROUP - 1)
+                     / REVISIONBENCH_GROUP;
+    for (i = 0; i < groups; ++i) {
+        revisionbench_group (i, path, sizeof(path));
+        if (mkdir (path, 0755) && errno != EEXIST) {
+            fprintf (stderr, "revisionbench: cannot create %s\n", path);
+            return 0;
+        }
+    }
+
+    // The revisions are dated one minute apart, ending now.
+    time_t timestamp = time(0) - (60 * revisionbench_depth);
+
+    for (file = 0; file < revisionbench_filetotal; ++file) {
+        revisionbench_file (file, filename, sizeof(filename),
+                            clientname, sizeof(clientname));
+        for (i = 1; i <= revisionbench_depth; ++i) {
+            int length = revisionbench_data (file, "revision", i);
+            long long start = revisionbench_now ();
+            const char *error =
+                housedepot_revision_checkin (clientname, filename,
+                                             timestamp + (60 * i),
+                                             revisionbench_content, length);
+            revisionbench_record (&series, start, !error);
+            if (error) {
+                fprintf (stderr, "revisionbench: checkin %s failed: %s\n",
+                         filename, error);
+                return 0;
+            }
+        }
+        for (i = 0; i < revisionbench_tags; ++i) {
+            snprintf (tag, sizeof(tag), "bench%d", i);
+            snprintf (revision, sizeof(revision), "%d", revisionbench_tag(i));
+            long long start = revisionbench_now ();
+            const char *error = housedepot_revision_apply (tag, clientname,
+                                                           filename, revision);
+            revisionbench_record (&series, start, !error);
+        }
+    }
+    revisionbench_report ("generate", &series);
+    return 1;
+}
+
+// The measurements. -----------------------------------------------------
+
+static void revisionbench_checkout (const char *name, int kind) {
+
+    char filename[1024];
+    char clientname[512];
+    char revision[32];
+    revisionbench_series series = {0};
+    int i;
+
+    for (i = 0; i < revisionbench_iterations; ++i) {
+        int file = revisionbench_random (revisionbench_filetotal);
+        revisionbench_file (file, filename, sizeof(filename),
+                            clientname, sizeof(clientname));
+        switch (kind) {
+        case 0:
+            snprintf (revision, sizeof(revision), "current");
+            break;
+        case 1:
+            snprintf (revision, sizeof(revision), "%d",
+                      1 + revisionbench_random (revisionbench_depth));
+            break;
+        default:
+            snprintf (revision, sizeof(revision), "bench%d",
+                      revisionbench_random (revisionbench_tags));
+            break;
+        }
+        long long start = revisionbench_now ();
+        int fd = housedepot_revision_checkout (filename, revision, 0);
+        revisionbench_record (&series, start, fd >= 0);
+        if (fd >= 0) close (fd);
+    }
+    revisionbench_report (name, &series);
+}
+
+static void revisionbench_history (void) {
+
+    char filename[1024];
+    char clientname[512];
+    revisionbench_series series = {0};
+    int i;
+
+    for (i = 0; i < revisionbench_iterations; ++i) {
+        int file = revisionbench_random (revisionbench_filetotal);
+        revisionbench_file (file, filename, sizeof(filename),
+                            clientname, sizeof(clientname));
+        long long start = revisionbench_now ();
+        const char *history =
+            housedepot_revision_history (clientname, filename);
+        revisionbench_record (&series, start, history && history[0]);
+    }
+    revisionbench_report ("history", &series);
+}
+
+static void revisionbench_listing (const char *name, int scan) {
+
+    char path[1100];
+    char uri[512];
+    revisionbench_series series = {0};
+    int i;
+
+    int groups = (revisionbench_filetotal + REVISIONBENCH_GROUP - 1)
+                     / REVISIONBENCH_GROUP;
+    for (i = 0; i < revisionbench_iterations; ++i) {
+        int group = revisionbench_random (groups);
+        revisionbench_group (group, path, sizeof(path));
+        snprintf (uri, sizeof(uri), "%s/group%d", revisionbench_uri, group);
+        long long start = revisionbench_now ();
+        if (scan) housedepot_index_invalidate (path);
+        const char *list = housedepot_revision_list (uri, path);
+        revisionbench_record (&series, start, list && list[0]);
+    }
+    revisionbench_report (name, &series);
+}
+
+static void revisionbench_reload (void) {
+
+    char path[1100];
+    char uri[512];
+    revisionbench_series series = {0};
+    int i, group;
+
+    int groups = (revisionbench_filetotal + REVISIONBENCH_GROUP - 1)
+                     / REVISIONBENCH_GROUP;
+    for (i = 0; i < REVISIONBENCH_RELOADS; ++i) {
+        long long start = revisionbench_now ();
+        housedepot_index_invalidate (0);
+        int ok = 1;
+        for (group = 0; group < groups; ++group) {
+            revisionbench_group (group, path, sizeof(path));
+            snprintf (uri, sizeof(uri), "%s/group%d", revisionbench_uri, group);
+            const char *list = housedepot_revision_list (uri, path);
+            if (!list || !list[0]) ok = 0;
+        }
+        revisionbench_record (&series, start, ok);
+    }
+    revisionbench_report ("reload", &series);
+}
+
+static void revisionbench_checkin (void) {
+
+    char filename[1024];
+    char clientname[512];
+    revisionbench_series series = {0};
+    int i;
+
+    for (i = 0; i < revisionbench_iterations; ++i) {
+        int file = revisionbench_random (revisionbench_filetotal);
+        revisionbench_file (file, filename, sizeof(filename),
+                            clientname, sizeof(clientname));
+        int length = revisionbench_data (file, "update", i);
+        long long start = revisionbench_now ();
+        const char *error =
+            housedepot_revision_checkin (clientname, filename, 0,
+                                         revisionbench_content, length);
+        revisionbench_record (&series, start, !error);
+    }
+    revisionbench_report ("checkin", &series);
+}
+
+// Delete and prune change the history of the files: each file is used
+// only once, the first half for delete and the second half for prune.
+//
+static void revisionbench_delete (void) {
+
+    char filename[1024];
+    char clientname[512];
+    char revision[32];
+    revisionbench_series series = {0};
+    int file;
+
+    if (revisionbench_depth < 3) return; // Nothing that can be deleted.
+
+    int count = revisionbench_filetotal / 2;
+    if (count > revisionbench_iterations) count = revisionbench_iterations;
+
+    snprintf (revision, sizeof(revision), "%d", revisionbench_depth / 2);
+    for (file = 0; file < count; ++file) {
+        revisionbench_file (file, filename, sizeof(filename),
+                            clientname, sizeof(clientname));
+        long long start = revisionbench_now ();
+        const char *error =
+            housedepot_revision_delete (clientname, filename, revision);
+        revisionbench_record (&series, start, !error);
+    }
+    revisionbench_report ("delete", &series);
+}
+
+static void revisionbench_prune (void) {
+
+    char filename[1024];
+    char clientname[512];
+    revisionbench_series series = {0};
+    int file;
+
+    if (revisionbench_depth < 3) return; // Nothing that can be pruned.
+
+    int first = revisionbench_filetotal / 2;
+    int count = revisionbench_filetotal - first;
+    if (count > revisionbench_iterations) count = revisionbench_iterations;
+
+    for (file = first; file < first + count; ++file) {
+        revisionbench_file (file, filename, sizeof(filename),
+                            clientname, sizeof(clientname));
+        long long start = revisionbench_now ();
+        int pruned = housedepot_revision_prune (clientname, filename,
+                                                revisionbench_depth / 2);
+        revisionbench_record (&series, start, pruned > 0);
+    }
+    revisionbench_report ("prune", &series);
+}
+
+static int revisionbench_run (int files, int depth) {
+
+    revisionbench_filetotal = files;
+    revisionbench_depth = depth;
+    revisionbench_seed = 12345;
+
+    snprintf (revisionbench_uri, sizeof(revisionbench_uri),
+              "/bench-%dx%d", files, depth);
+    snprintf (revisionbench_path, sizeof(revisionbench_path),
+              "%s%s", revisionbench_root, revisionbench_uri);
+
+    struct stat info;
+    int reuse = (stat (revisionbench_path, &info) == 0);
+    if (!reuse && mkdir (revisionbench_path, 0755)) {
+        fprintf (stderr, "revisionbench: cannot create %s\n",
+                 revisionbench_path);
+        return 0;
+    }
+    housedepot_index_open (revisionbench_path);
+    if (revisionbench_storage) {
+        housedepot_storage_option (revisionbench_path,
+                                   "storage", revisionbench_storage);
+    }
+
+    if (reuse) {
+        revisionbench_reload (); // Load the existing repository first.
+    } else {
+        if (!revisionbench_generate ()) return 0;
+    }
+
+    revisionbench_checkout ("checkout", 0);
+    revisionbench_checkout ("checkout-rev", 1);
+    if (revisionbench_tags > 0) revisionbench_checkout ("checkout-tag", 2);
+    revisionbench_history ();
+    revisionbench_listing ("list", 0);
+    revisionbench_listing ("scan", 1);
+    if (!reuse) revisionbench_reload ();
+
+    // The operations below modify the repository.
+    revisionbench_checkin ();
+    revisionbench_delete ();
+    revisionbench_prune ();
+
+    // Do not keep the whole index of all repositories in memory.
+    housedepot_index_invalidate (0);
+    return 1;
+}
+
+static int revisionbench_remove (const char *path, const struct stat *s,
+                                 int flag, struct FTW *ftw) {
+    remove (path);
+    return 0;
+}
+
+int main (int argc, const char **argv) {
+
+    const char *value;
+    int i, f, r;
+
+    // The module options are passed as is, with -workers=0 added last
+    // so that all the storage jobs run synchronously.
+    const char **args = calloc (argc + 2, sizeof(const char *));
+    int count = 0;
+    args[count++] = argv[0];
+
+    for (i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (revisionbench_option ("-root=", arg, &revisionbench_root)) {
+        } else if (revisionbench_option ("-files=", arg, &value)) {
+            revisionbench_filecount =
+                revisionbench_list (value, revisionbench_files);
+        } else if (revisionbench_option ("-revisions=", arg, &value)) {
+            revisionbench_revisioncount =
+                revisionbench_list (value, revisionbench_revisions);
+        } else if (revisionbench_option ("-tags=", arg, &value)) {
+            revisionbench_tags = atoi (value);
+        } else if (revisionbench_option ("-size=", arg, &value)) {
+            revisionbench_size = atoi (value);
+        } else if (revisionbench_option ("-iterations=", arg, &value)) {
+            revisionbench_iterations = atoi (value);
+        } else if (revisionbench_option ("-storage=", arg,
+                                         &revisionbench_storage)) {
+        } else if (!strcmp (arg, "-keep")) {
+            revisionbench_keep = 1;
+        } else {
+            args[count++] = arg;
+        }
+    }
+    args[count++] = "-workers=0";
+    args[count] = 0;
+
+    if (revisionbench_filecount <= 0 || revisionbench_revisioncount <= 0 ||
+        revisionbench_tags < 0 || revisionbench_size < 32 ||
+        revisionbench_iterations <= 0) {
+        fprintf (stderr, "revisionbench: invalid option value\n");
+        return 1;
+    }
+
+    int temporary = 0;
+    char tmproot[] = "/tmp/revisionbench.XXXXXX";
+    if (!revisionbench_root) {
+        revisionbench_root = mkdtemp (tmproot);
+        if (!revisionbench_root) {
+            fprintf (stderr, "revisionbench: cannot create %s\n", tmproot);
+            return 1;
+        }
+        temporary = 1;
+    }
+    revisionbench_content = malloc (revisionbench_size + 1);
+
+    houselog_initialize ("depot", count, args);
+    housedepot_worker_initialize (count, args);
+    housedepot_uring_initialize (count, args);
+    housedepot_cache_initialize (count, args);
+    housedepot_manifest_initialize (count, args);
+    housedepot_retention_initialize (count, args);
+    housedepot_revision_initialize ("localhost", 0, count, args);
+
+    printf ("revisionbench: %d tags, %d bytes, %d iterations, storage %s\n",
+            revisionbench_tags, revisionbench_size, revisionbench_iterations,
+            revisionbench_storage ? revisionbench_storage : "copy");
+    printf ("%6s %5s %-12s %8s %6s %10s %10s %10s\n",
+            "files", "revs", "operation", "count", "errors",
+            "avg us", "p50 us", "p99 us");
+
+    int status = 0;
+    for (f = 0; f < revisionbench_filecount; ++f) {
+        for (r = 0; r < revisionbench_revisioncount; ++r) {
+            int depth = revisionbench_revisions[r];
+            if (revisionbench_tags > depth) {
+                fprintf (stderr, "revisionbench: more tags than revisions\n");
+                status = 1;
+                continue;
+            }
+            if (!revisionbench_run (revisionbench_files[f], depth)) status = 1;
+        }
+    }
+
+    if (temporary) {
+        if (revisionbench_keep) {
+            printf ("revisionbench: repositories kept in %s\n",
+                    revisionbench_root);
+        } else {
+            nftw (revisionbench_root,
+                  revisionbench_remove, 16, FTW_DEPTH|FTW_PHYS);
+        }
+    }
+    return status;
+}